@@ -0,0 +1,314 @@
+/*
+Copyright (c) 2014 - 2020, Jan-Willem Smaal <usenet@gispen.org>
+SPDX-License-Identifier: Apache-2.0
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+
+You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied.
+
+See the License for the specific language governing permissions and limitations under the License.
+*/
+
+/** SerialMidi benchmark
+ * Runs the parser and the TX encoders over synthetic streams and prints
+ * bytes/second and ns/message.  Run it before and after a change.
+ *
+ * Host:   cd bench && make run     (builds with -DSERIAL_MIDI_HOST)
+ * Target: add this file to an mbed OS application, timing then uses
+ *         the DWT cycle counter and the result goes to the console.
+ *
+ * The parser is fed through Parse() so no UART is involved.  The TX
+ * benchmarks encode into the batched TX block, the Flush() that hands
+ * a block to the UART is not timed (on target that is wire bound).
+ */
+#include "serial-midi.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#define BENCH_STREAM_SIZE  4096    // Bytes per synthetic stream
+#define BENCH_RX_BYTES     (8u * 1024 * 1024)  // Bytes parsed per RX run
+#define BENCH_TX_MESSAGES  (1u * 1024 * 1024)  // Messages per TX run
+
+#ifdef SERIAL_MIDI_HOST
+#include <chrono>
+#define BENCH_RX_SCALE 1
+static void BenchTimerInit(void) {}
+static inline uint64_t BenchNowNs(void)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#else
+/* Target runs are shorter, assume a Cortex-M4/M7 core */
+#define BENCH_RX_SCALE 64
+static uint64_t bench_cycles;
+static uint32_t bench_last;
+static void BenchTimerInit(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	bench_cycles = 0;
+	bench_last = DWT->CYCCNT;
+}
+static inline uint64_t BenchNowNs(void)
+{
+	// Extend the 32 bit counter, called often enough not to miss a wrap
+	uint32_t now = DWT->CYCCNT;
+	bench_cycles += (uint32_t)(now - bench_last);
+	bench_last = now;
+	return bench_cycles * 1000 / (SystemCoreClock / 1000000);
+}
+#endif
+
+
+/*-----------------------------------------------------------------------*/
+/** Synthetic streams
+ */
+static uint8_t stream[BENCH_STREAM_SIZE];
+
+/* Note on/off pairs on one channel, all running status */
+static size_t StreamDenseNotes(void)
+{
+	size_t n = 0;
+	stream[n++] = C_NOTE_ON;
+	while(n + 2 <= sizeof(stream)) {
+		stream[n] = (uint8_t)(36 + (n % 48));
+		stream[n + 1] = (n & 2) ? 0 : 100;     // velocity 0 = off
+		n += 2;
+	}
+	return n;
+}
+
+/* Control changes rotating over channels, a status byte every message */
+static size_t StreamCcFlood(void)
+{
+	size_t n = 0;
+	for(uint8_t i = 0; n + 3 <= sizeof(stream); i++) {
+		stream[n++] = C_CONTROL_CHANGE | (i & 0x0F);
+		stream[n++] = i & MIDI_DATA;
+		stream[n++] = (uint8_t)(i * 3) & MIDI_DATA;
+	}
+	return n;
+}
+
+/* Notes on two channels with a timing clock every 7 bytes, mostly in
+ * the middle of a message */
+static size_t StreamClockInterleaved(void)
+{
+	size_t n = 0;
+	for(uint8_t i = 0; n + 4 <= sizeof(stream); i++) {
+		stream[n++] = C_NOTE_ON | (i & 1);
+		stream[n++] = (uint8_t)(48 + (i % 24));
+		if((n % 7) < 2) {
+			stream[n++] = RT_TIMING_CLOCK;
+		}
+		stream[n++] = (i & 2) ? 0 : 90;
+	}
+	return n;
+}
+
+/* SysEx dumps of 256 data bytes */
+static size_t StreamSysExDump(void)
+{
+	size_t n = 0;
+	while(n + 258 <= sizeof(stream)) {
+		stream[n++] = SYSTEM_EXCLUSIVE_START;
+		for(int i = 0; i < 256; i++) {
+			stream[n++] = (uint8_t)(i & MIDI_DATA);
+		}
+		stream[n++] = SYSTEM_EXCLUSIVE_END;
+	}
+	return n;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** Receivers
+ */
+static volatile uint32_t sink;
+
+void midi_note_on_handler(uint8_t note, uint8_t velocity) { sink += note + velocity; }
+void midi_note_off_handler(uint8_t note, uint8_t velocity) { sink += note + velocity; }
+void midi_control_change_handler(uint8_t controller, uint8_t value) { sink += controller + value; }
+void midi_pitchwheel_handler(uint8_t valueLSB, uint8_t valueMSB) { sink += valueLSB + valueMSB; }
+void realtime_handler(uint8_t msg) { sink += msg; }
+static void sysex_handler(const uint8_t *data, size_t len, uint8_t flags)
+{
+	(void)data;
+	sink += len + flags;
+}
+
+struct BenchHandler {
+	void NoteOn(uint8_t, uint8_t note, uint8_t velocity) { sink += note + velocity; }
+	void NoteOff(uint8_t, uint8_t note, uint8_t velocity) { sink += note + velocity; }
+	void ControlChange(uint8_t, uint8_t controller, uint8_t value) { sink += controller + value; }
+	void Realtime(uint8_t msg) { sink += msg; }
+	void SysEx(const uint8_t *, size_t len, uint8_t flags) { sink += len + flags; }
+};
+
+
+static void Report(const char *name, uint64_t bytes, uint64_t messages,
+		uint64_t ns)
+{
+	if(ns == 0) {
+		ns = 1;
+	}
+	uint64_t kb_per_s = bytes * 1000000000ull / ns / 1024;
+	uint64_t ns_x10 = messages ? (ns * 10 / messages) : 0;
+	printf("%-26s %10llu kB/s %8llu.%llu ns/msg\n", name,
+		(unsigned long long)kb_per_s,
+		(unsigned long long)(ns_x10 / 10), (unsigned long long)(ns_x10 % 10));
+}
+
+template<class Midi>
+static void BenchParse(const char *name, Midi &midi, size_t len)
+{
+	uint32_t runs = BENCH_RX_BYTES / BENCH_RX_SCALE / len;
+	uint64_t messages = 0;
+	uint64_t start = BenchNowNs();
+	for(uint32_t r = 0; r < runs; r++) {
+		messages += midi.Parse(stream, len);
+	}
+	Report(name, (uint64_t)runs * len, messages, BenchNowNs() - start);
+}
+
+
+/* Replays a recorded trace (16 byte blocks, 5 ms apart) at full speed, 
+ * includes the trace decoding */
+static uint8_t trace_ring[BENCH_STREAM_SIZE * 2];
+static uint8_t trace[BENCH_STREAM_SIZE * 2];
+
+template<class Midi>
+static void BenchReplay(const char *name, Midi &midi, size_t len)
+{
+	MidiTraceRecorder recorder(trace_ring, sizeof(trace_ring));
+	for(size_t i = 0; i < len; i += 16) {
+		recorder.Record(&stream[i], (len - i < 16) ? len - i : 16, 
+				(uint32_t)(i / 16) * 5000);
+	}
+	size_t trace_len = recorder.Read(trace, sizeof(trace));
+
+	MidiTracePlayer player(trace, trace_len, 0);
+	uint32_t runs = BENCH_RX_BYTES / BENCH_RX_SCALE / len;
+	uint64_t messages = 0;
+	uint64_t start = BenchNowNs();
+	for(uint32_t r = 0; r < runs; r++) {
+		player.Rewind();
+		messages += player.Run(midi);
+	}
+	Report(name, (uint64_t)runs * len, messages, BenchNowNs() - start);
+}
+
+
+/** Access to the host wire for counting the encoded bytes 
+ */
+class BenchMidi : public SerialMidi {
+public:
+	using SerialMidi::SerialMidi;
+	uint64_t WireBytes(void) {
+#ifdef SERIAL_MIDI_HOST
+		return serial_port.host_tx_bytes;
+#else
+		return 0;
+#endif
+	}
+};
+
+
+/*-----------------------------------------------------------------------*/
+/** Transmitters, messages per batch so a Flush() never happens while
+ * the timer runs
+ */
+#define BENCH_TX_BATCH (MIDI_TX_BUFFER_SIZE / 3)
+
+enum BenchTx { TX_NOTES, TX_NOTES_OPTIMIZED, TX_CC_FLOOD, TX_CC_CACHED };
+
+static void BenchEncode(const char *name, BenchMidi &midi, BenchTx kind)
+{
+	uint32_t batches = BENCH_TX_MESSAGES / BENCH_RX_SCALE / BENCH_TX_BATCH;
+	uint64_t ns = 0;
+	uint32_t k = 0;
+
+	midi.BatchedTx(true);
+	midi.OptimizeTx(kind == TX_NOTES_OPTIMIZED);
+	midi.ControllerCache(kind == TX_CC_CACHED);
+	uint64_t wire = midi.WireBytes();
+	for(uint32_t b = 0; b < batches; b++) {
+		uint64_t start = BenchNowNs();
+		for(uint32_t i = 0; i < BENCH_TX_BATCH; i++, k++) {
+			switch(kind) {
+			case TX_NOTES:
+			case TX_NOTES_OPTIMIZED:
+				if(k & 1) {
+					midi.NoteOFF(0, 36 + (k % 48), 64);
+				}
+				else {
+					midi.NoteON(0, 36 + (k % 48), 100);
+				}
+				break;
+			case TX_CC_FLOOD:
+			case TX_CC_CACHED:
+				// Knob scan, most values repeat
+				midi.ControlChange(k & 0x0F, 7, (k >> 6) & MIDI_DATA);
+				break;
+			}
+		}
+		ns += BenchNowNs() - start;
+		midi.Flush();
+	}
+	midi.BatchedTx(false);
+	midi.OptimizeTx(false);
+	midi.ControllerCache(false);
+
+	uint64_t messages = (uint64_t)batches * BENCH_TX_BATCH;
+	wire = midi.WireBytes() - wire;
+	// Encoded bytes that reached the wire, on target (not counted) 
+	// assume 3 per message 
+	Report(name, wire ? wire : messages * 3, messages, ns);
+}
+
+
+int main(void)
+{
+	BenchMidi delegates(
+		&midi_note_on_handler,
+		&realtime_handler,
+		&midi_note_off_handler,
+		&midi_control_change_handler,
+		&midi_pitchwheel_handler
+	);
+	BenchHandler handler;
+	SerialMidiT<BenchHandler> templated(handler);
+	size_t len;
+
+	BenchTimerInit();
+	delegates.SetSysExHandler(&sysex_handler);
+	printf("SerialMidi benchmark, %u byte streams\n", BENCH_STREAM_SIZE);
+
+	len = StreamDenseNotes();
+	BenchParse("rx dense notes delegates", delegates, len);
+	BenchParse("rx dense notes template", templated, len);
+	len = StreamCcFlood();
+	BenchParse("rx cc flood", delegates, len);
+	len = StreamClockInterleaved();
+	BenchParse("rx clock interleaved", delegates, len);
+	BenchReplay("rx trace replay", delegates, len);
+	len = StreamSysExDump();
+	BenchParse("rx sysex dump", delegates, len);
+	BenchParse("rx sysex dump template", templated, len);
+
+	BenchEncode("tx notes", delegates, TX_NOTES);
+	BenchEncode("tx notes optimized", delegates, TX_NOTES_OPTIMIZED);
+	BenchEncode("tx cc flood", delegates, TX_CC_FLOOD);
+	BenchEncode("tx cc flood cached", delegates, TX_CC_CACHED);
+
+	printf("done (%lu)\n", (unsigned long)sink);
+	return 0;
+}
@@ -0,0 +1,85 @@
+/** MIDI route stages, see midi-route.h.
+ *
+ *  Copyright (c) 2014 Jan-Willem Smaal. All rights reserved.
+ */
+#include "midi-route.h"
+#include <cstdint>
+
+
+/*-----------------------------------------------------------------------*/
+
+/**
+ * Bit of a message type in a MIDI_ROUTE_* mask.
+ */
+uint16_t MidiRouteStage::TypeBit(uint8_t status)
+{
+	if(status < 0xF0) {
+		return (uint16_t)(1u << ((status >> 4) - 8));
+	}
+	if(status >= 0xF8) {
+		return MIDI_ROUTE_REALTIME;
+	}
+	if(status == MIDI_CC14 || status == MIDI_PARAMETER) {
+		return MIDI_ROUTE_PARAMETER;
+	}
+	return MIDI_ROUTE_SYSTEM;
+}
+
+
+/**
+ * Runs count stages over ev, false when a stage dropped it.
+ */
+bool MidiRouteStage::Apply(const MidiRouteStage *stages, size_t count,
+		MidiEvent &ev)
+{
+	const MidiRouteStage *s = stages;
+	const MidiRouteStage *end = s + count;
+
+	for(; s < end; s++) {
+		bool channel = ev.status < 0xF0 || ev.status == MIDI_CC14 ||
+			ev.status == MIDI_PARAMETER;
+		bool key = ev.status == C_NOTE_ON || ev.status == C_NOTE_OFF ||
+			ev.status == C_POLYPHONIC_AFTERTOUCH;
+		int k;
+
+		switch(s->op) {
+		case TYPES:
+			if(!(s->mask & TypeBit(ev.status))) {
+				return false;
+			}
+			break;
+		case CHANNELS:
+			if(channel && !(s->mask & (1u << ev.channel))) {
+				return false;
+			}
+			break;
+		case CHANNEL_MAP:
+			if(channel && (s->mask & (1u << ev.channel))) {
+				ev.channel = s->arg;
+			}
+			break;
+		case TRANSPOSE:
+			if(!key) {
+				break;
+			}
+			k = ev.data1 + (int8_t)s->arg;
+			if(k < 0 || k > MIDI_DATA) {
+				return false;
+			}
+			ev.data1 = (uint8_t)k;
+			break;
+		case KEY_RANGE:
+			if(key && (ev.data1 < s->arg || ev.data1 > s->arg2)) {
+				return false;
+			}
+			break;
+		case VELOCITY:
+			if(ev.status == C_NOTE_ON && ev.data2) {
+				uint8_t v = s->table[ev.data2] & MIDI_DATA;
+				ev.data2 = v ? v : 1;
+			}
+			break;
+		}
+	}
+	return true;
+}
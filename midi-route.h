@@ -0,0 +1,67 @@
+/*
+Copyright (c) 2014 - 2020, Jan-Willem Smaal <usenet@gispen.org>
+SPDX-License-Identifier: Apache-2.0
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+
+You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied.
+
+See the License for the specific language governing permissions and limitations under the License.
+*/
+
+/** MIDI route stages
+ * The filter and transform stages of MidiRouter (midi-router.h), apart
+ * from its threads and queues.  A route runs its stages over a copy of
+ * each event with MidiRouteStage::Apply().
+ */
+#ifndef _MIDI_ROUTE
+#define _MIDI_ROUTE
+
+#include <cstdint>
+#include <cstddef>
+#include "serial-midi.h"
+
+/* Message types for Types() */
+#define MIDI_ROUTE_NOTE_OFF      0x0001
+#define MIDI_ROUTE_NOTE_ON       0x0002
+#define MIDI_ROUTE_POLY_AT       0x0004
+#define MIDI_ROUTE_CONTROL       0x0008
+#define MIDI_ROUTE_PROGRAM       0x0010
+#define MIDI_ROUTE_CHANNEL_AT    0x0020
+#define MIDI_ROUTE_PITCH_WHEEL   0x0040
+#define MIDI_ROUTE_SYSTEM        0x0080  // System common
+#define MIDI_ROUTE_REALTIME      0x0100
+#define MIDI_ROUTE_PARAMETER     0x0200  // 14 bit CC, RPN/NRPN (RxParameters())
+#define MIDI_ROUTE_NOTES         (MIDI_ROUTE_NOTE_OFF | MIDI_ROUTE_NOTE_ON)
+#define MIDI_ROUTE_ALL           0x03FF
+
+
+/** One entry of the stage table, see MidiRouter::AddStage().
+ */
+struct MidiRouteStage {
+	enum Op : uint8_t {
+		TYPES,
+		CHANNELS,
+		CHANNEL_MAP,
+		TRANSPOSE,
+		KEY_RANGE,
+		VELOCITY
+	};
+
+	uint8_t op;                 // Op
+	uint8_t arg;                // Channel, semitones (int8_t), low key
+	uint8_t arg2;               // High key
+	uint16_t mask;              // Channels or MIDI_ROUTE_* types
+	const uint8_t *table;       // Velocity curve
+
+	static bool Apply(const MidiRouteStage *stages, size_t count,
+			MidiEvent &ev);
+	static uint16_t TypeBit(uint8_t status);
+};
+
+#endif /* _MIDI_ROUTE */
@@ -0,0 +1,394 @@
+/** MIDI router, see midi-router.h.
+ *
+ *  Copyright (c) 2014 Jan-Willem Smaal. All rights reserved.
+ */
+#include "midi-router.h"
+#include <cstdint>
+#include <new>
+
+// Input worker wakes up at least this often (ms)
+#define MIDI_ROUTER_IDLE_MS 1000
+
+
+/*-----------------------------------------------------------------------*/
+
+MidiRouter::MidiRouter()
+{
+	input_count = 0;
+	output_count = 0;
+	route_count = 0;
+	stage_count = 0;
+	started = false;
+	stopping = false;
+	for(uint8_t i = 0; i < MIDI_ROUTER_PORTS; i++) {
+		inputs[i].router = this;
+		inputs[i].port = nullptr;
+		inputs[i].queue = nullptr;
+		inputs[i].index = i;
+		outputs[i].router = this;
+		outputs[i].port = nullptr;
+		outputs[i].index = i;
+		outputs[i].head = 0;
+		outputs[i].tail = 0;
+		outputs[i].rt_head = 0;
+		outputs[i].rt_tail = 0;
+		outputs[i].dropped = 0;
+	}
+}
+
+
+/**
+ * Stops the workers and hands the ports back: inputs polled, outputs
+ * unbatched.
+ */
+MidiRouter::~MidiRouter()
+{
+	if(!started) {
+		return;
+	}
+	stopping = true;
+#if MIDI_ROUTER_STACK_SIZE
+	// Inputs first, they still kick the outputs
+	for(uint8_t i = 0; i < input_count; i++) {
+		Thread *t = reinterpret_cast<Thread *>(inputs[i].thread);
+		inputs[i].port->WakeWaiter();
+		t->join();
+		t->~Thread();
+	}
+	for(uint8_t i = 0; i < output_count; i++) {
+		Thread *t = reinterpret_cast<Thread *>(outputs[i].thread);
+		outputs[i].kick.set(MIDI_ROUTER_KICK_FLAG);
+		t->join();
+		t->~Thread();
+	}
+#endif
+	for(uint8_t i = 0; i < input_count; i++) {
+		inputs[i].port->DisableRxInterrupt();
+	}
+	for(uint8_t i = 0; i < output_count; i++) {
+		outputs[i].port->BatchedTx(false);
+	}
+}
+
+
+/**
+ * The input is parsed in queue (EnableRxInterrupt() at Start()).  A port
+ * can be input and output at the same time.
+ */
+int MidiRouter::AddInput(SerialMidi *in, EventQueue *queue)
+{
+	if(started || in == nullptr || input_count == MIDI_ROUTER_PORTS) {
+		return -1;
+	}
+	inputs[input_count].port = in;
+	inputs[input_count].queue = queue;
+	return input_count++;
+}
+
+
+/**
+ * The output is switched to batched TX at Start(), from then on only
+ * the router may send on it (real-time from the clock generator and
+ * Active Sensing excepted, they use the priority lane).  Routed 
+ * real-time goes out through the priority lane too, sent by the worker
+ * of the output.
+ */
+int MidiRouter::AddOutput(SerialMidi *out)
+{
+	if(started || out == nullptr || output_count == MIDI_ROUTER_PORTS) {
+		return -1;
+	}
+	outputs[output_count].port = out;
+	return output_count++;
+}
+
+
+/**
+ * output_mask is a bit mask of output indices, e.g. (1u << a) | (1u << b),
+ * outputs may also be added after the route.  Bits of outputs that do not
+ * exist at Start() are ignored.  The stages added next belong to this
+ * route.
+ */
+int MidiRouter::AddRoute(int input, uint16_t output_mask)
+{
+	if(started || input < 0 || input >= input_count ||
+			route_count == MIDI_ROUTER_ROUTES) {
+		return -1;
+	}
+	Route &r = routes[route_count];
+	r.input = (uint8_t)input;
+	r.first = stage_count;
+	r.count = 0;
+	r.outputs = output_mask;
+	return route_count++;
+}
+
+
+/**
+ * Appends to the last route, the stages of a route are contiguous in
+ * the table.
+ */
+bool MidiRouter::AddStage(const MidiRouteStage &stage)
+{
+	if(started || route_count == 0 || stage_count == MIDI_ROUTER_STAGES) {
+		return false;
+	}
+	stages[stage_count++] = stage;
+	routes[route_count - 1].count++;
+	return true;
+}
+
+
+bool MidiRouter::Types(uint16_t mask)
+{
+	return AddStage({ MidiRouteStage::TYPES, 0, 0, mask, nullptr });
+}
+
+
+bool MidiRouter::Channels(uint16_t mask)
+{
+	return AddStage({ MidiRouteStage::CHANNELS, 0, 0, mask, nullptr });
+}
+
+
+bool MidiRouter::MapChannels(uint16_t mask, uint8_t channel)
+{
+	return AddStage({ MidiRouteStage::CHANNEL_MAP, (uint8_t)(channel & 0x0F),
+			0, mask, nullptr });
+}
+
+
+bool MidiRouter::Transpose(int8_t semitones)
+{
+	return AddStage({ MidiRouteStage::TRANSPOSE, (uint8_t)semitones, 0, 0,
+			nullptr });
+}
+
+
+bool MidiRouter::KeyRange(uint8_t low, uint8_t high)
+{
+	return AddStage({ MidiRouteStage::KEY_RANGE, low, high, 0, nullptr });
+}
+
+
+/**
+ * table maps velocity 0..127 (index 0 unused), a result of 0 is sent
+ * as 1 so a Note On stays a Note On.
+ */
+bool MidiRouter::VelocityCurve(const uint8_t *table)
+{
+	if(table == nullptr) {
+		return false;
+	}
+	return AddStage({ MidiRouteStage::VELOCITY, 0, 0, 0, table });
+}
+
+
+/**
+ * Puts the inputs in RX interrupt mode and the outputs in batched TX,
+ * then starts one worker per port.  The tables are fixed from here on.
+ */
+void MidiRouter::Start(osPriority input_priority, osPriority output_priority)
+{
+	if(started) {
+		return;
+	}
+	started = true;
+	for(uint8_t i = 0; i < output_count; i++) {
+		outputs[i].port->BatchedTx(true);
+#if MIDI_ROUTER_STACK_SIZE
+		Thread *t = new (outputs[i].thread) Thread(output_priority,
+				MIDI_ROUTER_STACK_SIZE, outputs[i].stack, "midi-out");
+		t->start(callback(&outputs[i], &Output::Run));
+#endif
+	}
+	for(uint8_t i = 0; i < input_count; i++) {
+		inputs[i].port->EnableRxInterrupt(inputs[i].queue);
+#if MIDI_ROUTER_STACK_SIZE
+		Thread *t = new (inputs[i].thread) Thread(input_priority,
+				MIDI_ROUTER_STACK_SIZE, inputs[i].stack, "midi-in");
+		t->start(callback(&inputs[i], &Input::Run));
+#endif
+	}
+	(void)input_priority;
+	(void)output_priority;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** Inputs
+ */
+
+void MidiRouter::Input::Run(void)
+{
+	while(!router->stopping) {
+		port->WaitForEvents(MIDI_ROUTER_IDLE_MS);
+		router->ServiceInput(index);
+	}
+}
+
+
+/**
+ * Drains the events of one input through its routes.  Real-time goes to
+ * the real-time queue of the outputs, ahead of the other messages.  The
+ * outputs that got events are kicked once at the end.  returns the events
+ * taken.
+ */
+size_t MidiRouter::ServiceInput(int input)
+{
+	if(input < 0 || input >= input_count) {
+		return 0;
+	}
+	SerialMidi *port = inputs[input].port;
+	uint16_t present = (uint16_t)((1u << output_count) - 1);
+	uint16_t kick = 0;
+	size_t n = 0;
+	MidiEvent ev;
+
+	while(port->Poll(ev)) {
+		n++;
+		if(ev.status == SYSTEM_EXCLUSIVE_START) {
+			port->ReleaseSysEx(ev);
+			continue;
+		}
+		if(ev.status == RT_ACTIVE_SENSING) {
+			continue;
+		}
+		uint16_t param = port->RxParameter();
+		for(uint8_t r = 0; r < route_count; r++) {
+			if(routes[r].input != input) {
+				continue;
+			}
+			MidiEvent out = ev;
+			if(!MidiRouteStage::Apply(&stages[routes[r].first],
+					routes[r].count, out)) {
+				continue;
+			}
+			for(uint16_t o = routes[r].outputs & present; o; o &= o - 1) {
+				uint8_t i = (uint8_t)__builtin_ctz(o);
+				if((out.status >= 0xF8) ? RealtimePush(outputs[i], out.status) :
+						OutputPush(outputs[i], out, param)) {
+					kick |= 1u << i;
+				}
+			}
+		}
+	}
+	for(; kick; kick &= kick - 1) {
+#if MIDI_ROUTER_STACK_SIZE
+		outputs[__builtin_ctz(kick)].kick.set(MIDI_ROUTER_KICK_FLAG);
+#else
+		ServiceOutput(__builtin_ctz(kick));
+#endif
+	}
+	return n;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** Outputs
+ */
+
+/**
+ * Several inputs push into one output, a short critical section (like
+ * the real-time lane).  The output thread is the single consumer.
+ */
+bool MidiRouter::OutputPush(Output &out, const MidiEvent &ev, uint16_t param)
+{
+	core_util_critical_section_enter();
+	uint16_t head = out.head.load(std::memory_order_relaxed);
+	if((uint16_t)(head - out.tail.load(std::memory_order_acquire)) >=
+			MIDI_ROUTER_OUT_QUEUE) {
+		core_util_critical_section_exit();
+		out.dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	out.ring[head % MIDI_ROUTER_OUT_QUEUE].ev = ev;
+	out.ring[head % MIDI_ROUTER_OUT_QUEUE].param = param;
+	out.head.store(head + 1, std::memory_order_release);
+	core_util_critical_section_exit();
+	return true;
+}
+
+
+/**
+ * As above for real-time, a single byte.
+ */
+bool MidiRouter::RealtimePush(Output &out, uint8_t status)
+{
+	core_util_critical_section_enter();
+	uint8_t head = out.rt_head.load(std::memory_order_relaxed);
+	if((uint8_t)(head - out.rt_tail.load(std::memory_order_acquire)) >=
+			MIDI_ROUTER_RT_QUEUE) {
+		core_util_critical_section_exit();
+		out.dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	out.rt_ring[head % MIDI_ROUTER_RT_QUEUE] = status;
+	out.rt_head.store(head + 1, std::memory_order_release);
+	core_util_critical_section_exit();
+	return true;
+}
+
+
+/**
+ * Output worker, sends the queued real-time through the priority lane.
+ */
+size_t MidiRouter::RealtimeSend(Output &out)
+{
+	uint8_t tail = out.rt_tail.load(std::memory_order_relaxed);
+	size_t n = 0;
+
+	while(tail != out.rt_head.load(std::memory_order_acquire)) {
+		out.port->SendRealtime(out.rt_ring[tail % MIDI_ROUTER_RT_QUEUE]);
+		out.rt_tail.store(++tail, std::memory_order_release);
+		n++;
+	}
+	return n;
+}
+
+
+void MidiRouter::Output::Run(void)
+{
+	while(!router->stopping) {
+		kick.wait_any(MIDI_ROUTER_KICK_FLAG);
+		router->ServiceOutput(index);
+	}
+}
+
+
+/**
+ * Re-encodes the queued events into the batched TX block and flushes
+ * it, the only place that sends on the output.  Real-time goes first
+ * and between the events.  returns the events sent.
+ */
+size_t MidiRouter::ServiceOutput(int output)
+{
+	if(output < 0 || output >= output_count) {
+		return 0;
+	}
+	Output &out = outputs[output];
+	uint16_t tail = out.tail.load(std::memory_order_relaxed);
+	size_t rt = RealtimeSend(out);
+	size_t n = 0;
+
+	while(tail != out.head.load(std::memory_order_acquire)) {
+		const Queued &q = out.ring[tail % MIDI_ROUTER_OUT_QUEUE];
+		out.port->SendEvent(q.ev, q.param);
+		out.tail.store(++tail, std::memory_order_release);
+		n++;
+		rt += RealtimeSend(out);
+	}
+	if(n) {
+		out.port->Flush();
+	}
+	return n + rt;
+}
+
+
+uint32_t MidiRouter::Dropped(int output) const
+{
+	if(output < 0 || output >= output_count) {
+		return 0;
+	}
+	return outputs[output].dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,194 @@
+/*
+Copyright (c) 2014 - 2020, Jan-Willem Smaal <usenet@gispen.org>
+SPDX-License-Identifier: Apache-2.0
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+
+You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied.
+
+See the License for the specific language governing permissions and limitations under the License.
+*/
+
+/** MIDI router
+ * Routes decoded messages between SerialMidi ports through filter and
+ * transform stages.  A route is an input, a bit mask of outputs and a
+ * run of stages in one flat table, nothing is allocated.
+ *
+ *   input   RX interrupt mode (parsed in its EventQueue), a worker thread
+ *           polls the events and runs the routes of that input
+ *   output  an event queue per output, its worker thread re-encodes into
+ *           the batched TX block and flushes.  Only that thread waits
+ *           for the wire, a full output queue drops (Dropped()) instead
+ *           of holding up the inputs and the other outputs.  Real-time
+ *           has its own short queue, the worker sends it first and
+ *           between the other events (priority lane).
+ *
+ * Stages run in the order added, on a copy of the event per route (see
+ * midi-route.h):
+ *   Types(mask)              pass the message types in mask (MIDI_ROUTE_*)
+ *   Channels(mask)           pass channel messages on these channels
+ *   MapChannels(mask, to)    move the channels in mask to channel to
+ *   Transpose(semitones)     notes and poly aftertouch, drops off range
+ *   KeyRange(low, high)      pass notes within low..high (a split)
+ *   VelocityCurve(table)     128 entry Note On velocity map
+ *
+ * SysEx is not routed (see SetThru()), Active Sensing neither, each link
+ * has its own (see ActiveSensing()).
+ *
+ *  @code
+ * static const uint8_t soft[128] = { ... };
+ * MidiRouter router;
+ * int kbd   = router.AddInput(&midiIn1);
+ * int synth = router.AddOutput(&midiOut1);
+ * int drums = router.AddOutput(&midiOut2);
+ * router.AddRoute(kbd, 1u << synth);         // lower half, an octave up
+ * router.KeyRange(0, 59);
+ * router.Transpose(12);
+ * router.VelocityCurve(soft);
+ * router.AddRoute(kbd, 1u << drums);         // upper half to channel 10
+ * router.KeyRange(60, 127);
+ * router.MapChannels(0xFFFF, 9);
+ * router.Start();
+ * @endcode
+ */
+#ifndef _MIDI_ROUTER
+#define _MIDI_ROUTER
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include "serial-midi.h"
+#include "midi-route.h"
+
+/* Table sizes, per router */
+#ifndef MIDI_ROUTER_PORTS
+#define MIDI_ROUTER_PORTS 8             // Inputs, and outputs (max 16)
+#endif
+#ifndef MIDI_ROUTER_ROUTES
+#define MIDI_ROUTER_ROUTES 16
+#endif
+#ifndef MIDI_ROUTER_STAGES
+#define MIDI_ROUTER_STAGES 32
+#endif
+
+/* Events waiting per output (power of 2) */
+#ifndef MIDI_ROUTER_OUT_QUEUE
+#define MIDI_ROUTER_OUT_QUEUE 64
+#endif
+
+/* Real-time messages waiting per output (power of 2, max 128) */
+#ifndef MIDI_ROUTER_RT_QUEUE
+#define MIDI_ROUTER_RT_QUEUE 8
+#endif
+
+/* Worker thread stack, one per input and per output.  0 compiles the
+ * threads out: call ServiceInput() yourself (e.g. from an EventQueue),
+ * the outputs are then serviced inline. */
+#ifndef MIDI_ROUTER_STACK_SIZE
+#define MIDI_ROUTER_STACK_SIZE 1024
+#endif
+
+static_assert(MIDI_ROUTER_PORTS <= 16, "MIDI_ROUTER_PORTS max 16");
+static_assert(MIDI_ROUTER_STAGES <= 255, "MIDI_ROUTER_STAGES max 255");
+static_assert((MIDI_ROUTER_OUT_QUEUE & (MIDI_ROUTER_OUT_QUEUE - 1)) == 0,
+		"MIDI_ROUTER_OUT_QUEUE must be a power of 2");
+static_assert(MIDI_ROUTER_RT_QUEUE <= 128 &&
+		(MIDI_ROUTER_RT_QUEUE & (MIDI_ROUTER_RT_QUEUE - 1)) == 0,
+		"MIDI_ROUTER_RT_QUEUE must be a power of 2, max 128");
+
+#define MIDI_ROUTER_KICK_FLAG    0x01
+
+
+class MidiRouter {
+public:
+	MidiRouter();
+	~MidiRouter();
+
+	// Set up before Start(), return the index or -1 when full
+	int AddInput(SerialMidi *in, EventQueue *queue = mbed_highprio_event_queue());
+	int AddOutput(SerialMidi *out);
+	int AddRoute(int input, uint16_t output_mask);
+
+	// Stages for the last added route, false when the table is full
+	bool AddStage(const MidiRouteStage &stage);
+	bool Types(uint16_t mask);
+	bool Channels(uint16_t mask);
+	bool MapChannels(uint16_t mask, uint8_t channel);
+	bool Transpose(int8_t semitones);
+	bool KeyRange(uint8_t low, uint8_t high);
+	bool VelocityCurve(const uint8_t *table);
+
+	void Start(osPriority input_priority = osPriorityAboveNormal,
+			osPriority output_priority = osPriorityHigh);
+
+	size_t ServiceInput(int input);
+	size_t ServiceOutput(int output);
+	uint32_t Dropped(int output) const;   // Events lost, queue full
+
+private:
+	struct Route {
+		uint8_t input;
+		uint8_t first;
+		uint8_t count;
+		uint16_t outputs;
+	};
+
+	// Event with its RxParameter(), for MIDI_CC14/MIDI_PARAMETER
+	struct Queued {
+		MidiEvent ev;
+		uint16_t param;
+	};
+
+	struct Input {
+		MidiRouter *router;
+		SerialMidi *port;
+		EventQueue *queue;
+		uint8_t index;
+		void Run(void);
+#if MIDI_ROUTER_STACK_SIZE
+		alignas(Thread) unsigned char thread[sizeof(Thread)];
+		alignas(8) unsigned char stack[MIDI_ROUTER_STACK_SIZE];
+#endif
+	};
+
+	struct Output {
+		MidiRouter *router;
+		SerialMidi *port;
+		uint8_t index;
+		Queued ring[MIDI_ROUTER_OUT_QUEUE];
+		std::atomic<uint16_t> head;
+		std::atomic<uint16_t> tail;
+		uint8_t rt_ring[MIDI_ROUTER_RT_QUEUE];
+		std::atomic<uint8_t> rt_head;
+		std::atomic<uint8_t> rt_tail;
+		std::atomic<uint32_t> dropped;
+		EventFlags kick;
+		void Run(void);
+#if MIDI_ROUTER_STACK_SIZE
+		alignas(Thread) unsigned char thread[sizeof(Thread)];
+		alignas(8) unsigned char stack[MIDI_ROUTER_STACK_SIZE];
+#endif
+	};
+
+	bool OutputPush(Output &out, const MidiEvent &ev, uint16_t param);
+	bool RealtimePush(Output &out, uint8_t status);
+	size_t RealtimeSend(Output &out);
+
+	Input inputs[MIDI_ROUTER_PORTS];
+	Output outputs[MIDI_ROUTER_PORTS];
+	Route routes[MIDI_ROUTER_ROUTES];
+	MidiRouteStage stages[MIDI_ROUTER_STAGES];
+	uint8_t input_count;
+	uint8_t output_count;
+	uint8_t route_count;
+	uint8_t stage_count;
+	bool started;
+	std::atomic<bool> stopping;
+};
+
+#endif /* _MIDI_ROUTER */
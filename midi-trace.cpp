@@ -0,0 +1,248 @@
+/** MIDI trace record/replay, see midi-trace.h for the format.
+ *
+ *  Copyright (c) 2014 Jan-Willem Smaal. All rights reserved.
+ */
+#include "midi-trace.h"
+#include "serial-midi.h"
+#include <cstdint>
+#include <cstring>
+
+
+/*-----------------------------------------------------------------------*/
+
+MidiTraceRecorder::MidiTraceRecorder(uint8_t *buf, size_t size)
+: ring(buf), ring_size(size)
+{
+	ring_head = 0;
+	ring_tail = 0;
+	last_us = 0;
+	started = false;
+	dropped = 0;
+}
+
+
+static size_t VarintLen(uint32_t v)
+{
+	size_t n = 1;
+
+	while(v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+
+void MidiTraceRecorder::Put(uint8_t c, size_t &head)
+{
+	ring[head] = c;
+	if(++head == ring_size) {
+		head = 0;
+	}
+}
+
+
+void MidiTraceRecorder::PutVarint(uint32_t v, size_t &head)
+{
+	while(v >= 0x80) {
+		Put((uint8_t)(v | 0x80), head);
+		v >>= 7;
+	}
+	Put((uint8_t)v, head);
+}
+
+
+/**
+ * Appends one record, producer side (RX parser context).  The cost is
+ * a copy of the block plus a few bytes of header.
+ */
+void MidiTraceRecorder::Record(const uint8_t *data, size_t len,
+		uint32_t end_us)
+{
+	size_t head = ring_head.load(std::memory_order_relaxed);
+	size_t tail = ring_tail.load(std::memory_order_acquire);
+	size_t used = (head >= tail) ? (head - tail) : (ring_size - tail + head);
+	uint32_t delta = started ? (end_us - last_us) : end_us;
+	size_t need = VarintLen(delta) + VarintLen((uint32_t)len) + len;
+
+	// One slot stays empty to tell full from empty
+	if(len == 0 || used + need >= ring_size) {
+		if(len) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+		return;
+	}
+	PutVarint(delta, head);
+	PutVarint((uint32_t)len, head);
+	size_t first = ring_size - head;
+	if(first > len) {
+		first = len;
+	}
+	memcpy(&ring[head], data, first);
+	memcpy(ring, data + first, len - first);
+	head += len;
+	if(head >= ring_size) {
+		head -= ring_size;
+	}
+	started = true;
+	last_us = end_us;
+	ring_head.store(head, std::memory_order_release);
+}
+
+
+/**
+ * Moves up to max bytes of trace to out, consumer side.  returns the
+ * number of bytes copied.  Records may be split over several calls,
+ * the concatenated output is the trace.
+ */
+size_t MidiTraceRecorder::Read(uint8_t *out, size_t max)
+{
+	size_t tail = ring_tail.load(std::memory_order_relaxed);
+	size_t head = ring_head.load(std::memory_order_acquire);
+	size_t n = 0;
+
+	while(n < max && tail != head) {
+		size_t chunk = ((head > tail) ? head : ring_size) - tail;
+		if(chunk > max - n) {
+			chunk = max - n;
+		}
+		memcpy(out + n, &ring[tail], chunk);
+		n += chunk;
+		tail += chunk;
+		if(tail == ring_size) {
+			tail = 0;
+		}
+	}
+	ring_tail.store(tail, std::memory_order_release);
+	return n;
+}
+
+
+size_t MidiTraceRecorder::Size(void) const
+{
+	size_t head = ring_head.load(std::memory_order_acquire);
+	size_t tail = ring_tail.load(std::memory_order_relaxed);
+
+	return (head >= tail) ? (head - tail) : (ring_size - tail + head);
+}
+
+
+uint32_t MidiTraceRecorder::Dropped(void) const
+{
+	return dropped.load(std::memory_order_relaxed);
+}
+
+
+/**
+ * Discards the unread trace, recording continues.  The first record
+ * after this carries a delta to a record that is no longer there, a
+ * decoder treats it as absolute time (just an offset).
+ */
+void MidiTraceRecorder::Clear(void)
+{
+	ring_tail.store(ring_head.load(std::memory_order_acquire),
+			std::memory_order_release);
+}
+
+
+/*-----------------------------------------------------------------------*/
+
+MidiTracePlayer::MidiTracePlayer(const uint8_t *trace, size_t len,
+		uint16_t speed_percent)
+: trace_start(trace), trace_end(trace + len), speed(speed_percent)
+{
+	Rewind();
+}
+
+
+void MidiTracePlayer::Rewind(void)
+{
+	pos = trace_start;
+	first = true;
+	start_us = 0;
+	trace_us = 0;
+	trace_base_us = 0;
+}
+
+
+bool MidiTracePlayer::Done(void) const
+{
+	return pos >= trace_end;
+}
+
+
+bool MidiTracePlayer::GetVarint(const uint8_t *&p, const uint8_t *end,
+		uint32_t &v)
+{
+	v = 0;
+	for(unsigned shift = 0; shift < 35; shift += 7) {
+		if(p >= end) {
+			return false;
+		}
+		uint8_t c = *p++;
+		v |= (uint32_t)(c & 0x7F) << shift;
+		if(!(c & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+bool MidiTracePlayer::Next(const uint8_t *&data, size_t &len,
+		uint32_t &delta_us)
+{
+	const uint8_t *p = pos;
+	uint32_t n;
+
+	if(!GetVarint(p, trace_end, delta_us) || !GetVarint(p, trace_end, n) ||
+			n > (size_t)(trace_end - p)) {
+		pos = trace_end;
+		return false;
+	}
+	data = p;
+	len = n;
+	pos = p + n;
+	return true;
+}
+
+
+/**
+ * Paced decoding.  The first record goes out at once and starts the
+ * replay clock, the others when (trace time) * 100 / speed has passed.
+ * The replay clock is 32 bit us, traces up to about an hour.
+ */
+bool MidiTracePlayer::NextDue(const uint8_t *&data, size_t &len,
+		uint32_t &end_us)
+{
+	const uint8_t *p = pos;
+	uint32_t delta;
+	uint32_t n;
+
+	if(Done()) {
+		return false;
+	}
+	if(!GetVarint(p, trace_end, delta) || !GetVarint(p, trace_end, n) ||
+			n > (size_t)(trace_end - p)) {
+		pos = trace_end;
+		return false;
+	}
+	uint64_t t = first ? 0 : trace_us + delta;
+	if(first) {
+		trace_base_us = delta;
+		start_us = MIDI_TIMESTAMP();
+	}
+	else if(speed) {
+		uint64_t elapsed = (uint32_t)(MIDI_TIMESTAMP() - start_us);
+		if(elapsed * speed < t * 100) {
+			return false;
+		}
+	}
+	first = false;
+	trace_us = t;
+	data = p;
+	len = n;
+	end_us = trace_base_us + (uint32_t)t;
+	pos = p + n;
+	return true;
+}
@@ -0,0 +1,137 @@
+/*
+Copyright (c) 2014 - 2020, Jan-Willem Smaal <usenet@gispen.org>
+SPDX-License-Identifier: Apache-2.0
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+
+You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied.
+
+See the License for the specific language governing permissions and limitations under the License.
+*/
+
+/** MIDI trace record/replay
+ * Captures the raw bytes seen by the SerialMidi RX path with their
+ * arrival time, and feeds such a trace back through a parser.
+ *
+ * Trace format, a sequence of records, one per received block:
+ *   varint delta_us   arrival of the last byte of the block, relative
+ *                     to the previous record (the first one: absolute)
+ *   varint length     number of raw bytes
+ *   length raw bytes
+ * varint: 7 bits per byte, least significant first, bit 7 set when more
+ * bytes follow.  A 3 byte block 1 ms after the previous one costs 3
+ * bytes of overhead.
+ *
+ *  @code
+ * static uint8_t trace_buf[4096];
+ * MidiTraceRecorder recorder(trace_buf, sizeof(trace_buf));
+ * midiIn.SetTrace(&recorder);
+ * ...
+ * // Writer thread: move the trace to flash/SD
+ * uint8_t chunk[256];
+ * size_t n = recorder.Read(chunk, sizeof(chunk));
+ * ...
+ * MidiTracePlayer player(trace, trace_len, 100);    // original speed
+ * while(!player.Done()) {
+ *	player.Service(midiIn);
+ * }
+ * @endcode
+ */
+#ifndef _MIDI_TRACE
+#define _MIDI_TRACE
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+
+/** Capture into a caller owned ring buffer.  Single producer (the RX
+ * parser context), single consumer (Read(), e.g. a flash/SD writer).
+ * A record that does not fit is dropped as a whole so the trace stays
+ * decodable, the next record then carries the accumulated delta.
+ */
+class MidiTraceRecorder {
+public:
+	MidiTraceRecorder(uint8_t *buf, size_t size);
+
+	void Record(const uint8_t *data, size_t len, uint32_t end_us);
+	size_t Read(uint8_t *out, size_t max);
+	size_t Size(void) const;        // Bytes waiting for Read()
+	uint32_t Dropped(void) const;   // Records lost, ring full
+	void Clear(void);               // Consumer side, restarts the trace
+
+private:
+	void Put(uint8_t c, size_t &head);
+	void PutVarint(uint32_t v, size_t &head);
+
+	uint8_t *ring;
+	size_t ring_size;
+	std::atomic<size_t> ring_head;
+	std::atomic<size_t> ring_tail;
+	uint32_t last_us;
+	bool started;
+	std::atomic<uint32_t> dropped;
+};
+
+
+/** Replays a trace through a parser, SerialMidi or SerialMidiT<>.
+ * speed_percent: 100 original timing, 200 twice as fast, 0 as fast as
+ * possible.  The parser always gets the recorded arrival times so
+ * timestamps and the clock follower see the original timing, with
+ * speed 0 a replay is fully deterministic, handy as a load generator.
+ */
+class MidiTracePlayer {
+public:
+	MidiTracePlayer(const uint8_t *trace, size_t len,
+			uint16_t speed_percent = 100);
+
+	// Feeds the records that are due, returns the messages parsed
+	template<class Midi> size_t Service(Midi &midi) {
+		const uint8_t *data;
+		size_t len;
+		uint32_t end_us;
+		size_t messages = 0;
+		while(NextDue(data, len, end_us)) {
+			messages += midi.Parse(data, len, end_us);
+		}
+		return messages;
+	}
+
+	// The whole trace, busy waits between records
+	template<class Midi> size_t Run(Midi &midi) {
+		size_t messages = 0;
+		while(!Done()) {
+			messages += Service(midi);
+		}
+		return messages;
+	}
+
+	bool Done(void) const;
+	void Rewind(void);
+
+	// Next record when its replay time has come, end_us is the recorded
+	// arrival time
+	bool NextDue(const uint8_t *&data, size_t &len, uint32_t &end_us);
+
+	// Plain decoding, returns false at the end or on a corrupt trace
+	bool Next(const uint8_t *&data, size_t &len, uint32_t &delta_us);
+
+private:
+	static bool GetVarint(const uint8_t *&p, const uint8_t *end,
+			uint32_t &v);
+
+	const uint8_t *trace_start;
+	const uint8_t *trace_end;
+	const uint8_t *pos;
+	uint16_t speed;
+	bool first;
+	uint32_t start_us;      // Replay start, our clock
+	uint64_t trace_us;      // Trace time since its first record
+	uint32_t trace_base_us; // Arrival time of the first record
+};
+
+#endif /* _MIDI_TRACE */
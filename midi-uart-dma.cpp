@@ -0,0 +1,461 @@
+/** eDMA UART backend for K64/K66, see midi-uart-dma.h.
+ *
+ *  Copyright (c) 2014 Jan-Willem Smaal. All rights reserved.
+ */
+#include "midi-uart-dma.h"
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#if DEVICE_SERIAL_ASYNCH
+#define MIDI_UART_HAL_INDEX(s) ((s).serial.index)
+#else
+#define MIDI_UART_HAL_INDEX(s) ((s).index)
+#endif
+
+// Channel interrupt numbers follow the channel (K66: channel n and n+16)
+#ifdef TARGET_K66F
+#define MIDI_DMA_IRQ(ch) ((IRQn_Type)(DMA0_DMA16_IRQn + (ch)))
+#else
+#define MIDI_DMA_IRQ(ch) ((IRQn_Type)(DMA0_IRQn + (ch)))
+#endif
+
+// DMAMUX request sources, UARTn RX = 2 + 2n, TX = 3 + 2n
+#define MIDI_DMAMUX_UART_RX(n) (2 + 2 * (n))
+#define MIDI_DMAMUX_UART_TX(n) (3 + 2 * (n))
+
+// Bytes copied into the TX ring per critical section
+#define MIDI_UART_DMA_TX_CHUNK 64
+
+// io_flags, set from the interrupts for a blocking read()/write()
+#define MIDI_UART_DMA_RX_FLAG 0x01
+#define MIDI_UART_DMA_TX_FLAG 0x02
+
+MidiUartDma *MidiUartDma::ports[MIDI_UART_DMA_PORTS];
+
+
+/*-----------------------------------------------------------------------*/
+
+MidiUartDma::MidiUartDma(PinName tx, PinName rx, int baud)
+{
+	static UART_Type *const uart_bases[] = UART_BASE_PTRS;
+	static const IRQn_Type uart_irqs[] = UART_RX_TX_IRQS;
+	static void (*const uart_vectors[MIDI_UART_DMA_PORTS])(void) = {
+		&UartVector<0>, &UartVector<1>, &UartVector<2>, &UartVector<3>
+	};
+	static void (*const rx_vectors[MIDI_UART_DMA_PORTS])(void) = {
+		&DmaRxVector<0>, &DmaRxVector<1>, &DmaRxVector<2>, &DmaRxVector<3>
+	};
+	static void (*const tx_vectors[MIDI_UART_DMA_PORTS])(void) = {
+		&DmaTxVector<0>, &DmaTxVector<1>, &DmaTxVector<2>, &DmaTxVector<3>
+	};
+
+	// Pins, clock gate, baud rate and 8N1 from the HAL
+	serial_init(&uart_hal, tx, rx);
+	serial_baud(&uart_hal, baud);
+	index = MIDI_UART_HAL_INDEX(uart_hal);
+	MBED_ASSERT(index >= 0 && index < MIDI_UART_DMA_PORTS);
+	uart = uart_bases[index];
+	rx_ch = MIDI_UART_DMA_CHANNEL + 2 * index;
+	tx_ch = rx_ch + 1;
+
+	blocking = true;
+	rx_sigio = nullptr;
+	rx_wraps = 0;
+	rx_read = 0;
+	rx_lost = 0;
+	tx_head = 0;
+	tx_tail = 0;
+	tx_dma_len = 0;
+	ports[index] = this;
+
+	SIM->SCGC6 |= SIM_SCGC6_DMAMUX_MASK;
+	SIM->SCGC7 |= SIM_SCGC7_DMA_MASK;
+
+	// FIFOs off, clearing an idle line reads D and that must not
+	// underflow a FIFO.  Idle counting starts after the stop bit.
+	uart->C2 &= ~(UART_C2_TE_MASK | UART_C2_RE_MASK);
+	uart->PFIFO &= ~(UART_PFIFO_TXFE_MASK | UART_PFIFO_RXFE_MASK);
+	uart->CFIFO |= UART_CFIFO_TXFLUSH_MASK | UART_CFIFO_RXFLUSH_MASK;
+	uart->C1 |= UART_C1_ILT_MASK;
+	uart->C5 |= UART_C5_TDMAS_MASK | UART_C5_RDMAS_MASK;
+
+	RxStart();
+	DMA0->CERQ = tx_ch;
+	DMAMUX->CHCFG[tx_ch] = 0;
+	DMAMUX->CHCFG[tx_ch] = DMAMUX_CHCFG_ENBL_MASK |
+		DMAMUX_CHCFG_SOURCE(MIDI_DMAMUX_UART_TX(index));
+
+	NVIC_SetVector(uart_irqs[index], (uint32_t)uart_vectors[index]);
+	NVIC_SetVector(MIDI_DMA_IRQ(rx_ch), (uint32_t)rx_vectors[index]);
+	NVIC_SetVector(MIDI_DMA_IRQ(tx_ch), (uint32_t)tx_vectors[index]);
+	NVIC_EnableIRQ(uart_irqs[index]);
+	NVIC_EnableIRQ(MIDI_DMA_IRQ(rx_ch));
+	NVIC_EnableIRQ(MIDI_DMA_IRQ(tx_ch));
+
+	// With TDMAS/RDMAS set TIE/RIE raise DMA requests, not interrupts
+	uart->C2 |= UART_C2_TIE_MASK | UART_C2_RIE_MASK | UART_C2_ILIE_MASK |
+		UART_C2_TE_MASK | UART_C2_RE_MASK;
+	// Receive errors interrupt too, an overrun left set stops RX
+	uart->C3 |= UART_C3_ORIE_MASK | UART_C3_NEIE_MASK | UART_C3_FEIE_MASK |
+		UART_C3_PEIE_MASK;
+}
+
+
+MidiUartDma::~MidiUartDma()
+{
+	static const IRQn_Type uart_irqs[] = UART_RX_TX_IRQS;
+
+	uart->C2 &= ~(UART_C2_TIE_MASK | UART_C2_RIE_MASK | UART_C2_ILIE_MASK);
+	uart->C3 &= ~(UART_C3_ORIE_MASK | UART_C3_NEIE_MASK | UART_C3_FEIE_MASK |
+		UART_C3_PEIE_MASK);
+	uart->C5 &= ~(UART_C5_TDMAS_MASK | UART_C5_RDMAS_MASK);
+	DMA0->CERQ = rx_ch;
+	DMA0->CERQ = tx_ch;
+	DMAMUX->CHCFG[rx_ch] = 0;
+	DMAMUX->CHCFG[tx_ch] = 0;
+	NVIC_DisableIRQ(uart_irqs[index]);
+	NVIC_DisableIRQ(MIDI_DMA_IRQ(rx_ch));
+	NVIC_DisableIRQ(MIDI_DMA_IRQ(tx_ch));
+	ports[index] = nullptr;
+	serial_free(&uart_hal);
+}
+
+
+/**
+ * The HAL only touches the baud rate/frame registers, the DMA setup in
+ * C2/C5 stays.
+ */
+void MidiUartDma::set_baud(int baud)
+{
+	serial_baud(&uart_hal, baud);
+}
+
+
+void MidiUartDma::set_format(int bits, Parity parity, int stop_bits)
+{
+	serial_format(&uart_hal, bits, (SerialParity)parity, stop_bits);
+}
+
+
+/**
+ * As BufferedSerial: one flag for both directions.  Blocking read()
+ * sleeps until at least one byte is there, blocking write() until all
+ * bytes are in the TX ring.
+ */
+int MidiUartDma::set_blocking(bool enable)
+{
+	blocking = enable;
+	return 0;
+}
+
+
+void MidiUartDma::sigio(Callback<void()> func)
+{
+	core_util_critical_section_enter();
+	rx_sigio = func;
+	core_util_critical_section_exit();
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** RX
+ */
+
+/**
+ * Circular transfer: one byte per request from D into the ring, the
+ * destination wraps at the end of the major loop, interrupts at half
+ * and full.
+ */
+void MidiUartDma::RxStart(void)
+{
+	DMA0->CERQ = rx_ch;
+	DMAMUX->CHCFG[rx_ch] = 0;
+	DMA0->CDNE = rx_ch;
+	DMA0->TCD[rx_ch].SADDR = (uint32_t)&uart->D;
+	DMA0->TCD[rx_ch].SOFF = 0;
+	DMA0->TCD[rx_ch].ATTR = DMA_ATTR_SSIZE(0) | DMA_ATTR_DSIZE(0);
+	DMA0->TCD[rx_ch].NBYTES_MLNO = 1;
+	DMA0->TCD[rx_ch].SLAST = 0;
+	DMA0->TCD[rx_ch].DADDR = (uint32_t)rx_ring;
+	DMA0->TCD[rx_ch].DOFF = 1;
+	DMA0->TCD[rx_ch].CITER_ELINKNO = DMA_CITER_ELINKNO_CITER(MIDI_UART_DMA_RX_SIZE);
+	DMA0->TCD[rx_ch].BITER_ELINKNO = DMA_BITER_ELINKNO_BITER(MIDI_UART_DMA_RX_SIZE);
+	DMA0->TCD[rx_ch].DLAST_SGA = -(int32_t)MIDI_UART_DMA_RX_SIZE;
+	DMA0->TCD[rx_ch].CSR = DMA_CSR_INTMAJOR_MASK | DMA_CSR_INTHALF_MASK;
+	DMAMUX->CHCFG[rx_ch] = DMAMUX_CHCFG_ENBL_MASK |
+		DMAMUX_CHCFG_SOURCE(MIDI_DMAMUX_UART_RX(index));
+	DMA0->SERQ = rx_ch;
+}
+
+
+/**
+ * Total bytes written by the DMA.  Right after a wrap the position is 0
+ * before the interrupt counted the pass, that only under-reports.
+ */
+uint32_t MidiUartDma::RxWritten(void) const
+{
+	uint32_t wraps;
+	uint32_t citer;
+
+	do {
+		wraps = rx_wraps;
+		citer = DMA0->TCD[rx_ch].CITER_ELINKNO & DMA_CITER_ELINKNO_CITER_MASK;
+	} while(wraps != rx_wraps);
+	return wraps * MIDI_UART_DMA_RX_SIZE + (MIDI_UART_DMA_RX_SIZE - citer);
+}
+
+
+/**
+ * Bytes waiting, a full ring is still intact.  When the DMA went more
+ * than a whole ring ahead the oldest bytes are gone, everything is
+ * skipped and the parser resyncs on the next status byte.
+ */
+size_t MidiUartDma::RxAvailable(void)
+{
+	uint32_t written = RxWritten();
+	int32_t avail = (int32_t)(written - rx_read);
+
+	if(avail <= 0) {
+		return 0;
+	}
+	if(avail > MIDI_UART_DMA_RX_SIZE) {
+		rx_lost += avail;
+		rx_read = written;
+		return 0;
+	}
+	return (size_t)avail;
+}
+
+
+bool MidiUartDma::readable(void) const
+{
+	return (int32_t)(RxWritten() - rx_read) > 0;
+}
+
+
+/**
+ * The bytes up to the end of the ring (or the DMA position), valid
+ * until Consume().
+ */
+size_t MidiUartDma::ReadSpan(const uint8_t *&data)
+{
+	size_t avail = RxAvailable();
+	size_t pos = rx_read & (MIDI_UART_DMA_RX_SIZE - 1);
+
+	if(avail > MIDI_UART_DMA_RX_SIZE - pos) {
+		avail = MIDI_UART_DMA_RX_SIZE - pos;
+	}
+	data = &rx_ring[pos];
+	return avail;
+}
+
+
+void MidiUartDma::Consume(size_t n)
+{
+	rx_read += n;
+}
+
+
+uint32_t MidiUartDma::RxLost(void) const
+{
+	return rx_lost;
+}
+
+
+/**
+ * A blocking read() sleeps until the next RX interrupt (ring half/full
+ * or the idle line after a burst).
+ */
+ssize_t MidiUartDma::read(void *buf, size_t len)
+{
+	uint8_t *out = (uint8_t *)buf;
+	size_t n = 0;
+
+	while(len && !readable()) {
+		if(!blocking) {
+			return -EAGAIN;
+		}
+		// Cleared before the check, an interrupt in between is not lost
+		io_flags.clear(MIDI_UART_DMA_RX_FLAG);
+		if(readable()) {
+			break;
+		}
+		io_flags.wait_any(MIDI_UART_DMA_RX_FLAG, osWaitForever, false);
+	}
+	// At most two spans, the ring may wrap
+	while(n < len) {
+		const uint8_t *data;
+		size_t chunk = ReadSpan(data);
+		if(chunk == 0) {
+			break;
+		}
+		if(chunk > len - n) {
+			chunk = len - n;
+		}
+		memcpy(out + n, data, chunk);
+		Consume(chunk);
+		n += chunk;
+	}
+	return (ssize_t)n;
+}
+
+
+/**
+ * UART status interrupt, only the idle line and the receive errors are
+ * enabled.  The flags are cleared by reading S1 then D, when a byte is
+ * waiting the DMA takes it and that read clears them.  An overrun lost
+ * a byte, it counts in RxLost().
+ */
+void MidiUartDma::UartIrq(void)
+{
+	uint8_t s1 = uart->S1;
+
+	if(s1 & UART_S1_OR_MASK) {
+		rx_lost++;
+	}
+	if((s1 & (UART_S1_IDLE_MASK | UART_S1_OR_MASK | UART_S1_NF_MASK |
+			UART_S1_FE_MASK | UART_S1_PF_MASK)) &&
+			!(s1 & UART_S1_RDRF_MASK)) {
+		(void)uart->D;
+	}
+	if(s1 & UART_S1_IDLE_MASK) {
+		io_flags.set(MIDI_UART_DMA_RX_FLAG);
+		if(rx_sigio) {
+			rx_sigio();
+		}
+	}
+}
+
+
+/**
+ * Half and full ring, a continuous stream (no idle line) still gets
+ * parsed in time.
+ */
+void MidiUartDma::DmaRxIrq(void)
+{
+	DMA0->CINT = rx_ch;
+	if(DMA0->TCD[rx_ch].CSR & DMA_CSR_DONE_MASK) {
+		DMA0->CDNE = rx_ch;
+		rx_wraps = rx_wraps + 1;
+	}
+	io_flags.set(MIDI_UART_DMA_RX_FLAG);
+	if(rx_sigio) {
+		rx_sigio();
+	}
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** TX
+ */
+
+/**
+ * Starts a transfer of the contiguous bytes in the TX ring if none is
+ * in flight.  Interrupts off or from the DMA interrupt.
+ */
+void MidiUartDma::TxKick(void)
+{
+	if(tx_dma_len || tx_head == tx_tail) {
+		return;
+	}
+	uint32_t pos = tx_tail & (MIDI_UART_DMA_TX_SIZE - 1);
+	uint32_t n = tx_head - tx_tail;
+	if(n > MIDI_UART_DMA_TX_SIZE - pos) {
+		n = MIDI_UART_DMA_TX_SIZE - pos;
+	}
+	DMA0->CDNE = tx_ch;
+	DMA0->TCD[tx_ch].SADDR = (uint32_t)&tx_ring[pos];
+	DMA0->TCD[tx_ch].SOFF = 1;
+	DMA0->TCD[tx_ch].ATTR = DMA_ATTR_SSIZE(0) | DMA_ATTR_DSIZE(0);
+	DMA0->TCD[tx_ch].NBYTES_MLNO = 1;
+	DMA0->TCD[tx_ch].SLAST = 0;
+	DMA0->TCD[tx_ch].DADDR = (uint32_t)&uart->D;
+	DMA0->TCD[tx_ch].DOFF = 0;
+	DMA0->TCD[tx_ch].CITER_ELINKNO = DMA_CITER_ELINKNO_CITER(n);
+	DMA0->TCD[tx_ch].BITER_ELINKNO = DMA_BITER_ELINKNO_BITER(n);
+	DMA0->TCD[tx_ch].DLAST_SGA = 0;
+	// The request is switched off at the end, TDRE stays asserted
+	DMA0->TCD[tx_ch].CSR = DMA_CSR_INTMAJOR_MASK | DMA_CSR_DREQ_MASK;
+	tx_dma_len = (uint16_t)n;
+	DMA0->SERQ = tx_ch;
+}
+
+
+void MidiUartDma::DmaTxIrq(void)
+{
+	DMA0->CINT = tx_ch;
+	tx_tail = tx_tail + tx_dma_len;
+	tx_dma_len = 0;
+	TxKick();
+	io_flags.set(MIDI_UART_DMA_TX_FLAG);
+}
+
+
+/**
+ * Copies into the TX ring in chunks, each under a short critical
+ * section (several writers, the DMA interrupt moves the tail).  On a
+ * full ring a blocking write() sleeps until the next DMA transfer ends.
+ * returns the bytes taken, -EAGAIN when non-blocking and the ring is
+ * full.
+ */
+ssize_t MidiUartDma::write(const void *buf, size_t len)
+{
+	const uint8_t *src = (const uint8_t *)buf;
+	size_t done = 0;
+
+	while(done < len) {
+		// Not cleared on wake up, all waiting writers see the space
+		io_flags.clear(MIDI_UART_DMA_TX_FLAG);
+		core_util_critical_section_enter();
+		uint32_t head = tx_head;
+		size_t n = MIDI_UART_DMA_TX_SIZE - (head - tx_tail);
+		if(n > len - done) {
+			n = len - done;
+		}
+		if(n > MIDI_UART_DMA_TX_CHUNK) {
+			n = MIDI_UART_DMA_TX_CHUNK;
+		}
+		for(size_t i = 0; i < n; i++) {
+			tx_ring[(head + i) & (MIDI_UART_DMA_TX_SIZE - 1)] = src[done + i];
+		}
+		tx_head = head + n;
+		TxKick();
+		core_util_critical_section_exit();
+		done += n;
+		if(n == 0) {
+			if(!blocking) {
+				break;
+			}
+			io_flags.wait_any(MIDI_UART_DMA_TX_FLAG, osWaitForever, false);
+		}
+	}
+	return (done || len == 0) ? (ssize_t)done : -EAGAIN;
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** Vectors, one set per UART
+ */
+template<int N> void MidiUartDma::UartVector(void)
+{
+	if(ports[N]) {
+		ports[N]->UartIrq();
+	}
+}
+
+
+template<int N> void MidiUartDma::DmaRxVector(void)
+{
+	if(ports[N]) {
+		ports[N]->DmaRxIrq();
+	}
+}
+
+
+template<int N> void MidiUartDma::DmaTxVector(void)
+{
+	if(ports[N]) {
+		ports[N]->DmaTxIrq();
+	}
+}
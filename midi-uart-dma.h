@@ -0,0 +1,136 @@
+/*
+Copyright (c) 2014 - 2020, Jan-Willem Smaal <usenet@gispen.org>
+SPDX-License-Identifier: Apache-2.0
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+
+You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied.
+
+See the License for the specific language governing permissions and limitations under the License.
+*/
+
+/** eDMA UART backend for K64/K66
+ * Drop-in for the part of BufferedSerial used by SerialMidi, selected by
+ * building with MIDI_UART_DMA=1.  BufferedSerial takes an interrupt per
+ * byte in both directions, here the eDMA moves the bytes:
+ *
+ *   RX  one channel fills a circular ring from UART->D.  Interrupts only
+ *       at ring half/full and on an idle line (end of a burst), these
+ *       raise sigio().  SerialMidi parses the ring in place, see
+ *       ReadSpan().
+ *   TX  write() copies into a TX ring, one channel empties it into
+ *       UART->D, an interrupt per DMA transfer (up to the whole ring).
+ *
+ * The HAL (serial_init()) does the pin mux, clock gate and baud rate, the
+ * UART then gets its FIFOs off and the DMA requests on.  Channels are
+ * MIDI_UART_DMA_CHANNEL + 2 * n (RX) and + 1 (TX) for UARTn, keep those
+ * away from other DMA users.  Only UART0-3 have separate RX/TX DMA
+ * requests, UART4/5 (and the K66 LPUART) stay on BufferedSerial.
+ *
+ * Single consumer for read(), writers may be in several threads (the
+ * real-time lane is drained from the queue thread).  Not for ISRs.
+ */
+#ifndef _MIDI_UART_DMA
+#define _MIDI_UART_DMA
+
+#include <cstdint>
+#include <cstddef>
+#include "mbed.h"
+
+/* RX ring (power of 2), at 31250 baud 256 bytes is 80 ms of a 
+ * saturated wire */
+#ifndef MIDI_UART_DMA_RX_SIZE
+#define MIDI_UART_DMA_RX_SIZE 256
+#endif
+
+/* TX ring (power of 2), write() waits (blocking) or returns short 
+ * when it is full */
+#ifndef MIDI_UART_DMA_TX_SIZE
+#define MIDI_UART_DMA_TX_SIZE 256
+#endif
+
+/* First eDMA channel, UARTn uses DMA_CHANNEL + 2n and + 2n + 1 */
+#ifndef MIDI_UART_DMA_CHANNEL
+#define MIDI_UART_DMA_CHANNEL 0
+#endif
+#define MIDI_UART_DMA_PORTS 4
+
+static_assert((MIDI_UART_DMA_RX_SIZE & (MIDI_UART_DMA_RX_SIZE - 1)) == 0 &&
+		MIDI_UART_DMA_RX_SIZE >= 16 && MIDI_UART_DMA_RX_SIZE <= 0x4000,
+		"MIDI_UART_DMA_RX_SIZE must be a power of 2");
+static_assert((MIDI_UART_DMA_TX_SIZE & (MIDI_UART_DMA_TX_SIZE - 1)) == 0 &&
+		MIDI_UART_DMA_TX_SIZE >= 16 && MIDI_UART_DMA_TX_SIZE <= 0x4000,
+		"MIDI_UART_DMA_TX_SIZE must be a power of 2");
+// K66 shares the vector of channel n and n + 16, stay below 16
+static_assert(MIDI_UART_DMA_CHANNEL + 2 * MIDI_UART_DMA_PORTS <= 16,
+		"MIDI_UART_DMA_CHANNEL too high");
+
+
+class MidiUartDma {
+public:
+	// Same values as SerialBase::Parity
+	enum Parity { None, Odd, Even, Forced1, Forced0 };
+
+	MidiUartDma(PinName tx, PinName rx, int baud = 9600);
+	~MidiUartDma();
+
+	void set_baud(int baud);
+	void set_format(int bits = 8, Parity parity = None, int stop_bits = 1);
+	int set_blocking(bool blocking);
+	void sigio(Callback<void()> func);    // Called in ISR context
+
+	ssize_t read(void *buf, size_t len);
+	ssize_t write(const void *buf, size_t len);
+	bool readable(void) const;
+
+	// Zero-copy RX: the received bytes that are contiguous in the ring,
+	// Consume() hands them back to the DMA once parsed
+	size_t ReadSpan(const uint8_t *&data);
+	void Consume(size_t n);
+
+	uint32_t RxLost(void) const;          // Bytes lost, ring full or overrun
+
+private:
+	template<int N> static void UartVector(void);
+	template<int N> static void DmaRxVector(void);
+	template<int N> static void DmaTxVector(void);
+	void UartIrq(void);
+	void DmaRxIrq(void);
+	void DmaTxIrq(void);
+
+	void RxStart(void);
+	uint32_t RxWritten(void) const;
+	size_t RxAvailable(void);
+	void TxKick(void);
+
+	serial_t uart_hal;
+	UART_Type *uart;
+	int index;
+	uint8_t rx_ch;
+	uint8_t tx_ch;
+	bool blocking;
+	Callback<void()> rx_sigio;
+	EventFlags io_flags;                  // Wakes a blocking read()/write()
+
+	// RX: the DMA is the producer, rx_wraps counts its passes over the
+	// ring, rx_read is the total consumed (both free running)
+	uint8_t rx_ring[MIDI_UART_DMA_RX_SIZE];
+	volatile uint32_t rx_wraps;
+	uint32_t rx_read;
+	uint32_t rx_lost;
+
+	// TX: write() produces, the DMA interrupt consumes
+	uint8_t tx_ring[MIDI_UART_DMA_TX_SIZE];
+	volatile uint32_t tx_head;
+	volatile uint32_t tx_tail;
+	volatile uint16_t tx_dma_len;         // Transfer in flight, 0 = idle
+
+	static MidiUartDma *ports[MIDI_UART_DMA_PORTS];
+};
+
+#endif /* _MIDI_UART_DMA */
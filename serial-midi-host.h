@@ -0,0 +1,242 @@
+/*
+Copyright (c) 2014 - 2020, Jan-Willem Smaal <usenet@gispen.org>
+SPDX-License-Identifier: Apache-2.0
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+
+You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied.
+
+See the License for the specific language governing permissions and limitations under the License.
+*/
+
+/** Host HAL shim
+ * Minimal stand-ins for the mbed OS parts used by SerialMidi so the
+ * parser and encoders build on a desktop host, e.g. for benchmarks.
+ * Selected by building with -DSERIAL_MIDI_HOST, serial-midi.h then
+ * includes this file instead of the board header and mbed.h.
+ *
+ * BufferedSerial reads from a byte span handed over with HostFeed() and
+ * counts (optionally captures) everything written.  Timers only fire on
+ * host_timers_fire(), EventQueue calls run on dispatch_once(). 
+ * host_us_offset() moves the clock ahead.  Single threaded only.
+ */
+#ifndef _SERIAL_MIDI_HOST
+#define _SERIAL_MIDI_HOST
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <sys/types.h>
+
+typedef int PinName;
+#define NC (-1)
+#define USART_TX 0
+#define USART_RX 1
+
+template <typename F> class Callback;
+template <typename R, typename... A> class Callback<R(A...)> {
+public:
+	Callback() {}
+	Callback(std::nullptr_t) {}
+	Callback(R (*fn)(A...)) : func(fn) {}
+	template <typename O> Callback(O *obj, R (O::*method)(A...))
+		: func([obj, method](A... a) { return (obj->*method)(a...); }) {}
+	R operator()(A... a) const { return func(a...); }
+	explicit operator bool() const { return (bool)func; }
+private:
+	std::function<R(A...)> func;
+};
+
+template <typename O, typename R, typename... A>
+Callback<R(A...)> callback(O *obj, R (O::*method)(A...))
+{
+	return Callback<R(A...)>(obj, method);
+}
+
+template <typename R, typename... A>
+Callback<R(A...)> callback(R (*fn)(A...))
+{
+	return Callback<R(A...)>(fn);
+}
+
+
+class BufferedSerial {
+public:
+	enum Parity { None, Odd, Even, Forced1, Forced0 };
+
+	BufferedSerial(PinName, PinName, int = 9600) {}
+	void set_baud(int) {}
+	void set_format(int = 8, Parity = None, int = 1) {}
+	int set_blocking(bool blocking) { (void)blocking; return 0; }
+	void sigio(Callback<void()>) {}
+
+	ssize_t read(void *buf, size_t len) {
+		size_t avail = host_rx_len - host_rx_pos;
+		if(avail == 0) {
+			return -EAGAIN;
+		}
+		if(len > avail) {
+			len = avail;
+		}
+		memcpy(buf, host_rx + host_rx_pos, len);
+		host_rx_pos += len;
+		return (ssize_t)len;
+	}
+	ssize_t write(const void *buf, size_t len) {
+		host_tx_bytes += len;
+		if(host_capture) {
+			const uint8_t *p = (const uint8_t *)buf;
+			host_tx.insert(host_tx.end(), p, p + len);
+		}
+		return (ssize_t)len;
+	}
+	bool readable() const { return host_rx_pos < host_rx_len; }
+
+	// Host side of the "wire"
+	void HostFeed(const uint8_t *data, size_t len) {
+		host_rx = data;
+		host_rx_len = len;
+		host_rx_pos = 0;
+	}
+	const uint8_t *host_rx = nullptr;
+	size_t host_rx_len = 0;
+	size_t host_rx_pos = 0;
+	size_t host_tx_bytes = 0;
+	bool host_capture = false;
+	std::vector<uint8_t> host_tx;
+};
+
+
+class EventQueue {
+public:
+	int call(Callback<void()> cb) { pending.push_back(cb); return 1; }
+	void dispatch_once(void) {
+		std::vector<Callback<void()> > run;
+		run.swap(pending);
+		for(size_t i = 0; i < run.size(); i++) {
+			run[i]();
+		}
+	}
+private:
+	std::vector<Callback<void()> > pending;
+};
+
+inline EventQueue *mbed_event_queue(void)
+{
+	static EventQueue queue;
+	return &queue;
+}
+
+inline EventQueue *mbed_highprio_event_queue(void)
+{
+	static EventQueue queue;
+	return &queue;
+}
+
+
+namespace Kernel {
+struct Clock {
+	typedef std::chrono::duration<uint32_t, std::milli> duration_u32;
+};
+}
+#define osWaitForever 0xFFFFFFFFu
+
+class EventFlags {
+public:
+	uint32_t set(uint32_t f) { flags |= f; return flags; }
+	uint32_t clear(uint32_t f = 0x7FFFFFFF) { flags &= ~f; return flags; }
+	uint32_t get(void) const { return flags; }
+	uint32_t wait_any_for(uint32_t f, Kernel::Clock::duration_u32,
+			bool clear = true) {
+		uint32_t r = flags & f;
+		if(clear) {
+			flags &= ~f;
+		}
+		return r;
+	}
+private:
+	uint32_t flags = 0;
+};
+
+
+class Ticker;
+
+// Attached timers, left to the process exit (static Tickers detach late)
+inline std::vector<Ticker *> &host_timers(void)
+{
+	static std::vector<Ticker *> *timers = new std::vector<Ticker *>;
+	return *timers;
+}
+
+class Ticker {
+public:
+	~Ticker() { detach(); }
+	void attach(Callback<void()> cb, std::chrono::microseconds) {
+		detach();
+		handler = cb;
+		host_timers().push_back(this);
+	}
+	void detach(void) {
+		std::vector<Ticker *> &t = host_timers();
+		t.erase(std::remove(t.begin(), t.end(), this), t.end());
+		handler = nullptr;
+	}
+	void HostFire(void) {
+		Callback<void()> cb = handler;
+		if(once) {
+			detach();
+		}
+		if(cb) {
+			cb();
+		}
+	}
+protected:
+	bool once = false;
+private:
+	Callback<void()> handler;
+};
+
+class Timeout : public Ticker {
+public:
+	Timeout() { once = true; }
+};
+
+// Runs every attached Ticker and Timeout once, as if its time was up
+inline void host_timers_fire(void)
+{
+	std::vector<Ticker *> t = host_timers();
+	for(Ticker *p : t) {
+		p->HostFire();
+	}
+}
+
+
+// Added to the clock, tests use it to move time ahead
+inline uint32_t &host_us_offset(void)
+{
+	static uint32_t offset = 0;
+	return offset;
+}
+
+inline uint32_t us_ticker_read(void)
+{
+	return host_us_offset() + (uint32_t)std::chrono::duration_cast<
+		std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void core_util_critical_section_enter(void) {}
+inline void core_util_critical_section_exit(void) {}
+inline bool core_util_is_isr_active(void) { return false; }
+
+#endif /* _SERIAL_MIDI_HOST */
@@ -8,23 +8,92 @@
  * 
  */
 #include "serial-midi.h"
+#ifndef SERIAL_MIDI_HOST
 #include "mbed.h"
+#endif
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+
+/* Longest control sequence: parameter select MSB/LSB, data MSB/LSB */
+#define MIDI_TX_SEQUENCE_MAX 4
+#define MIDI_TX_UNKNOWN 0xFFFF	// Receiver state not known 
+
+
+/**
+ * Status byte classification, generated at compile time. 
+ * Per status byte: number of data bytes and how to handle the message.
+ * Shared by the parser and the encoder (Send()).  Only these lookups are
+ * table driven, ParseByte() still branches on real-time, SysEx and 
+ * running status and the delivery switches on the message type. 
+ */
+enum : uint8_t {
+	STATUS_LEN_MASK = 0x03, // Number of data bytes 
+	STATUS_DISPATCH = 0x04, // A message, deliver when complete 
+	STATUS_SYSTEM   = 0x08  // System common, cancels running status 
+};
+
+static constexpr uint8_t StatusInfo(unsigned status)
+{
+	return 
+		(status < 0x80) ? 0 :                           // No status 
+		(status < 0xA0) ? (2 | STATUS_DISPATCH) :       // Note OFF/ON
+		(status < 0xB0) ? (2 | STATUS_DISPATCH) :       // Poly aftertouch 
+		(status < 0xC0) ? (2 | STATUS_DISPATCH) :       // Control change
+		(status < 0xE0) ? (1 | STATUS_DISPATCH) :       // Program/Channel AT 
+		(status < 0xF0) ? (2 | STATUS_DISPATCH) :       // Pitch wheel 
+		(status == 0xF1) ? (1 | STATUS_SYSTEM | STATUS_DISPATCH) : // MTC QF
+		(status == 0xF2) ? (2 | STATUS_SYSTEM | STATUS_DISPATCH) : // Song pos.
+		(status == 0xF3) ? (1 | STATUS_SYSTEM | STATUS_DISPATCH) : // Song sel.
+		(status == 0xF6) ? (STATUS_SYSTEM | STATUS_DISPATCH) : // Tune request
+		0;                                              // SysEx, undefined
+}
+
+struct StatusTable {
+	uint8_t info[256]; 
+	constexpr StatusTable() : info() {
+		for(unsigned i = 0; i < 256; i++) {
+			info[i] = StatusInfo(i); 
+		}
+	}
+};
+
+static constexpr StatusTable status_table; 
 
 /**
  * Constructor 
  * Inits the serial USART with MIDI clock speed and 
  * registers delegates for the callbacks of the parser. 
+ * Uses the board default USART_TX/USART_RX pins. 
+ */
+SerialMidi::SerialMidi ( 
+	void (*note_on_handler_ptr)(uint8_t note, uint8_t velocity),
+	void (*realtime_handler_ptr)(uint8_t msg),
+	void (*note_off_handler_ptr)(uint8_t note, uint8_t velocity),
+	void (*control_change_handler_ptr)(uint8_t controller, uint8_t value), 
+	void (*midi_pitchwheel_ptr)(uint8_t valueLSB, uint8_t valueMSB)
+) 
+: SerialMidi(USART_TX, USART_RX, note_on_handler_ptr, realtime_handler_ptr,
+		note_off_handler_ptr, control_change_handler_ptr, midi_pitchwheel_ptr)
+{
+}
+
+
+/**
+ * Constructor for an additional MIDI port on other pins, every instance
+ * has its own USART, buffers, parser state and delegates so several 
+ * ports can run in parallel. 
  */
 SerialMidi::SerialMidi ( 
+	PinName tx, 
+	PinName rx, 
 	void (*note_on_handler_ptr)(uint8_t note, uint8_t velocity),
 	void (*realtime_handler_ptr)(uint8_t msg),
 	void (*note_off_handler_ptr)(uint8_t note, uint8_t velocity),
 	void (*control_change_handler_ptr)(uint8_t controller, uint8_t value), 
 	void (*midi_pitchwheel_ptr)(uint8_t valueLSB, uint8_t valueMSB)
 ) 
-: serial_port(USART_TX, USART_RX, MIDI_BAUD_RATE) 	// Override default constructor
+: serial_port(tx, rx, MIDI_BAUD_RATE) 	// Override default constructor
 {
     // Assign delegate's
     midi_note_on_delegate 		= note_on_handler_ptr;
@@ -32,13 +101,38 @@ SerialMidi::SerialMidi (
     midi_note_off_delegate 		= note_off_handler_ptr;
     midi_control_change_delegate = control_change_handler_ptr;
 	midi_pitchwheel_delegate 	= midi_pitchwheel_ptr; 
-    
+
+	Init(); 
+}
+
+
+/**
+ * Constructor without delegates, for the Poll() API and 
+ * SerialMidiT<Handler> 
+ */
+SerialMidi::SerialMidi(PinName tx, PinName rx)
+: SerialMidi(tx, rx, nullptr, nullptr, nullptr, nullptr, nullptr) 
+{
+}
+
+
+/**
+ * A port with Active Sensing on must leave the shared ticker list. 
+ */
+SerialMidi::~SerialMidi()
+{
+	ActiveSensing(false, false, nullptr); 
+}
+
+
+void SerialMidi::Init(void)
+{
     // init the serial-usart system done via Constructor just to be on the safe
 	// side we set it explicitly below 
     serial_port.set_baud(MIDI_BAUD_RATE);
     serial_port.set_format(
         /* bits */ 		8,
-        /* parity */ 	BufferedSerial::None,
+        /* parity */ 	MidiPort::None,
         /* stop bit */ 	1
     );
 
@@ -49,101 +143,383 @@ SerialMidi::SerialMidi (
 	global_midi_c2 = 0;
 	global_midi_c3 = 0;
 	global_state = SerialMidi::State_machine::RESET; 
+
+	// OMNI, all channels 
+	rx_channel_mask = 0xFFFF; 
+	rx_channel_pass = true; 
+	rx_channel = 0; 
+	rx_parse_us = 0; 
+	rx_timestamp = 0; 
+	rx_irq_us = 0; 
+	rx_irq_hint = false; 
+	rx_param_parse = 0; 
+	rx_param = 0; 
+	control14_handler_delegate = nullptr; 
+	poly_aftertouch_handler_delegate = nullptr; 
+	program_change_handler_delegate = nullptr; 
+	channel_aftertouch_handler_delegate = nullptr; 
+	system_common_handler_delegate = nullptr; 
+	rpn_handler_delegate = nullptr; 
+	nrpn_handler_delegate = nullptr; 
+	RxParameters(false); 
+	clk_seq = 0; 
+	clk_last_us = 0; 
+	clk_avg_q8 = 0; 
+	clk_var = 0; 
+	clk_jmin = 0; 
+	clk_jmax = 0; 
+	clk_song = 0; 
+	clk_count = 0; 
+	clk_samples = 0; 
+	clk_running = false; 
+
+	// SysEx goes into the block pool until a buffer is provided 
+	sysex_handler_delegate = nullptr; 
+	rx_sysex_buf = nullptr; 
+	rx_sysex_size = MIDI_SYSEX_BLOCK_SIZE; 
+	rx_sysex_len = 0; 
+	rx_sysex_done = nullptr; 
+	rx_sysex_chunk = 0; 
+	rx_sysex_flags = 0; 
+	rx_sysex_user = false; 
+	rx_sysex_block = MIDI_SYSEX_NO_BLOCK; 
+	rx_reparse = false; 
+#if MIDI_SYSEX_BLOCK_COUNT
+	sysex_pool_free = (MIDI_SYSEX_BLOCK_COUNT == 32) ? 0xFFFFFFFFu : 
+		((1u << MIDI_SYSEX_BLOCK_COUNT) - 1); 
+#endif
+
+	// Polling by default, see EnableRxInterrupt()
+	rx_event_mode = false; 
+	rx_queue = nullptr; 
+	rx_deferred_pending = false; 
+	rx_ev_head = 0; 
+	rx_ev_tail = 0; 
+
+	// Batched and non-blocking TX are opt-in 
+	global_running_status_tx = 0; 
+	tx_status_expired = false; 
+	RunningStatusRefresh(MIDI_TX_STATUS_REFRESH_MS); 
+#if MIDI_CC_CACHE
+	ControllerCache(false); 
+#endif
+#if MIDI_TX_PARAMETERS
+	tx_sel_nrpn = 0; 
+#endif
+	for(uint8_t ch = 0; ch < 16; ch++) {
+		TxControlReset(ch); 
+	}
+#if MIDI_NOTE_TRACKER
+	memset(tx_notes, 0, sizeof(tx_notes)); 
+	memset(rx_notes, 0, sizeof(rx_notes)); 
+#endif
+
+	tx_batched = false; 
+	tx_nonblocking = false; 
+	tx_optimize = false; 
+	tx_policy = TxPolicy::DROP_NEWEST; 
+	tx_len = 0; 
+	tx_queue_status = 0; 
+	tx_queue_phase = 0; 
+	tx_wire_free_us = 0; 
+	rt_head = 0; 
+	rt_tail = 0; 
+	tx_sysex_ptr = nullptr; 
+	tx_sysex_left = 0; 
+	tx_sysex_at = 0; 
+
+	thru_port = nullptr; 
+	thru_mode = ThruMode::OFF; 
+
+	ResetStats(); 
+	rx_trace = nullptr; 
+
+	rt_busy = false; 
+	clk_tx_next = 0; 
+	clk_tx_interval = 0; 
+	clk_tx_song = 0; 
+	clk_tx_running = false; 
+	clk_tx_queue = nullptr; 
+	clk_tx_pending = false; 
+
+	rx_deliver_hook = nullptr; 
+	sense_next = nullptr; 
+	sense_listed = false; 
+	sense_tx = false; 
+	sense_watch = false; 
+	rx_sense_seen = false; 
+	tx_last_us = 0; 
+	rx_last_us = 0; 
+	rx_sense_lost = false; 
+	sense_queue = nullptr; 
+	connection_lost_handler_delegate = nullptr; 
 }
 
 
-void SerialMidi::NoteON(uint8_t channel, uint8_t key, uint8_t velocity)
+SerialMidi::TxStatus SerialMidi::NoteON(uint8_t channel, uint8_t key, uint8_t velocity)
 {
-	uint8_t buf[4]; 
+	// Running status especially usefull for fast passages 
+	return SendChannelMessage(C_NOTE_ON | channel, key, velocity, 2);
+}
 
-    buf[0] = C_NOTE_ON | channel;
-    buf[1] = key;
-    buf[2] = velocity; 
 
-	// Running status especially usefull for fast passages 
-	if(global_running_status_tx == buf[0]) {
-		serial_port.write(&buf[1], 2);
-	} 
-	else {
-		serial_port.write(buf, 3);
-		global_running_status_tx = buf[0];
+SerialMidi::TxStatus SerialMidi::NoteOFF(uint8_t channel, uint8_t key, uint8_t velocity)
+{
+	// Note On velocity 0 saves the status byte, see OptimizeTx() 
+	if(tx_optimize && TxRunningStatus() == (C_NOTE_ON | channel)) {
+		return SendChannelMessage(C_NOTE_ON | channel, key, 0, 2);
 	}
+	return SendChannelMessage(C_NOTE_OFF | channel, key, velocity, 2);
 }
 
 
-void SerialMidi::NoteOFF(uint8_t channel, uint8_t key, uint8_t velocity)
+SerialMidi::TxStatus SerialMidi::ControlChange(uint8_t channel, uint8_t controller, uint8_t val)
 {
-	uint8_t buf[4]; 
+#if MIDI_CC_CACHE
+	if(cc_cache) {
+		uint16_t slot = (channel & 0x0F) * 128 + (controller & 0x7F); 
+		TxStatus st = CacheUpdate(slot, cc_last[slot] != val); 
+		cc_last[slot] = val; 
+		if(st != TxStatus::OK) {
+			return st; 
+		}
+		st = SendChannelMessage(C_CONTROL_CHANGE | channel, controller, val, 2);
+		CacheSent(slot, st); 
+		return st; 
+	}
+#endif
+	// Running status especially usefull for smooth control change
+	return SendChannelMessage(C_CONTROL_CHANGE | channel, controller, val, 2);
+}
 
-    buf[0] = C_NOTE_OFF | channel;
-    buf[1] = key;
-    buf[2] = velocity; 
 
-	// Running status especially usefull for fast passages 
-	if(global_running_status_tx == buf[0]) {
-		serial_port.write(&buf[1], 2);
-	} 
-	else {
-		serial_port.write(buf, 3);
-		global_running_status_tx = buf[0];
+/**
+ * Generic encoder, any channel or system common message (data bytes as 
+ * the status needs) or real-time byte, the typed senders inline into 
+ * it.  Lengths come from the status table, channel messages use running
+ * status, system common cancels it.  DROPPED for SysEx (SendSysEx()) or
+ * a status that is not a message. 
+ */
+SerialMidi::TxStatus SerialMidi::Send(uint8_t status, uint8_t data1, uint8_t data2)
+{
+	uint8_t info = status_table.info[status]; 
+
+	if(status >= 0xF8) {
+		return SendRealtime(status); 
 	}
+	if(!(info & STATUS_DISPATCH)) {
+		return TxStatus::DROPPED; 
+	}
+	TxStatus st = SendChannelMessage(status, data1 & MIDI_DATA, 
+			data2 & MIDI_DATA, info & STATUS_LEN_MASK); 
+	if(info & STATUS_SYSTEM) {
+		global_running_status_tx = 0; 
+	}
+	return st; 
 }
 
 
-void SerialMidi::ControlChange(uint8_t channel, uint8_t controller, uint8_t val)
+/**
+ * Note Off for every note we sent a Note On for and no Note Off yet, 
+ * with running status (and OptimizeTx()) that is 2 bytes per held note
+ * instead of 128 messages per channel.  A note whose Note Off is 
+ * dropped stays held, calling this again retries it. 
+ * Without MIDI_NOTE_TRACKER it sends All Notes Off (CC 123) instead. 
+ */
+SerialMidi::TxStatus SerialMidi::AllNotesOff(uint8_t channel)
 {
-	uint8_t buf[4]; 
-	
-    buf[0] = C_CONTROL_CHANGE | channel;
-    buf[1] = controller;
-    buf[2] = val; 
-
-	// Running status especially usefull for smooth control change
-	if(global_running_status_tx == buf[0]) {
-		serial_port.write(&buf[1], 2);
-	} 
-	else {
-		serial_port.write(buf, 3);
-		global_running_status_tx = buf[0];
+	channel &= 0x0F; 
+#if MIDI_NOTE_TRACKER
+	TxStatus result = TxStatus::OK; 
+	for(uint8_t w = 0; w < 4; w++) {
+		uint32_t held = tx_notes[channel][w]; 
+		while(held) {
+			uint8_t bit = (uint8_t)__builtin_ctz(held); 
+			held &= held - 1; 
+			if(NoteOFF(channel, (uint8_t)(w * 32 + bit), 0x40) == 
+					TxStatus::DROPPED) {
+				result = TxStatus::DROPPED; 
+			}
+		}
 	}
+	return result; 
+#else
+	return SendChannelMessage(C_CONTROL_CHANGE | channel, 
+			CTL_ALL_NOTES_OFF, 0, 2); 
+#endif
 }
 
 
-void SerialMidi::ChannelAfterTouch(uint8_t channel, uint8_t val)
+/**
+ * Stuck note recovery, AllNotesOff() on all 16 channels.  Only held 
+ * notes go out so it takes a few ms, not the seconds of a brute force 
+ * 16 x 128 Note Off. 
+ */
+SerialMidi::TxStatus SerialMidi::Panic(void)
 {
+	TxStatus result = TxStatus::OK; 
 
-	uint8_t buf[4]; 
-	
-    buf[0] = C_CHANNEL_AFTERTOUCH| channel;
-    buf[1] = val;
- 
-	if(global_running_status_tx == buf[0]) {
-		serial_port.write(&buf[1], 1);
-	} 
-	else {
-		serial_port.write(buf, 2);
-		global_running_status_tx = buf[0];
+	for(uint8_t channel = 0; channel < 16; channel++) {
+		if(AllNotesOff(channel) == TxStatus::DROPPED) {
+			result = TxStatus::DROPPED; 
+		}
 	}
+	return result; 
+}
+
+
+bool SerialMidi::TxNoteActive(uint8_t channel, uint8_t key) const
+{
+#if MIDI_NOTE_TRACKER
+	return (tx_notes[channel & 0x0F][(key >> 5) & 3] >> (key & 31)) & 1; 
+#else
+	(void)channel; 
+	(void)key; 
+	return false; 
+#endif
 }
 
 
 /**
- * Modulation Wheel both LSB and MSB  MIDI sends LSB dirst.  
+ * Modulation Wheel both MSB and LSB, see ControlChange14(). 
  * range: 0 --> 16383
  * only a 14 bit value 
  */
-void SerialMidi::ModWheel(uint8_t channel, uint16_t val)
+SerialMidi::TxStatus SerialMidi::ModWheel(uint8_t channel, uint16_t val)
 {	
-    ControlChange(channel, CTL_LSB_MODWHEEL,  ~(CHANNEL_VOICE_MASK) & val);
-    ControlChange(channel, CTL_MSB_MODWHEEL,  ~(CHANNEL_VOICE_MASK) & (val>>7));
+	return ControlChange14(channel, CTL_MSB_MODWHEEL, val); 
+}
+
+
+/**
+ * Appends the control changes that take the receiver from what it has 
+ * (cur, MIDI_TX_UNKNOWN: anything) to value.  An MSB resets the LSB to 
+ * 0 at the receiver so the LSB follows a new MSB unless it is 0, an 
+ * unchanged MSB is not sent again.  returns the number of pairs. 
+ */
+static uint8_t Control14Pairs(uint8_t *pairs, uint8_t controller, 
+		uint16_t cur, uint16_t value)
+{
+	uint8_t msb = (value >> 7) & MIDI_DATA; 
+	uint8_t lsb = value & MIDI_DATA; 
+	uint8_t n = 0; 
+
+	if(cur == MIDI_TX_UNKNOWN || (cur >> 7) != msb) {
+		pairs[n++] = controller; 
+		pairs[n++] = msb; 
+		cur = (uint16_t)msb << 7; 
+	}
+	if((cur & MIDI_DATA) != lsb) {
+		pairs[n++] = controller + 32; 
+		pairs[n++] = lsb; 
+	}
+	return n / 2; 
+}
+
+
+/**
+ * 14 bit control change (controller 0..31, its LSB is controller + 32)
+ * in one block with as few bytes as possible: MSB and LSB with one 
+ * status byte, only the LSB when the MSB did not change, only the MSB
+ * when the LSB is 0.  SUPPRESSED when the receiver has the value.  
+ * range: 0 --> 16383
+ */
+SerialMidi::TxStatus SerialMidi::ControlChange14(uint8_t channel, 
+		uint8_t controller, uint16_t val)
+{
+	uint8_t pairs[2 * MIDI_TX_SEQUENCE_MAX]; 
+	uint16_t cur = MIDI_TX_UNKNOWN; 
+
+	channel &= 0x0F; 
+	controller &= 0x1F; 
+#if MIDI_TX_PARAMETERS
+	cur = tx_cc14[channel][controller]; 
+#endif
+	return SendControlSequence(channel, pairs, 
+			Control14Pairs(pairs, controller, cur, val)); 
+}
+
+
+/**
+ * RPN/NRPN data entry (CC 6/38) as one block.  The parameter number 
+ * CCs (101/100 resp. 99/98) are only sent when another parameter is 
+ * selected, the data entry like ControlChange14().  
+ * number and val: 0 --> 16383
+ */
+SerialMidi::TxStatus SerialMidi::SendParameter(uint8_t channel, bool nrpn, 
+		uint16_t number, uint16_t val)
+{
+	uint8_t pairs[2 * MIDI_TX_SEQUENCE_MAX]; 
+	uint8_t n = 0; 
+	uint8_t msb = (number >> 7) & MIDI_DATA; 
+	uint8_t lsb = number & MIDI_DATA; 
+	uint16_t cur = MIDI_TX_UNKNOWN; 
+
+	channel &= 0x0F; 
+#if MIDI_TX_PARAMETERS
+	bool same = (nrpn == (((tx_sel_nrpn >> channel) & 1) != 0)); 
+	if(!same || tx_sel_msb[channel] != msb) {
+		pairs[2 * n] = nrpn ? CTL_NRPN_MSB : CTL_RPN_MSB; 
+		pairs[2 * n + 1] = msb; 
+		n++; 
+	}
+	if(!same || tx_sel_lsb[channel] != lsb) {
+		pairs[2 * n] = nrpn ? CTL_NRPN_LSB : CTL_RPN_LSB; 
+		pairs[2 * n + 1] = lsb; 
+		n++; 
+	}
+	if(n == 0) {
+		cur = tx_cc14[channel][CTL_MSB_DATA_ENTRY]; 
+	}
+#else
+	pairs[0] = nrpn ? CTL_NRPN_MSB : CTL_RPN_MSB; 
+	pairs[1] = msb; 
+	pairs[2] = nrpn ? CTL_NRPN_LSB : CTL_RPN_LSB; 
+	pairs[3] = lsb; 
+	n = 2; 
+#endif
+	n += Control14Pairs(&pairs[2 * n], CTL_MSB_DATA_ENTRY, cur, val); 
+	return SendControlSequence(channel, pairs, n); 
+}
+
+
+SerialMidi::TxStatus SerialMidi::Rpn(uint8_t channel, uint16_t number, 
+		uint16_t val)
+{
+	return SendParameter(channel, false, number, val); 
+}
+
+
+SerialMidi::TxStatus SerialMidi::Nrpn(uint8_t channel, uint16_t number, 
+		uint16_t val)
+{
+	return SendParameter(channel, true, number, val); 
+}
+
+
+/**
+ * Receiver state of channel unknown, after Reset Controllers (CC 121) 
+ * or System Reset.  The next 14 bit/RPN/NRPN send is complete. 
+ */
+void SerialMidi::TxControlReset(uint8_t channel)
+{
+#if MIDI_TX_PARAMETERS
+	for(uint8_t ctl = 0; ctl < 32; ctl++) {
+		tx_cc14[channel & 0x0F][ctl] = MIDI_TX_UNKNOWN; 
+	}
+	tx_sel_msb[channel & 0x0F] = 0xFF; 
+	tx_sel_lsb[channel & 0x0F] = 0xFF; 
+#else
+	(void)channel; 
+#endif
 }
 
 /* 
  * If we only want to send a MSB with a 8 bit value this one will be used 
  */
-void SerialMidi::ModWheel(uint8_t channel, uint8_t val)
+SerialMidi::TxStatus SerialMidi::ModWheel(uint8_t channel, uint8_t val)
 {	
-    ControlChange(channel, CTL_MSB_MODWHEEL,  ~(CHANNEL_VOICE_MASK) & val);
+    return ControlChange(channel, CTL_MSB_MODWHEEL,  ~(CHANNEL_VOICE_MASK) & val);
 }
 
 
@@ -153,22 +529,28 @@ void SerialMidi::ModWheel(uint8_t channel, uint8_t val)
  *       LOW   MIDDLE   HIGH
  * range: 0 --> 8192  --> 16383
  */
-void SerialMidi::PitchWheel(uint8_t channel, uint16_t val)
+SerialMidi::TxStatus SerialMidi::PitchWheel(uint8_t channel, uint16_t val)
 {
-	uint8_t buf[4]; 
-	
-    buf[0] = C_PITCH_WHEEL | channel;
-    buf[1] = val & ~(CHANNEL_VOICE_MASK);
-	buf[2] = (val>>7) & ~(CHANNEL_VOICE_MASK);
-
-	// Running status especially usefull for smooth control change
-	if(global_running_status_tx == buf[0]) {
-		serial_port.write(&buf[1], 2);
-	} 
-	else {
-		serial_port.write(buf, 3);
-		global_running_status_tx = buf[0];
+#if MIDI_CC_CACHE
+	if(cc_cache) {
+		uint16_t slot = 16 * 128 + (channel & 0x0F); 
+		TxStatus st = CacheUpdate(slot, pw_last[channel & 0x0F] != val); 
+		pw_last[channel & 0x0F] = val; 
+		if(st != TxStatus::OK) {
+			return st; 
+		}
+		st = SendChannelMessage(C_PITCH_WHEEL | channel, 
+				val & ~(CHANNEL_VOICE_MASK), 
+				(val>>7) & ~(CHANNEL_VOICE_MASK), 
+				2);
+		CacheSent(slot, st); 
+		return st; 
 	}
+#endif
+	return SendChannelMessage(C_PITCH_WHEEL | channel, 
+			val & ~(CHANNEL_VOICE_MASK), 
+			(val>>7) & ~(CHANNEL_VOICE_MASK), 
+			2);
 }
 
 /**
@@ -177,202 +559,2579 @@ void SerialMidi::PitchWheel(uint8_t channel, uint16_t val)
  *       LOW   MIDDLE   HIGH
  * range: -8192   0     8192 
  */
-void SerialMidi::PitchWheel(uint8_t channel, int16_t val)
+SerialMidi::TxStatus SerialMidi::PitchWheel(uint8_t channel, int16_t val)
 {
 	uint16_t pitch = uint16_t(val + 0x2000);	
-	PitchWheel(channel, pitch);
+	return PitchWheel(channel, pitch);
 }
 
 
-inline void SerialMidi::TimingClock(void)
+/**
+ * Encodes a channel message applying running status and hands it to
+ * Transmit().  data_len is the number of data bytes (1 or 2). 
+ * In non-blocking mode the TX policy decides what happens when the 
+ * TX queue is full. 
+ */
+SerialMidi::TxStatus SerialMidi::SendChannelMessage(uint8_t status, 
+		uint8_t data1, uint8_t data2, uint8_t data_len)
 {
-	uint8_t c = RT_TIMING_CLOCK;
-	serial_port.write(&c,1);
+	uint8_t buf[4]; 
+	uint8_t len = 0; 
+
+	TxBatchRoom(1 + data_len); 
+	uint8_t running = TxRunningStatus(); 
+	if(running != status) {
+		buf[len++] = status; 
+	}
+	if(data_len > 0) {
+		buf[len++] = data1; 
+	}
+	if(data_len == 2) {
+		buf[len++] = data2; 
+	}
+
+	if(tx_nonblocking && (tx_len + len > sizeof(tx_buf))) {
+		ServiceTx(); 
+	}
+	if(tx_nonblocking && (tx_len + len > sizeof(tx_buf)) && 
+			tx_policy == TxPolicy::DROP_OLDEST_SAME_CONTROLLER && 
+			(status & 0xF0) == C_CONTROL_CHANGE && 
+			ReplaceQueuedControlChange(status, data1, data2)) {
+		return TxStatus::REPLACED; 
+	}
+	if(TxReserve(len) != TxStatus::OK) {
+		return TxStatus::DROPPED; 
+	}
+
+	if(tx_len == 0 && tx_sysex_left == 0) {
+		// Empty queue, the wire is at our running status 
+		tx_queue_status = running; 
+		tx_queue_phase = 0; 
+	}
+	MIDI_STAT(stats.tx_messages[MidiStatIndex(status)]++); 
+	MIDI_STAT(stats.tx_running_status_hits += (running == status)); 
+	global_running_status_tx = status;
+#if MIDI_NOTE_TRACKER
+	NoteTrack(tx_notes, status & 0xF0, status & 0x0F, data1, data2); 
+#endif
+	if((status & 0xF0) == C_CONTROL_CHANGE) {
+		TxControlTrack(status & 0x0F, data1, data2); 
+	}
+#if MIDI_CC_CACHE
+	// Also for Send(), SendEvent() and thru, the cache follows the wire 
+	if((status & 0xF0) == C_CONTROL_CHANGE) {
+		CacheTrack((status & 0x0F) * 128 + (data1 & 0x7F), data2); 
+	}
+	else if((status & 0xF0) == C_PITCH_WHEEL) {
+		CacheTrack(16 * 128 + (status & 0x0F), data1 | (data2 << 7)); 
+	}
+#endif
+	Transmit(buf, len); 
+	return TxStatus::OK; 
 }
 
 
-inline void SerialMidi::Start(void)
+/**
+ * Batched TX, flushes a batch that has no room for len more bytes before
+ * the next message is encoded: Flush() may regroup the batch and leave 
+ * the running status on another channel. 
+ */
+void SerialMidi::TxBatchRoom(size_t len)
 {
-	uint8_t c = RT_START;
-	serial_port.write(&c,1);
+	if(tx_batched && !tx_nonblocking && tx_len + len > sizeof(tx_buf)) {
+		Flush(); 
+	}
 }
 
 
-inline void SerialMidi::Continue(void)
+/**
+ * Non-blocking TX, makes room for len more bytes according to the 
+ * policy.  DROPPED (counted) when there is none, OK otherwise. 
+ */
+SerialMidi::TxStatus SerialMidi::TxReserve(size_t len)
 {
-	uint8_t c = RT_CONTINUE;
-	serial_port.write(&c,1);
+	if(!tx_nonblocking || tx_len + len <= sizeof(tx_buf)) {
+		return TxStatus::OK; 
+	}
+	ServiceTx(); 
+	if(tx_len + len <= sizeof(tx_buf)) {
+		return TxStatus::OK; 
+	}
+	if(tx_policy != TxPolicy::BLOCK) {
+		MIDI_STAT(stats.tx_dropped++); 
+		return TxStatus::DROPPED; 
+	}
+	FlushBlocking(); 
+	return TxStatus::OK; 
 }
 
 
-inline void SerialMidi::Stop(void)
+/**
+ * Several control changes of one channel as a single block, one status
+ * byte at most and one write.  pairs: controller, value, ... 
+ * Queued, sent or dropped as a whole. 
+ */
+SerialMidi::TxStatus SerialMidi::SendControlSequence(uint8_t channel, 
+		const uint8_t *pairs, uint8_t count)
 {
-	uint8_t c = RT_STOP;
-	serial_port.write(&c,1);
+	uint8_t buf[1 + 2 * MIDI_TX_SEQUENCE_MAX]; 
+	uint8_t len = 0; 
+	uint8_t status = C_CONTROL_CHANGE | (channel & 0x0F); 
+
+	if(count == 0) {
+		return TxStatus::SUPPRESSED; 
+	}
+	TxBatchRoom(1 + 2 * count); 
+	uint8_t running = TxRunningStatus(); 
+	if(running != status) {
+		buf[len++] = status; 
+	}
+	memcpy(&buf[len], pairs, 2 * count); 
+	len += 2 * count; 
+	if(TxReserve(len) != TxStatus::OK) {
+		return TxStatus::DROPPED; 
+	}
+
+	if(tx_len == 0 && tx_sysex_left == 0) {
+		tx_queue_status = running; 
+		tx_queue_phase = 0; 
+	}
+	MIDI_STAT(stats.tx_messages[MidiStatIndex(status)] += count); 
+	MIDI_STAT(stats.tx_running_status_hits += count - (running != status)); 
+	global_running_status_tx = status;
+	for(uint8_t i = 0; i < count; i++) {
+#if MIDI_NOTE_TRACKER
+		NoteTrack(tx_notes, C_CONTROL_CHANGE, channel, pairs[2 * i], 
+				pairs[2 * i + 1]); 
+#endif
+#if MIDI_CC_CACHE
+		CacheTrack((channel & 0x0F) * 128 + (pairs[2 * i] & 0x7F), 
+				pairs[2 * i + 1]); 
+#endif
+		TxControlTrack(channel, pairs[2 * i], pairs[2 * i + 1]); 
+	}
+	Transmit(buf, len); 
+	return TxStatus::OK; 
 }
 
 
-inline void SerialMidi::Active_Sensing(void)
+/**
+ * What the receiver knows of 14 bit controllers and the RPN/NRPN 
+ * selection, from every control change sent.  An MSB resets the LSB 
+ * (MIDI 1.0), a new selection makes the data entry value unknown. 
+ */
+void SerialMidi::TxControlTrack(uint8_t channel, uint8_t ctl, uint8_t val)
 {
-	uint8_t c = RT_ACTIVE_SENSING;
-	serial_port.write(&c,1);
+#if MIDI_TX_PARAMETERS
+	uint16_t *cc14 = tx_cc14[channel & 0x0F]; 
+
+	if(ctl < 32) {
+		cc14[ctl] = (uint16_t)val << 7; 
+	}
+	else if(ctl < 64) {
+		if(cc14[ctl - 32] != MIDI_TX_UNKNOWN) {
+			cc14[ctl - 32] = (cc14[ctl - 32] & 0x3F80) | val; 
+		}
+	}
+	else if(ctl >= CTL_NRPN_LSB && ctl <= CTL_RPN_MSB) {
+		uint16_t bit = 1u << (channel & 0x0F); 
+		bool nrpn = (ctl <= CTL_NRPN_MSB); 
+		uint8_t &half = (ctl & 1) ? tx_sel_msb[channel & 0x0F] : 
+				tx_sel_lsb[channel & 0x0F]; 
+		if(nrpn != ((tx_sel_nrpn & bit) != 0) || half != val) {
+			// Another parameter, its value is unknown 
+			cc14[CTL_MSB_DATA_ENTRY] = MIDI_TX_UNKNOWN; 
+		}
+		half = val; 
+		tx_sel_nrpn = nrpn ? (tx_sel_nrpn | bit) : (tx_sel_nrpn & ~bit); 
+	}
+	else if(ctl == CTL_RESET_CONTROLLERS) {
+		TxControlReset(channel); 
+	}
+#else
+	(void)channel; 
+	(void)ctl; 
+	(void)val; 
+#endif
 }
 
 
-inline void SerialMidi::Reset(void)
+
+/**
+ * Writes encoded bytes to the USART, or in batched/non-blocking mode 
+ * appends them to the TX block.  A full batch is flushed automatically. 
+ */
+void SerialMidi::Transmit(const uint8_t *buf, size_t len)
 {
-	uint8_t c = RT_RESET;
-	serial_port.write(&c,1);
+	if(!tx_batched && !tx_nonblocking) {
+		PortWrite(buf, len);
+		return; 
+	}
+	if(tx_len + len > sizeof(tx_buf)) {
+		Flush(); 
+	}
+	memcpy(&tx_buf[tx_len], buf, len); 
+	tx_len += len; 
+	TxHighWater(); 
+
+	if(!tx_batched) {
+		ServiceTx(); 
+	}
 }
 
 
+/**
+ * Batched TX mode: channel messages are collected in a fixed size block 
+ * (running status applies across the whole batch) and written to the 
+ * USART in one go on Flush().  Real-time messages are never batched. 
+ * Disabling batched mode flushes what is pending. 
+ */
+void SerialMidi::BatchedTx(bool enable)
+{
+	if(!enable) {
+		Flush(); 
+	}
+	tx_batched = enable; 
+}
 
-char * SerialMidi::Text() 
+
+/**
+ * Running status optimizer: a Note Off goes out as Note On velocity 0 
+ * whenever that saves the status byte (the release velocity is lost).
+ * In batched mode Flush() also regroups the batch per channel, the 
+ * order of the messages within a channel is kept so e.g. sustain pedal
+ * and notes stay in sequence. 
+ */
+void SerialMidi::OptimizeTx(bool enable)
 {
-	static char buf[64];
-	snprintf(buf, 64,
-			"run_tx:%2X,run_rx:%2X,3rd_byte:%2X",  
-			global_running_status_tx, 
-			global_running_status_rx,
-			global_3rd_byte_flag ); 
-			// FIXME  global_state
-	return buf; 
+	tx_optimize = enable; 
 }
 
 
 /**
- * MIDI Parser
+ * Running status refresh: a receiver connected mid-stream can not decode
+ * running status data until it sees a status byte.  Every timeout_ms the
+ * TX running status is forgotten so the next message goes out with its
+ * status byte, this bounds the recovery time while keeping the savings
+ * in dense passages.  0 turns the refresh off. 
  */
-void SerialMidi::ReceiveParser(void)
+void SerialMidi::RunningStatusRefresh(uint32_t timeout_ms)
 {
-	uint8_t c;
+	tx_status_ticker.detach(); 
+	if(timeout_ms) {
+		tx_status_ticker.attach(callback(this, 
+				&SerialMidi::RunningStatusExpired), 
+				std::chrono::milliseconds(timeout_ms)); 
+	}
+}
 
-    // Read one byte from the circular FIFO input buffer
-    // This buffer is filled by the ISR routine on receipt of
-    // data on the port.
-    if( serial_port.read(&c, 1) == 0) {
-		return;
+
+/**
+ * Controller cache for ControlChange(), ModWheel() and PitchWheel(): a value 
+ * equal to the last one sent is SUPPRESSED.  With min_interval_ms each 
+ * controller is sent at most once per interval, updates in between are 
+ * DEFERRED and only the latest value goes out when the next interval 
+ * starts, from ServiceControllers() (called by ServiceTx() as well). 
+ * Enabling (again) forgets all values so everything is sent once. 
+ * Does nothing when built with MIDI_CC_CACHE 0. 
+ */
+void SerialMidi::ControllerCache(bool enable, uint32_t min_interval_ms)
+{
+#if MIDI_CC_CACHE
+	cc_cache = false; 
+	memset(cc_last, 0xFF, sizeof(cc_last)); 
+	memset(pw_last, 0xFF, sizeof(pw_last)); 
+	memset(cc_pending, 0, sizeof(cc_pending)); 
+	memset(cc_sent, 0, sizeof(cc_sent)); 
+	cc_interval_us = min_interval_ms * 1000; 
+	cc_window_start = us_ticker_read(); 
+	cc_cache = enable; 
+#else
+	(void)enable; 
+	(void)min_interval_ms; 
+#endif
+}
+
+
+/**
+ * Starts a new rate limit window once the interval has passed and sends
+ * the latest value of every deferred controller.  Call regularly, e.g. 
+ * from the scan loop, when the controller rate limit is used.
+ */
+void SerialMidi::ServiceControllers(void)
+{
+#if MIDI_CC_CACHE
+	uint32_t now = us_ticker_read(); 
+
+	if(!cc_cache || cc_interval_us == 0 || 
+			(now - cc_window_start) < cc_interval_us) {
+		return; 
 	}
-	//printf("%2X ", c);
-	// MIDI through (kind of with some processing delay)
-	//serial_port.write(&c,1);
-    
-    // Check if bit7 = 1
-    if ( c & CHANNEL_VOICE_MASK ) {
-	    // if (! (c & SYSTEM_REALTIME_MASK)) {
-		// is it a real-time message?  0xF8 up to 0xFF
-        if (c >= 0xF8 ) {
-			realtime_handler_delegate(c);
-            return;
-        }
-        else {
-            global_running_status_rx = c;
-            global_3rd_byte_flag = 0;
-            // Is this a tune request
-            if(c == SYSTEM_TUNE_REQUEST) {
-                global_midi_c2 = c; // Store in FIFO.
-                // TODO: Process something.
-                return;
-            }
-            // Do nothing
-            // Ignore for now.
-            return;
-        }
-    }
-    else {  // Bit 7 == 0   (data)
-	    if(global_3rd_byte_flag == 1) {
-            global_3rd_byte_flag = 0;
-            global_midi_c3 = c;
-
-			// We don't care about the input channel (OMNI) for now.
-            global_running_status_rx &= 0xF0;
-            if(global_running_status_rx == C_NOTE_ON){
-				if(global_midi_c3 == 0 ) {
-					// Most MIDI implementation use velocity zero
-					// as a note-off.  
-					midi_note_off_delegate(global_midi_c2, global_midi_c3);
-					return;
-				}  
-				else {
-	            	midi_note_on_delegate(global_midi_c2, global_midi_c3);
-					return;
-				}
-				return;
-            }
-            else if(global_running_status_rx == C_NOTE_OFF) {
-                midi_note_off_delegate(global_midi_c2, global_midi_c3);
-                return;
-            }
-			else if(global_running_status_rx == C_PITCH_WHEEL) {
-				midi_pitchwheel_delegate(global_midi_c2, global_midi_c3);
-				return; 
-			}
-			else if(global_running_status_rx == C_PROGRAM_CHANGE) {
-				return; 
+	cc_window_start = now; 
+	memset(cc_sent, 0, sizeof(cc_sent)); 
+	for(uint16_t w = 0; w < (MIDI_CC_SLOTS + 31) / 32; w++) {
+		while(cc_pending[w]) {
+			uint16_t bit = __builtin_ctz(cc_pending[w]); 
+			uint16_t slot = w * 32 + bit; 
+			TxStatus st; 
+			cc_pending[w] &= ~(1u << bit); 
+			cc_sent[w] |= 1u << bit; 
+			if(slot < 16 * 128) {
+				st = SendChannelMessage(C_CONTROL_CHANGE | (slot >> 7), 
+						slot & 0x7F, cc_last[slot], 2); 
 			}
-			else if(global_running_status_rx ==  C_POLYPHONIC_AFTERTOUCH) {
-				return; 
+			else {
+				uint16_t val = pw_last[slot - 16 * 128]; 
+				st = SendChannelMessage(C_PITCH_WHEEL | (slot - 16 * 128), 
+						val & ~(CHANNEL_VOICE_MASK), 
+						(val>>7) & ~(CHANNEL_VOICE_MASK), 2); 
 			}
-			else if(global_running_status_rx ==  C_CHANNEL_AFTERTOUCH) {
+			if(st == TxStatus::DROPPED) {
+				// Queue full, retry in the next window 
+				cc_pending[w] |= 1u << bit; 
 				return; 
 			}
-            else if(global_running_status_rx == C_CONTROL_CHANGE) {
-                midi_control_change_delegate(global_midi_c2, global_midi_c3);
-                return;
-            }
-			//else {
-			//	return; 
-			//	}
-        }
-        else {
-            if(global_running_status_rx == 0) {
-                // Ignore data Byte if running status is  0
-                return;
-            }
-            else {
-                if (global_running_status_rx < 0xC0) { // All 2 byte commands
-                    global_3rd_byte_flag = 1;
-                    global_midi_c2 = c;
-                    // At this stage we have only 1 byte out of 2.
-                    return;
-                }
-                else if (global_running_status_rx < 0xE0) {    // All 1 byte commands
-                    global_midi_c2 = c;
-                    // TODO: !! Process callback/delegate for two bytes command.
-                    return;
-                }
-                else if ( global_running_status_rx < 0xF0){
-                    global_3rd_byte_flag = 1;
-                    global_midi_c2 = c;
-                }
-				//!!
-                else if ( global_running_status_rx >= 0xF0) {
-                    if (global_running_status_rx == 0xF2) {
-                        global_running_status_rx = 0;
-                        global_3rd_byte_flag = 1;
-                        global_midi_c2 = c;
-                        return;
-                    }
-                    else if (global_running_status_rx >= 0xF0 ){
-                        if(global_running_status_rx == 0xF3 ||
-                           global_running_status_rx == 0xF3 ) {
-                            global_running_status_rx = 0;
-                            global_midi_c2 = c;
-                            // TODO: !! Process callback for two bytes command.
-                            return;
-                        }
-                        else {
-                            // Ignore status
-                            global_running_status_rx = 0;
-                            return;
-                        }
-                    }
-                }
-            }  
-        }  // global_3rd_byte_flag
-    } // end of data bit 7 == 0
-
-} // End of SerialMidiReceiveParser
+		}
+	}
+#endif
+}
+
+
+#if MIDI_CC_CACHE
+
+/**
+ * Decides if a controller update is sent now (OK), later (DEFERRED) or 
+ * not at all (SUPPRESSED).  changed: value differs from the cached one. 
+ */
+SerialMidi::TxStatus SerialMidi::CacheUpdate(uint16_t slot, bool changed)
+{
+	uint32_t bit = 1u << (slot & 31); 
+
+	if(cc_pending[slot >> 5] & bit) {
+		return TxStatus::DEFERRED; 
+	}
+	if(!changed) {
+		return TxStatus::SUPPRESSED; 
+	}
+	if(cc_interval_us) {
+		if(cc_sent[slot >> 5] & bit) {
+			cc_pending[slot >> 5] |= bit; 
+			return TxStatus::DEFERRED; 
+		}
+		cc_sent[slot >> 5] |= bit; 
+	}
+	return TxStatus::OK; 
+}
+
+
+/**
+ * A dropped value is forgotten so the next update is sent again. 
+ */
+void SerialMidi::CacheSent(uint16_t slot, TxStatus st)
+{
+	if(st != TxStatus::DROPPED) {
+		return; 
+	}
+	if(slot < 16 * 128) {
+		cc_last[slot] = 0xFF; 
+	}
+	else {
+		pw_last[slot - 16 * 128] = 0xFFFF; 
+	}
+}
+
+
+/**
+ * Value that went out on the wire, a deferred update of the same slot
+ * is dropped as the receiver has this newer value. 
+ */
+void SerialMidi::CacheTrack(uint16_t slot, uint16_t val)
+{
+	if(slot < 16 * 128) {
+		cc_last[slot] = (uint8_t)val; 
+	}
+	else {
+		pw_last[slot - 16 * 128] = val; 
+	}
+	cc_pending[slot >> 5] &= ~(1u << (slot & 31)); 
+}
+#endif
+
+
+/**
+ * Ticker (ISR) context.  Only flags the expiry, the encoder resets its
+ * state in TxRunningStatus(), bytes already queued are not touched. 
+ */
+void SerialMidi::RunningStatusExpired(void)
+{
+	tx_status_expired.store(true, std::memory_order_relaxed); 
+}
+
+
+/**
+ * TX running status for the encoder.  global_running_status_tx has a 
+ * single writer (the sending context), a refresh that fires between its
+ * read and the write back of a send is taken by the next send. 
+ */
+uint8_t SerialMidi::TxRunningStatus(void)
+{
+	if(tx_status_expired.exchange(false, std::memory_order_relaxed)) {
+		global_running_status_tx = 0; 
+	}
+	return global_running_status_tx; 
+}
+
+
+/**
+ * Re-encodes the queued channel messages grouped per channel, starting
+ * with the channel of the running status on the wire.  The batch is 
+ * left as it is when it holds anything but complete channel messages
+ * (SysEx stream, raw thru data, real-time). 
+ */
+void SerialMidi::OptimizeBatch(void)
+{
+	struct Msg {
+		uint8_t status, data1, data2; 
+	}; 
+	Msg msgs[MIDI_TX_BUFFER_SIZE]; 
+	size_t count = 0; 
+	uint8_t status = tx_queue_status; 
+	uint8_t phase = tx_queue_phase; 
+
+	if(tx_len == 0 || tx_sysex_left || phase != 0) {
+		return; 
+	}
+	for(size_t i = 0; i < tx_len; i++) {
+		uint8_t c = tx_buf[i]; 
+		if(c >= 0xF0) {
+			return; 
+		}
+		if(c & CHANNEL_VOICE_MASK) {
+			if(phase != 0) {
+				return; 
+			}
+			status = c; 
+			continue; 
+		}
+		if(status == 0) {
+			return; 
+		}
+		if(phase == 0) {
+			msgs[count].status = status; 
+			msgs[count].data1 = c; 
+			msgs[count].data2 = 0; 
+			count++; 
+		}
+		else {
+			msgs[count - 1].data2 = c; 
+		}
+		if(++phase >= MidiDataLength(status)) {
+			phase = 0; 
+		}
+	}
+	if(phase != 0) {
+		return; 
+	}
+
+	// Emit order: channel of the wire running status first, then the 
+	// other channels in order of first appearance 
+	uint8_t order[MIDI_TX_BUFFER_SIZE]; 
+	size_t n = 0; 
+	uint16_t done = 0; 
+	uint8_t first = tx_queue_status ? (tx_queue_status & 0x0F) : 
+		(msgs[0].status & 0x0F); 
+	for(size_t pass = 0; n < count; pass++) {
+		uint8_t ch = first; 
+		if(pass > 0) {
+			size_t j = 0; 
+			while(done & (1 << (msgs[j].status & 0x0F))) {
+				j++; 
+			}
+			ch = msgs[j].status & 0x0F; 
+		}
+		done |= 1 << ch; 
+		for(size_t j = 0; j < count; j++) {
+			if((msgs[j].status & 0x0F) == ch) {
+				order[n++] = (uint8_t)j; 
+			}
+		}
+	}
+
+	uint8_t out[MIDI_TX_BUFFER_SIZE]; 
+	size_t len = 0; 
+	uint8_t running = tx_queue_status; 
+	for(size_t k = 0; k < count; k++) {
+		Msg m = msgs[order[k]]; 
+		uint8_t on = C_NOTE_ON | (m.status & 0x0F); 
+		if((m.status & 0xF0) == C_NOTE_OFF && (running == on || 
+				(k + 1 < count && msgs[order[k + 1]].status == on))) {
+			m.status = on; 
+			m.data2 = 0; 
+		}
+		if(m.status != running) {
+			out[len++] = m.status; 
+			running = m.status; 
+		}
+		out[len++] = m.data1; 
+		if(MidiDataLength(m.status) == 2) {
+			out[len++] = m.data2; 
+		}
+	}
+	if(len > tx_len) {
+		return; 
+	}
+	memcpy(tx_buf, out, len); 
+	tx_len = len; 
+	global_running_status_tx = running; 
+}
+
+
+/**
+ * Hands the pending TX block to the USART in a single write.  
+ * Typically called at the end of a sequencer tick. 
+ * In non-blocking mode only what the USART accepts right now is written. 
+ */
+void SerialMidi::Flush(void)
+{
+	if(tx_batched && tx_optimize) {
+		OptimizeBatch(); 
+	}
+	if(tx_nonblocking) {
+		ServiceTx(); 
+	}
+	else {
+		FlushBlocking(); 
+	}
+}
+
+
+/**
+ * Non-blocking TX mode: send methods never wait for the USART, messages
+ * are queued in the TX block and drained by ServiceTx().  When the queue 
+ * is full the policy decides: 
+ *   BLOCK        wait for the USART (as in blocking mode)
+ *   DROP_NEWEST  the new message is not sent, DROPPED is returned
+ *   DROP_OLDEST_SAME_CONTROLLER  a queued Control Change for the same 
+ *                channel/controller gets the new value (REPLACED),
+ *                otherwise the new message is dropped. 
+ * Note: BufferedSerial has a single blocking flag so reads become 
+ * non-blocking as well. 
+ */
+void SerialMidi::NonBlockingTx(bool enable, TxPolicy policy)
+{
+	if(!enable && tx_nonblocking) {
+		FlushBlocking(); 
+	}
+	tx_nonblocking = enable; 
+	tx_policy = policy; 
+	tx_wire_free_us = us_ticker_read(); 
+	serial_port.set_blocking(!enable); 
+}
+
+
+/**
+ * Moves queued bytes to the USART without blocking, real-time bytes 
+ * first.  Channel data is paced to the wire so no more than 
+ * MIDI_TX_LOOKAHEAD bytes wait inside BufferedSerial, this bounds the 
+ * delay of a real-time byte to about that many byte times. 
+ * Call regularly (at least once per byte time for full throughput) from 
+ * the main loop or an EventQueue when in non-blocking mode. 
+ */
+void SerialMidi::ServiceTx(void)
+{
+	uint32_t now = us_ticker_read(); 
+
+	ServiceControllers(); 
+	ServiceRt(now); 
+	if(rt_tail != rt_head) {
+		return; 
+	}
+
+	int32_t backlog = (int32_t)(tx_wire_free_us - now); 
+	if(tx_len == 0 && tx_sysex_left == 0) {
+		// Drained, keep the estimate close to now so it can not go stale
+		if(backlog <= 0) {
+			tx_wire_free_us = now; 
+		}
+		return; 
+	}
+	// A stamp from long ago reads as far ahead (32 bit wrap), 
+	// never more than the lookahead can be on the wire 
+	if(backlog < 0) {
+		backlog = 0; 
+	}
+	else if(backlog > MIDI_TX_LOOKAHEAD * MIDI_BYTE_TIME_US) {
+		backlog = MIDI_TX_LOOKAHEAD * MIDI_BYTE_TIME_US; 
+		tx_wire_free_us = now + backlog; 
+	}
+	int32_t room = MIDI_TX_LOOKAHEAD - 
+		(backlog + MIDI_BYTE_TIME_US - 1) / MIDI_BYTE_TIME_US; 
+
+	// Queued bytes up to a pending SysEx stream, the stream itself 
+	// straight from the callers memory and then the rest of the queue. 
+	while(room > 0) {
+		bool stream = (tx_sysex_left > 0 && tx_sysex_at == 0); 
+		const uint8_t *src = stream ? tx_sysex_ptr : tx_buf; 
+		size_t avail = stream ? tx_sysex_left : 
+			(tx_sysex_left ? tx_sysex_at : tx_len); 
+		if(avail == 0) {
+			return; 
+		}
+		size_t n = ((size_t)room < avail) ? (size_t)room : avail; 
+		ssize_t written = PortWrite(src, n); 
+		if(written <= 0) {
+			return; 
+		}
+		if(stream) {
+			tx_sysex_ptr += written; 
+			tx_sysex_left -= written; 
+		}
+		else {
+			TxConsume((size_t)written); 
+		}
+		TxWireAdd(now, (size_t)written); 
+		if((size_t)written < n) {
+			return; 
+		}
+		room -= written; 
+	}
+}
+
+
+/**
+ * Drops bytes that have been handed to the USART from the front of the
+ * TX block while keeping track of the running status and data byte 
+ * position in effect at the (new) start of the queue. 
+ */
+void SerialMidi::TxConsume(size_t n)
+{
+	for(size_t i = 0; i < n; i++) {
+		TxTrackByte(tx_buf[i], tx_queue_status, tx_queue_phase); 
+	}
+	tx_len -= n; 
+	if(tx_len) {
+		memmove(tx_buf, &tx_buf[n], tx_len); 
+	}
+	if(tx_sysex_left) {
+		tx_sysex_at -= n; 
+	}
+}
+
+
+/**
+ * Running status bookkeeping for a byte stream, phase is the index of 
+ * the next data byte within the current message. 
+ */
+void SerialMidi::TxTrackByte(uint8_t c, uint8_t &status, uint8_t &phase)
+{
+	if(c >= 0xF8) {
+		// Real-time (raw thru data) does not touch running status 
+		return; 
+	}
+	if(c & CHANNEL_VOICE_MASK) {
+		status = c; 
+		phase = 0; 
+	}
+	else if(++phase >= (status_table.info[status] & STATUS_LEN_MASK)) {
+		phase = 0; 
+	}
+}
+
+
+/**
+ * Writes the whole TX block to the USART, waiting if needed. 
+ */
+void SerialMidi::FlushBlocking(void)
+{
+	size_t total = tx_len + tx_sysex_left; 
+
+	if(total == 0) {
+		return; 
+	}
+	if(tx_nonblocking) {
+		serial_port.set_blocking(true); 
+	}
+	if(tx_sysex_left) {
+		PortWrite(tx_buf, tx_sysex_at); 
+		TxConsume(tx_sysex_at); 
+		PortWrite(tx_sysex_ptr, tx_sysex_left); 
+		tx_sysex_left = 0; 
+	}
+	PortWrite(tx_buf, tx_len); 
+	TxConsume(tx_len); 
+	if(tx_nonblocking) {
+		serial_port.set_blocking(false); 
+		TxWireAdd(us_ticker_read(), total); 
+	}
+}
+
+
+/**
+ * Searches the TX queue for the most recently queued Control Change with
+ * the same status and controller and overwrites its value, so values 
+ * still go out in order.  returns true if such a message was found. 
+ */
+bool SerialMidi::ReplaceQueuedControlChange(uint8_t status, 
+		uint8_t controller, uint8_t val)
+{
+	uint8_t st = tx_queue_status; 
+	uint8_t phase = tx_queue_phase; 
+	uint8_t *pending = nullptr; 
+
+	for(size_t i = 0; i + 1 < tx_len; i++) {
+		if(st == status && phase == 0 && tx_buf[i] == controller && 
+				!(tx_buf[i + 1] & CHANNEL_VOICE_MASK)) {
+			pending = &tx_buf[i + 1]; 
+		}
+		TxTrackByte(tx_buf[i], st, phase); 
+	}
+	if(pending == nullptr) {
+		return false; 
+	}
+	*pending = val; 
+	return true; 
+}
+
+
+/**
+ * Number of bytes waiting in the TX queue 
+ */
+size_t SerialMidi::TxQueueDepth(void) const
+{
+	return tx_len + tx_sysex_left; 
+}
+
+
+/**
+ * Re-encodes a decoded message on this port, applying this port's 
+ * running status.  Real-time goes through the priority lane, system 
+ * common is sent as a whole (it cancels the running status).  SysEx 
+ * chunks are not sent (DROPPED), see SendSysEx(). 
+ */
+SerialMidi::TxStatus SerialMidi::SendEvent(const MidiEvent &ev, uint16_t param)
+{
+	if(ev.status >= 0xF8) {
+		return SendRealtime(ev.status); 
+	}
+	// Assembled on RX, param is RxParameter() 
+	if(ev.status == MIDI_CC14) {
+		return ControlChange14(ev.channel, (uint8_t)param, 
+				(uint16_t)(ev.data1 | (ev.data2 << 7))); 
+	}
+	if(ev.status == MIDI_PARAMETER) {
+		return SendParameter(ev.channel, (param & MIDI_PARAM_NRPN) != 0, 
+				param & MIDI_PARAM_NULL, 
+				(uint16_t)(ev.data1 | (ev.data2 << 7))); 
+	}
+	if(ev.status >= 0x80 && ev.status < 0xF0) {
+		return Send(ev.status | (ev.channel & 0x0F), ev.data1, ev.data2); 
+	}
+	// System common, Send() drops a SysEx chunk 
+	return Send(ev.status, ev.data1, ev.data2); 
+}
+
+
+/**
+ * Sends bytes as they are, e.g. a soft thru of another port.  The TX 
+ * running status is unknown afterwards so the next message always goes
+ * out with its status byte.  With a non-blocking policy other than BLOCK
+ * a span that does not fit in the TX queue is DROPPED as a whole. 
+ */
+SerialMidi::TxStatus SerialMidi::SendRaw(const uint8_t *data, size_t len)
+{
+	global_running_status_tx = 0; 
+	if(tx_len == 0 && tx_sysex_left == 0) {
+		tx_queue_status = 0; 
+		tx_queue_phase = 0; 
+	}
+	if(!tx_batched && !tx_nonblocking) {
+		PortWrite(data, len);
+		return TxStatus::OK; 
+	}
+	while(len > 0) {
+		size_t n = (len < sizeof(tx_buf)) ? len : sizeof(tx_buf); 
+		if(tx_nonblocking && tx_len + n > sizeof(tx_buf)) {
+			ServiceTx(); 
+			if(tx_len + n > sizeof(tx_buf)) {
+				if(tx_policy != TxPolicy::BLOCK) {
+					MIDI_STAT(stats.tx_dropped++); 
+					return TxStatus::DROPPED; 
+				}
+				FlushBlocking(); 
+			}
+		}
+		Transmit(data, n); 
+		data += n; 
+		len -= n; 
+	}
+	return TxStatus::OK; 
+}
+
+
+/**
+ * MIDI Thru / merge towards another port:
+ *   SOFT   every received block is forwarded raw with one write before 
+ *          it is parsed, lowest possible delay for a single input. 
+ *   MERGE  decoded messages are re-encoded on out, several inputs can 
+ *          merge into one out.  Running status is recomputed for the 
+ *          merged stream and real-time goes ahead through the out's 
+ *          priority lane (use non-blocking TX on out).  System common
+ *          is merged as a complete message.  Filtered channels are not
+ *          merged, neither is SysEx (its chunks can not be interleaved
+ *          with the other inputs). 
+ * All inputs merging into one out must be parsed from the same thread,
+ * e.g. use the same EventQueue for their EnableRxInterrupt(). 
+ * SetThru(nullptr) turns thru off. 
+ */
+void SerialMidi::SetThru(SerialMidi *out, ThruMode mode)
+{
+	if(out == nullptr || out == this) {
+		mode = ThruMode::OFF; 
+		out = nullptr; 
+	}
+	thru_mode = ThruMode::OFF; 
+	thru_port = out; 
+	thru_mode = mode; 
+}
+
+
+/**
+ * Sends a System Exclusive message, data is the payload without the 
+ * 0xF0/0xF7 framing.  The payload is streamed directly from data (may 
+ * live in flash), no copy is made.  
+ * In non-blocking mode the stream is queued behind the pending channel
+ * data and drained by ServiceTx(), real-time bytes still go first; data
+ * must stay valid until TxQueueDepth() drops to zero.  Only one SysEx 
+ * stream can be pending, a second one is DROPPED (or waits with the 
+ * BLOCK policy).  
+ */
+SerialMidi::TxStatus SerialMidi::SendSysEx(const uint8_t *data, size_t len)
+{
+	const uint8_t start = SYSTEM_EXCLUSIVE_START; 
+	const uint8_t end = SYSTEM_EXCLUSIVE_END; 
+
+	if(!tx_nonblocking) {
+		Flush(); 
+		PortWrite(&start, 1); 
+		PortWrite(data, len); 
+		PortWrite(&end, 1); 
+		global_running_status_tx = 0; 
+		MIDI_STAT(stats.tx_messages[7]++); 
+		return TxStatus::OK; 
+	}
+
+	if(tx_sysex_left || tx_len + 2u > sizeof(tx_buf)) {
+		ServiceTx(); 
+	}
+	if(tx_sysex_left || tx_len + 2u > sizeof(tx_buf)) {
+		if(tx_policy != TxPolicy::BLOCK) {
+			MIDI_STAT(stats.tx_dropped++); 
+			return TxStatus::DROPPED; 
+		}
+		FlushBlocking(); 
+	}
+	// SysEx cancels running status 
+	global_running_status_tx = 0; 
+	tx_buf[tx_len++] = start; 
+	tx_sysex_at = tx_len; 
+	tx_sysex_ptr = data; 
+	tx_sysex_left = len; 
+	tx_buf[tx_len++] = end; 
+	MIDI_STAT(stats.tx_messages[7]++); 
+	TxHighWater(); 
+	ServiceTx(); 
+	return TxStatus::OK; 
+}
+
+
+SerialMidi::TxStatus SerialMidi::TimingClock(void)
+{
+	return SendRealtime(RT_TIMING_CLOCK);
+}
+
+
+/**
+ * With the clock generator running Start resets the song position and 
+ * restarts the clock phase, the first clock follows one byte time later.
+ */
+SerialMidi::TxStatus SerialMidi::Start(void)
+{
+	if(clk_tx_interval) {
+		core_util_critical_section_enter(); 
+		clk_tx_timeout.detach(); 
+		clk_tx_song = 0; 
+		clk_tx_running = true; 
+		clk_tx_next = (uint64_t)(us_ticker_read() + MIDI_BYTE_TIME_US) << 16; 
+		ClockArm(); 
+		core_util_critical_section_exit(); 
+	}
+	return SendRealtime(RT_START);
+}
+
+
+SerialMidi::TxStatus SerialMidi::Continue(void)
+{
+	clk_tx_running = true; 
+	return SendRealtime(RT_CONTINUE);
+}
+
+
+/**
+ * The clock generator keeps sending clocks while stopped, the song 
+ * position does not advance. 
+ */
+SerialMidi::TxStatus SerialMidi::Stop(void)
+{
+	clk_tx_running = false; 
+	return SendRealtime(RT_STOP);
+}
+
+
+/**
+ * Song Position Pointer, only meaningful while stopped.  Moves the clock
+ * generator position as well. 
+ */
+SerialMidi::TxStatus SerialMidi::SongPosition(uint16_t beats)
+{
+	TxStatus st = Send(SYSTEM_SONG_POSITION, beats & MIDI_DATA, 
+			(beats >> 7) & MIDI_DATA); 
+	if(st != TxStatus::DROPPED) {
+		clk_tx_song = (uint32_t)(beats & 0x3FFF) * 6; 
+	}
+	return st; 
+}
+
+
+/**
+ * Clock generator: a hardware Timeout emits the Timing Clock bytes (24 
+ * per quarter) into the real-time lane at bpm_x100 (1/100 BPM), the 
+ * lane is then drained from queue (BufferedSerial can not be written in
+ * the ISR).  The next tick is accumulated in 1/65536 us so there is no 
+ * drift.  With NonBlockingTx() a tick waits for at most MIDI_TX_LOOKAHEAD
+ * + 1 byte times.  In blocking TX a tick queues behind everything already
+ * handed to BufferedSerial, a whole message or SysEx (its TX buffer, 
+ * 320 us per byte), use NonBlockingTx() when the clock must be tight. 
+ * A tempo change takes effect after the already scheduled tick.  
+ * 0 stops the generator.  
+ * Start/Stop/Continue/SongPosition() are coupled to the generator. 
+ */
+void SerialMidi::ClockGenerator(uint32_t bpm_x100, EventQueue *queue)
+{
+	if(bpm_x100 == 0) {
+		clk_tx_timeout.detach(); 
+		clk_tx_interval = 0; 
+		return; 
+	}
+	core_util_critical_section_enter(); 
+	bool was_running = (clk_tx_interval != 0); 
+	// 60 s * 100 / 24 clocks per quarter 
+	clk_tx_interval = (250000000ull << 16) / bpm_x100; 
+	clk_tx_queue = queue; 
+	if(!was_running) {
+		clk_tx_next = (uint64_t)us_ticker_read() << 16; 
+		ClockArm(); 
+	}
+	core_util_critical_section_exit(); 
+}
+
+
+/**
+ * Song position of the clock generator in MIDI clocks (6 per beat). 
+ */
+uint32_t SerialMidi::ClockGenPosition(void) const
+{
+	return clk_tx_song; 
+}
+
+
+/**
+ * Schedules the Timeout for clk_tx_next, late ticks fire immediately. 
+ */
+void SerialMidi::ClockArm(void)
+{
+	int32_t delay = (int32_t)((uint32_t)(clk_tx_next >> 16) - us_ticker_read()); 
+
+	if(delay < 0) {
+		delay = 0; 
+	}
+	clk_tx_timeout.attach(callback(this, &SerialMidi::ClockTick), 
+			std::chrono::microseconds(delay)); 
+}
+
+
+/**
+ * Timeout, ISR context. 
+ */
+void SerialMidi::ClockTick(void)
+{
+	RtQueuePush(RT_TIMING_CLOCK); 
+	if(clk_tx_running) {
+		clk_tx_song++; 
+	}
+	clk_tx_next += clk_tx_interval; 
+	ClockArm(); 
+	RtDefer(clk_tx_queue); 
+}
+
+
+/**
+ * Has the real-time lane drained from queue, ISR context.  One deferred
+ * drain is pending at any time. 
+ */
+void SerialMidi::RtDefer(EventQueue *queue)
+{
+	if(clk_tx_pending.exchange(true)) {
+		return; 
+	}
+	if(queue == nullptr || queue->call(callback(this, 
+			&SerialMidi::RtDeferred)) == 0) {
+		clk_tx_pending = false; 
+	}
+}
+
+
+void SerialMidi::RtDeferred(void)
+{
+	clk_tx_pending = false; 
+	ServiceRt(us_ticker_read()); 
+}
+
+
+SerialMidi::TxStatus SerialMidi::Active_Sensing(void)
+{
+	return SendRealtime(RT_ACTIVE_SENSING);
+}
+
+
+SerialMidi *SerialMidi::sense_ports = nullptr; 
+
+static Ticker &SenseTicker(void)
+{
+	static Ticker ticker; 
+	return ticker; 
+}
+
+
+/**
+ * Automatic Active Sensing.  send: 0xFE goes out whenever nothing was 
+ * sent for MIDI_SENSE_TX_IDLE_MS.  watch: once 0xFE was received, no byte
+ * for MIDI_SENSE_RX_TIMEOUT_MS means the input is lost: Note Off for 
+ * the held RX notes (MIDI_NOTE_TRACKER, also to a MERGE thru), then the
+ * connection lost delegate/ConnectionLost() member, or a RT_ACTIVE_SENSING
+ * event with data1 MIDI_SENSE_LOST for Poll().  
+ * All ports share one Ticker (a few compares per port every 
+ * MIDI_SENSE_TICK_MS), the 0xFE bytes are handed to queue.  The lost 
+ * events come from the RX context, like the parsed ones: the RX 
+ * interrupt queue (EnableRxInterrupt()), or else the next 
+ * ReceiveParser(), ReceiveParserBlock() or Poll() call. 
+ */
+void SerialMidi::ActiveSensing(bool send, bool watch, EventQueue *queue)
+{
+	bool on = send || watch; 
+
+	core_util_critical_section_enter(); 
+	sense_queue = queue; 
+	tx_last_us = MIDI_TIMESTAMP(); 
+	rx_last_us = tx_last_us; 
+	rx_sense_seen = false; 
+	rx_sense_lost = false; 
+	sense_tx = send; 
+	sense_watch = watch; 
+	if(on && !sense_listed) {
+		sense_next = sense_ports; 
+		sense_ports = this; 
+		sense_listed = true; 
+		if(sense_next == nullptr) {
+			SenseTicker().attach(callback(&SerialMidi::SenseTick), 
+					std::chrono::milliseconds(MIDI_SENSE_TICK_MS)); 
+		}
+	}
+	else if(!on && sense_listed) {
+		SerialMidi **p = &sense_ports; 
+		while(*p != this) {
+			p = &(*p)->sense_next; 
+		}
+		*p = sense_next; 
+		sense_listed = false; 
+		if(sense_ports == nullptr) {
+			SenseTicker().detach(); 
+		}
+	}
+	core_util_critical_section_exit(); 
+}
+
+
+void SerialMidi::SetConnectionLostHandler(void (*handler_ptr)(void))
+{
+	connection_lost_handler_delegate = handler_ptr; 
+}
+
+
+/**
+ * Shared ticker, ISR context. 
+ */
+void SerialMidi::SenseTick(void)
+{
+	uint32_t now = MIDI_TIMESTAMP(); 
+
+	for(SerialMidi *m = sense_ports; m; m = m->sense_next) {
+		m->SenseCheck(now); 
+	}
+}
+
+
+/**
+ * One port, now: MIDI_TIMESTAMP() of the tick, the clock of tx_last_us
+ * and rx_last_us. 
+ */
+void SerialMidi::SenseCheck(uint32_t now)
+{
+	if(sense_tx && now - tx_last_us >= MIDI_SENSE_TX_IDLE_MS * 1000u) {
+		tx_last_us = now; 
+		if(RtQueuePush(RT_ACTIVE_SENSING)) {
+			RtDefer(sense_queue); 
+		}
+	}
+	if(sense_watch && rx_sense_seen && 
+			now - rx_last_us >= MIDI_SENSE_RX_TIMEOUT_MS * 1000u) {
+		rx_sense_seen = false; 
+		// Only flagged, the RX context is the single producer of the 
+		// event ring and owns rx_notes.  In RX interrupt mode it is 
+		// woken up like for received bytes. 
+		rx_sense_lost.store(true, std::memory_order_release); 
+		RxIrq(); 
+	}
+}
+
+
+/**
+ * Input lost, RX context (see RxService()).  Releases the held notes
+ * and reports it as the parser would have, queued or delivered. 
+ */
+void SerialMidi::SenseLost(bool queue)
+{
+	MidiEvent ev; 
+
+	while(RxNextHeld(ev)) {
+		ThruEvent(ev); 
+		SenseDeliver(ev, queue); 
+	}
+	ev.status = RT_ACTIVE_SENSING; 
+	ev.data1 = MIDI_SENSE_LOST; 
+	ev.data2 = 0; 
+	ev.channel = 0; 
+	SenseDeliver(ev, queue); 
+}
+
+
+void SerialMidi::SenseDeliver(const MidiEvent &ev, bool queue)
+{
+	rx_timestamp = MIDI_TIMESTAMP(); 
+	rx_param = 0; 
+	if(queue) {
+		rx_param_parse = 0; 
+		if(!RxEventPush(ev, rx_timestamp)) {
+			MIDI_STAT(stats.rx_dropped++); 
+			return; 
+		}
+		rx_flags.set(MIDI_RX_EVENT_FLAG); 
+	}
+	else {
+		DeliverNow(ev); 
+	}
+}
+
+
+SerialMidi::TxStatus SerialMidi::Reset(void)
+{
+	TxStatus st = SendRealtime(RT_RESET);
+#if MIDI_NOTE_TRACKER
+	// The receiver drops its notes 
+	if(st == TxStatus::OK) {
+		NoteTrack(tx_notes, RT_RESET, 0, 0, 0); 
+	}
+#endif
+	if(st == TxStatus::OK) {
+		for(uint8_t ch = 0; ch < 16; ch++) {
+			TxControlReset(ch); 
+		}
+	}
+	return st; 
+}
+
+
+/**
+ * Real-time messages bypass the TX queue.  In non-blocking mode they go 
+ * into the priority lane and are injected ahead of any pending channel 
+ * data (even in between the data bytes of a message).  
+ * Safe to call from interrupt context in non-blocking mode. 
+ */
+SerialMidi::TxStatus SerialMidi::SendRealtime(uint8_t c)
+{
+	if(!tx_nonblocking && clk_tx_interval == 0) {
+		PortWrite(&c,1);
+		MIDI_STAT(stats.tx_messages[7]++); 
+		return TxStatus::OK; 
+	}
+	// Same lane as the clock generator, keeps the order 
+	if(!RtQueuePush(c)) {
+		return TxStatus::DROPPED; 
+	}
+	if(!core_util_is_isr_active()) {
+		if(tx_nonblocking) {
+			ServiceTx(); 
+		}
+		else {
+			ServiceRt(us_ticker_read()); 
+		}
+	}
+	return TxStatus::OK; 
+}
+
+
+/**
+ * Real-time lane, multiple producers (threads, ISR) guarded by a 
+ * critical section, single consumer ServiceTx(). 
+ */
+bool SerialMidi::RtQueuePush(uint8_t c)
+{
+	bool queued = false; 
+
+	core_util_critical_section_enter(); 
+	if((uint8_t)(rt_head - rt_tail) < MIDI_RT_QUEUE_SIZE) {
+		rt_queue[rt_head % MIDI_RT_QUEUE_SIZE] = c; 
+		rt_head++; 
+		queued = true; 
+	}
+	core_util_critical_section_exit(); 
+	return queued; 
+}
+
+
+/**
+ * Drains the real-time lane.  Consumers are ServiceTx() and the clock 
+ * generator deferral, only one of them drains at a time. 
+ */
+void SerialMidi::ServiceRt(uint32_t now)
+{
+	if(rt_busy.exchange(true)) {
+		return; 
+	}
+	while(rt_tail != rt_head) {
+		uint8_t c = rt_queue[rt_tail % MIDI_RT_QUEUE_SIZE]; 
+		if(serial_port.write(&c, 1) != 1) {
+			break; 
+		}
+		MIDI_STAT(stats_rt_bytes++); 
+		rt_tail++; 
+		TxWireAdd(now, 1); 
+		if(sense_tx) {
+			tx_last_us = MIDI_TIMESTAMP(); 
+		}
+	}
+	rt_busy = false; 
+}
+
+
+/**
+ * Bookkeeping of the bytes handed to the USART, tx_wire_free_us is the 
+ * estimated moment the USART will have shifted out everything. 
+ */
+void SerialMidi::TxWireAdd(uint32_t now, size_t n)
+{
+	if((int32_t)(tx_wire_free_us - now) < 0) {
+		tx_wire_free_us = now; 
+	}
+	tx_wire_free_us += n * MIDI_BYTE_TIME_US; 
+}
+
+
+/**
+ * Writes to the USART, counting the bytes.  Not for the real-time lane 
+ * (other context). 
+ */
+ssize_t SerialMidi::PortWrite(const void *buf, size_t len)
+{
+	ssize_t written = serial_port.write(buf, len); 
+
+	MIDI_STAT(if(written > 0) stats.tx_bytes += written); 
+	if(sense_tx) {
+		tx_last_us = MIDI_TIMESTAMP(); 
+	}
+	return written; 
+}
+
+
+void SerialMidi::TxHighWater(void)
+{
+	MIDI_STAT(if(TxQueueDepth() > stats.tx_queue_high_water) 
+			stats.tx_queue_high_water = TxQueueDepth()); 
+}
+
+
+/**
+ * Snapshot of the runtime counters, callable from any thread. 
+ */
+void SerialMidi::GetStats(MidiStats &out) const
+{
+	out = stats; 
+	out.tx_bytes += stats_rt_bytes; 
+	out.tx_messages[7] += stats_rt_bytes; 
+}
+
+
+/**
+ * Clears the counters, call it from the thread that parses and sends. 
+ */
+void SerialMidi::ResetStats(void)
+{
+	memset(&stats, 0, sizeof(stats)); 
+	stats_rt_bytes = 0; 
+}
+
+
+/**
+ * Records every received block with its arrival time (the parsers end_us,
+ * see Parse()) into recorder, from the parser context.  Replay with 
+ * MidiTracePlayer. 
+ */
+void SerialMidi::SetTrace(MidiTraceRecorder *recorder)
+{
+	rx_trace = recorder; 
+}
+
+
+/**
+ * Text representation of the parser state, shares one static buffer 
+ * between all instances.  Prefer Text(buf, size). 
+ */
+char * SerialMidi::Text() 
+{
+	static char buf[192];
+	return Text(buf, sizeof(buf)); 
+}
+
+
+/**
+ * Text representation of the parser state and the main counters into 
+ * the callers buffer, returns buf. 
+ */
+char * SerialMidi::Text(char *buf, size_t size) 
+{
+	MidiStats st; 
+
+	GetStats(st); 
+	snprintf(buf, size,
+			"run_tx:%2X,run_rx:%2X,3rd_byte:%2X,state:%d,"
+			"rx:%lu/%lu,tx:%lu/%lu,drop:%lu/%lu,resync:%lu,hw:%lu",  
+			global_running_status_tx, 
+			global_running_status_rx,
+			global_3rd_byte_flag, 
+			(int)global_state, 
+			(unsigned long)st.rx_bytes, 
+			(unsigned long)st.rx_ignored, 
+			(unsigned long)st.tx_bytes, 
+			(unsigned long)st.tx_running_status_hits, 
+			(unsigned long)st.rx_dropped, 
+			(unsigned long)st.tx_dropped, 
+			(unsigned long)st.rx_resyncs, 
+			(unsigned long)st.tx_queue_high_water); 
+	return buf; 
+}
+
+
+/**
+ * MIDI Parser
+ * Reads one byte from the USART and feeds it into the state machine. 
+ */
+void SerialMidi::ReceiveParser(void)
+{
+	uint8_t c;
+
+	RxService(rx_event_mode); 
+
+    // Read one byte from the circular FIFO input buffer
+    // This buffer is filled by the ISR routine on receipt of
+    // data on the port.
+    if( serial_port.read(&c, 1) <= 0) {
+		return;
+	}
+	Parse(&c, 1);
+}
+
+
+/**
+ * MIDI Parser, bulk variant 
+ * Drains up to MIDI_RX_BLOCK_SIZE bytes from the USART FIFO in a single 
+ * read() and runs the state machine over the whole block. 
+ * returns the number of MIDI messages dispatched to the delegates. 
+ */
+size_t SerialMidi::ReceiveParserBlock(void)
+{
+	return ReadBlock(rx_event_mode); 
+}
+
+
+/**
+ * One block read (see ReadWith()), the decoded messages are queued or 
+ * delivered to the delegates. 
+ */
+size_t SerialMidi::ReadBlock(bool queue)
+{
+	RxService(queue); 
+	return ReadWith([this, queue](const uint8_t *data, size_t len, 
+			uint32_t end_us) { return ParseBlock(data, len, end_us, queue); }); 
+}
+
+
+/**
+ * MIDI Parser, span variant 
+ * Runs the state machine directly over caller owned memory e.g. a DMA 
+ * buffer half, a USB-MIDI bridge or a captured trace.  No copy is made
+ * and running status is kept across calls just like for the USART. 
+ * returns the number of MIDI messages dispatched to the delegates, or 
+ * queued when the RX interrupt mode is enabled. 
+ */
+size_t SerialMidi::Parse(const uint8_t *data, size_t len)
+{
+	return ParseBlock(data, len, MIDI_TIMESTAMP(), rx_event_mode); 
+}
+
+
+/**
+ * As above with the arrival time of the last byte, e.g. taken in the DMA
+ * interrupt.  Earlier bytes are back-dated by one byte time each. 
+ */
+size_t SerialMidi::Parse(const uint8_t *data, size_t len, uint32_t end_us)
+{
+	return ParseBlock(data, len, end_us, rx_event_mode); 
+}
+
+
+/**
+ * Every message is timestamped with the arrival of its last byte: end_us
+ * (the read time) back-dated by one byte time per byte that follows in 
+ * the block.  For the first block after an RX interrupt the interrupt 
+ * time is the lower bound.  
+ */
+size_t SerialMidi::ParseBlock(const uint8_t *data, size_t len, 
+		uint32_t end_us, bool queue)
+{
+	size_t dispatched = ParseWith(data, len, end_us, 
+			[this, queue](const MidiEvent &ev) { return RxTake(ev, queue); }); 
+
+	if (queue && dispatched) {
+		rx_flags.set(MIDI_RX_EVENT_FLAG); 
+	}
+	return dispatched; 
+}
+
+
+/**
+ * A decoded message: queued for Poll() / DispatchEvents() or delivered 
+ * now.  returns false when the event ring was full. 
+ */
+bool SerialMidi::RxTake(const MidiEvent &ev, bool queue)
+{
+	// Caller buffer SysEx chunks can not be queued 
+	if (queue && !(ev.status == SYSTEM_EXCLUSIVE_START && 
+			ev.data2 == MIDI_SYSEX_NO_BLOCK)) {
+		if (!RxEventPush(ev, rx_parse_us)) {
+			MIDI_STAT(stats.rx_dropped++); 
+			ReleaseSysEx(ev); 
+			return false; 
+		}
+		return true; 
+	}
+	RxStampDirect(); 
+	DeliverNow(ev); 
+	return true; 
+}
+
+
+/**
+ * MIDI state machine, processes a single byte.  The data byte count and
+ * the system common flag come from status_table. 
+ * returns true when ev holds a complete message. 
+ */
+bool SerialMidi::ParseByte(uint8_t c, MidiEvent &ev)
+{
+	//printf("%2X ", c);
+	rx_reparse = false; 
+    
+    // Check if bit7 = 1
+    if ( c & CHANNEL_VOICE_MASK ) {
+		// is it a real-time message?  0xF8 up to 0xFF
+        if (c >= 0xF8 ) {
+			ev.status = c; 
+			ev.data1 = 0; 
+			ev.data2 = 0; 
+			ev.channel = 0; 
+            return true;
+        }
+		bool sysex_done = false; 
+		if (global_state == State_machine::HANDLE_SYSEX) {
+			// EOX, or any other status byte, ends the SysEx
+			global_state = State_machine::RESET; 
+			if (c != SYSTEM_EXCLUSIVE_END) {
+				// The END goes out first, then the byte is parsed again
+				// for itself (a new SysEx, a tune request, ...) 
+				MIDI_STAT(stats.rx_resyncs++); 
+				rx_reparse = true; 
+				return SysExChunk(ev, MIDI_SYSEX_END | MIDI_SYSEX_ERROR); 
+			}
+			sysex_done = SysExChunk(ev, MIDI_SYSEX_END); 
+		}
+		else if (global_3rd_byte_flag) {
+			// Incomplete message 
+			MIDI_STAT(stats.rx_resyncs++); 
+		}
+		if (c == SYSTEM_EXCLUSIVE_START) {
+			global_state = State_machine::HANDLE_SYSEX; 
+			rx_sysex_len = 0; 
+			rx_sysex_flags = MIDI_SYSEX_BEGIN; 
+			if (rx_sysex_buf == nullptr) {
+				SysExAcquire(); 
+			}
+		}
+		// Store running status, messages without data bytes
+		// (tune request, SysEx) have no running status.
+		global_running_status_rx = c;
+		global_3rd_byte_flag = 0;
+		rx_channel_pass = ChannelPass(c); 
+		if (!sysex_done && (status_table.info[c] & STATUS_DISPATCH)) {
+			if ((status_table.info[c] & STATUS_LEN_MASK) == 0) {
+				// Tune request, complete without data.  A held MSB 
+				// stays held for the next byte. 
+				ev.status = c; 
+				ev.data1 = 0; 
+				ev.data2 = 0; 
+				ev.channel = 0; 
+				return true; 
+			}
+		}
+#if MIDI_RX_PARAMETERS
+		if (rx_hold && c != rx_hold) {
+			// The held MSB gets no LSB (no MSB held inside a SysEx) 
+			return ParamFlush(ev); 
+		}
+#endif
+		return sysex_done;
+    }
+
+	if (global_state == State_machine::HANDLE_SYSEX) {
+		if (rx_sysex_buf == nullptr && !SysExAcquire()) {
+			// No buffer or pool exhausted, data is lost 
+			rx_sysex_flags |= MIDI_SYSEX_ERROR; 
+			MIDI_STAT(stats.rx_ignored++); 
+			return false; 
+		}
+		rx_sysex_buf[rx_sysex_len++] = c; 
+		if (rx_sysex_len < rx_sysex_size) {
+			return false; 
+		}
+		// Buffer full, hand out this chunk 
+		return SysExChunk(ev, 0); 
+	}
+
+	// Bit 7 == 0   (data)
+	uint8_t info = status_table.info[global_running_status_rx]; 
+	uint8_t len = info & STATUS_LEN_MASK; 
+
+	if(len == 0) {
+		// Ignore data Byte without (valid) running status
+		MIDI_STAT(stats.rx_ignored++); 
+		return false;
+	}
+	if(len == 2 && global_3rd_byte_flag == 0) {
+		// At this stage we have only 1 byte out of 2.
+		global_3rd_byte_flag = 1;
+		global_midi_c2 = c;
+#if MIDI_RX_PARAMETERS
+		if (rx_hold && c != rx_hold_ctl + 32) {
+			return ParamFlush(ev); 
+		}
+#endif
+		return false;
+	}
+	global_3rd_byte_flag = 0;
+	if(!rx_channel_pass) {
+		// Filtered channel, only keep byte count in sync 
+		MIDI_STAT(stats.rx_filtered++); 
+		return false; 
+	}
+	if(len == 2) {
+		global_midi_c3 = c; 
+	}
+	else {
+		global_midi_c2 = c; 
+		global_midi_c3 = 0; 
+	}
+
+	ev.status = global_running_status_rx & 0xF0; 
+	ev.channel = global_running_status_rx & 0x0F; 
+	ev.data1 = global_midi_c2; 
+	ev.data2 = global_midi_c3; 
+	if(info & STATUS_SYSTEM) {
+		// No running status for system common messages 
+		ev.status = global_running_status_rx; 
+		ev.channel = 0; 
+		global_running_status_rx = 0;
+	}
+	if(ev.status == SYSTEM_SONG_POSITION) {
+		ClockSongPosition((global_midi_c3 << 7) | global_midi_c2); 
+	}
+	if(ev.status == C_NOTE_ON && global_midi_c3 == 0) {
+		// Most MIDI implementation use velocity zero
+		// as a note-off.  
+		ev.status = C_NOTE_OFF; 
+	}
+#if MIDI_RX_PARAMETERS
+	if(ev.status == C_CONTROL_CHANGE && rx_params) {
+		return ParamAssemble(ev); 
+	}
+#endif
+	return true; 
+} // End of SerialMidi::ParseByte
+
+
+/**
+ * 14 bit controllers and RPN/NRPN, see RxParameters().  Takes a decoded
+ * control change, returns false when it was absorbed (parameter number
+ * select, MSB held for its LSB), otherwise ev is the message to deliver.
+ */
+bool SerialMidi::ParamAssemble(MidiEvent &ev)
+{
+#if MIDI_RX_PARAMETERS
+	uint8_t ch = ev.channel; 
+	uint8_t ctl = ev.data1; 
+	uint8_t val = ev.data2; 
+	uint16_t &sel = rx_param_sel[ch]; 
+
+	switch(ctl) {
+	case CTL_NRPN_MSB:
+		sel = MIDI_PARAM_NRPN | (val << 7) | (sel & 0x7F); 
+		return false; 
+	case CTL_NRPN_LSB:
+		sel = MIDI_PARAM_NRPN | (sel & 0x3F80) | val; 
+		return false; 
+	case CTL_RPN_MSB:
+		sel = (val << 7) | (sel & 0x7F); 
+		return false; 
+	case CTL_RPN_LSB:
+		sel = (sel & 0x3F80) | val; 
+		return false; 
+	}
+	if(ctl < 32) {
+		// A new MSB resets the LSB, wait for the next byte 
+		rx_msb[ch][ctl] = val; 
+		rx_hold = C_CONTROL_CHANGE | ch; 
+		rx_hold_ctl = ctl; 
+		rx_hold_us = rx_block_us; 
+		return false; 
+	}
+	if(ctl < 64) {
+		rx_hold = 0; 
+		ParamValue(ev, ctl - 32, (rx_msb[ch][ctl - 32] << 7) | val); 
+		return true; 
+	}
+#endif
+	(void)ev; 
+	return true; 
+}
+
+
+/**
+ * Turns ev into a MIDI_CC14 or (data entry with a selected RPN/NRPN) a
+ * MIDI_PARAMETER event. 
+ */
+void SerialMidi::ParamValue(MidiEvent &ev, uint8_t controller, uint16_t value)
+{
+#if MIDI_RX_PARAMETERS
+	uint16_t sel = rx_param_sel[ev.channel]; 
+
+	if(controller == CTL_MSB_DATA_ENTRY && 
+			(sel & MIDI_PARAM_NULL) != MIDI_PARAM_NULL) {
+		ev.status = MIDI_PARAMETER; 
+		rx_param_parse = sel; 
+	}
+	else {
+		ev.status = MIDI_CC14; 
+		rx_param_parse = controller; 
+	}
+	ev.data1 = value & MIDI_DATA; 
+	ev.data2 = (value >> 7) & MIDI_DATA; 
+#else
+	(void)ev; 
+	(void)controller; 
+	(void)value; 
+#endif
+}
+
+
+/**
+ * Delivers a held MSB as it is (LSB 0), when the next byte is not its 
+ * LSB or none followed in time.  returns false when none is held. 
+ */
+bool SerialMidi::ParamFlush(MidiEvent &ev)
+{
+#if MIDI_RX_PARAMETERS
+	if(rx_hold == 0) {
+		return false; 
+	}
+	ev.channel = rx_hold & 0x0F; 
+	rx_hold = 0; 
+	ParamValue(ev, rx_hold_ctl, rx_msb[ev.channel][rx_hold_ctl] << 7); 
+	return true; 
+#else
+	(void)ev; 
+	return false; 
+#endif
+}
+
+
+/**
+ * RX context, no byte followed a held MSB for MIDI_RX_PARAM_HOLD_US (see
+ * RxService()).  Queues or delivers it as the parser would have, 
+ * stamped with the arrival of its block. 
+ */
+void SerialMidi::ParamExpired(bool queue)
+{
+#if MIDI_RX_PARAMETERS
+	MidiEvent ev; 
+	uint32_t t = rx_hold_us; 
+
+	if(!ParamFlush(ev)) {
+		return; 
+	}
+	RxDone(ev, t, 0); 
+	ThruEvent(ev); 
+	if(RxTake(ev, queue) && queue) {
+		rx_flags.set(MIDI_RX_EVENT_FLAG); 
+	}
+#else
+	(void)queue; 
+#endif
+}
+
+
+/**
+ * Completes a SysEx chunk.  A caller buffer chunk stays valid until the 
+ * next byte is parsed, a pool block until ReleaseSysEx().  
+ * returns false when there is no chunk to hand out. 
+ */
+bool SerialMidi::SysExChunk(MidiEvent &ev, uint8_t flags)
+{
+	if (rx_sysex_buf == nullptr) {
+		if (flags & MIDI_SYSEX_END) {
+			// Nothing buffered (block boundary, pool exhausted or no 
+			// pool) but the end must still be reported 
+			ev.status = SYSTEM_EXCLUSIVE_START; 
+			ev.data1 = rx_sysex_flags | flags; 
+			ev.data2 = MIDI_SYSEX_EMPTY; 
+			ev.channel = 0; 
+			rx_sysex_flags = 0; 
+			return true; 
+		}
+		return false; 
+	}
+	ev.status = SYSTEM_EXCLUSIVE_START; 
+	ev.data1 = rx_sysex_flags | flags; 
+	ev.data2 = rx_sysex_user ? MIDI_SYSEX_NO_BLOCK : rx_sysex_block; 
+	ev.channel = 0; 
+	rx_sysex_done = rx_sysex_buf; 
+	rx_sysex_chunk = rx_sysex_len; 
+#if MIDI_SYSEX_BLOCK_COUNT
+	if (!rx_sysex_user) {
+		// Block now belongs to the event, the next one is taken when
+		// more data arrives 
+		sysex_pool_len[rx_sysex_block] = rx_sysex_len; 
+		rx_sysex_buf = nullptr; 
+		rx_sysex_block = MIDI_SYSEX_NO_BLOCK; 
+	}
+#endif
+	rx_sysex_len = 0; 
+	rx_sysex_flags = 0; 
+	return true; 
+}
+
+
+/**
+ * Takes a free block from the pool for the chunk being received. 
+ * Only the parser takes blocks, consumers give them back so a plain 
+ * atomic and/or on the free mask is enough. 
+ */
+bool SerialMidi::SysExAcquire(void)
+{
+#if MIDI_SYSEX_BLOCK_COUNT
+	if (rx_sysex_user) {
+		return false; 
+	}
+	uint32_t free = sysex_pool_free.load(std::memory_order_acquire); 
+	if (free == 0) {
+		return false; 
+	}
+	uint8_t block = __builtin_ctz(free); 
+	sysex_pool_free.fetch_and(~(1u << block), std::memory_order_acq_rel); 
+	rx_sysex_block = block; 
+	rx_sysex_buf = sysex_pool[block]; 
+	rx_sysex_size = MIDI_SYSEX_BLOCK_SIZE; 
+	return true; 
+#else
+	return false; 
+#endif
+}
+
+
+/**
+ * Streaming SysEx reception.  Payload bytes (without 0xF0/0xF7) are 
+ * collected in chunks and handed to the SysEx handler each time a chunk 
+ * is full and at the end of the message, so dumps of any length need no
+ * more RAM than one chunk.  flags tell MIDI_SYSEX_BEGIN (first chunk),
+ * MIDI_SYSEX_END (last chunk, may be empty) and MIDI_SYSEX_ERROR (ended
+ * by another status byte instead of EOX, or data lost).  
+ * By default chunks are blocks of the static pool (MIDI_SYSEX_BLOCK_COUNT
+ * x MIDI_SYSEX_BLOCK_SIZE) and are queued with the other events in the 
+ * event queue modes.  With SetSysExBuffer() the caller supplied buffer 
+ * is used instead, its chunks are always delivered right away from the
+ * parser context.  SetSysExBuffer(nullptr, 0) returns to the pool. 
+ * Switching mid-message drops the bytes not handed out yet, the END of
+ * that message then has MIDI_SYSEX_ERROR set. 
+ */
+void SerialMidi::SetSysExBuffer(uint8_t *buf, size_t size)
+{
+#if MIDI_SYSEX_BLOCK_COUNT
+	if (!rx_sysex_user && rx_sysex_block < MIDI_SYSEX_BLOCK_COUNT) {
+		// Mid-message, the block being filled goes back to the pool 
+		sysex_pool_free.fetch_or(1u << rx_sysex_block, std::memory_order_release); 
+	}
+#endif
+	if (rx_sysex_len) {
+		// The rest of the message goes to the new buffer, tell the loss
+		rx_sysex_flags |= MIDI_SYSEX_ERROR; 
+		MIDI_STAT(stats.rx_ignored += rx_sysex_len); 
+	}
+	rx_sysex_user = (buf != nullptr && size > 0); 
+	rx_sysex_buf = rx_sysex_user ? buf : nullptr; 
+	rx_sysex_size = rx_sysex_user ? size : MIDI_SYSEX_BLOCK_SIZE; 
+	rx_sysex_block = MIDI_SYSEX_NO_BLOCK; 
+	rx_sysex_len = 0; 
+}
+
+
+void SerialMidi::SetSysExHandler(
+	void (*sysex_handler_ptr)(const uint8_t *data, size_t len, uint8_t flags))
+{
+	sysex_handler_delegate = sysex_handler_ptr; 
+}
+
+
+/**
+ * Chunk of a SysEx event (status SYSTEM_EXCLUSIVE_START, data1 flags), 
+ * for use with Poll().  Give pool blocks back with ReleaseSysEx(). 
+ */
+const uint8_t *SerialMidi::SysExData(const MidiEvent &ev, size_t &len) const
+{
+#if MIDI_SYSEX_BLOCK_COUNT
+	if (ev.data2 < MIDI_SYSEX_BLOCK_COUNT) {
+		len = sysex_pool_len[ev.data2]; 
+		return sysex_pool[ev.data2]; 
+	}
+#endif
+	if (ev.data2 == MIDI_SYSEX_EMPTY) {
+		len = 0; 
+		return nullptr; 
+	}
+	len = rx_sysex_chunk; 
+	return rx_sysex_done; 
+}
+
+
+void SerialMidi::ReleaseSysEx(const MidiEvent &ev)
+{
+#if MIDI_SYSEX_BLOCK_COUNT
+	if (ev.status == SYSTEM_EXCLUSIVE_START && 
+			ev.data2 < MIDI_SYSEX_BLOCK_COUNT) {
+		sysex_pool_free.fetch_or(1u << ev.data2, std::memory_order_release); 
+	}
+#else
+	(void)ev; 
+#endif
+}
+
+
+void SerialMidi::DeliverSysEx(const MidiEvent &ev)
+{
+	size_t len; 
+	const uint8_t *data = SysExData(ev, len); 
+
+	if (sysex_handler_delegate) {
+		sysex_handler_delegate(data, len, ev.data1); 
+	}
+	ReleaseSysEx(ev); 
+}
+
+
+/**
+ * Receive channel filter, bit n set means channel n (CH1 == bit 0) is 
+ * passed to the handlers.  Messages on other channels are dropped by 
+ * the parser before any callback or event queue work is done. 
+ * System messages are never filtered. 
+ */
+void SerialMidi::SetChannelMask(uint16_t mask)
+{
+	rx_channel_mask = mask; 
+	rx_channel_pass = ChannelPass(global_running_status_rx); 
+}
+
+
+uint16_t SerialMidi::ChannelMask(void) const
+{
+	return rx_channel_mask; 
+}
+
+
+/**
+ * MIDI clock follower, O(1) integer arithmetic per real-time byte.  
+ * The tick interval is an exponential moving average (1/8) with the 
+ * timestamps of RxTimestamp(), a gap of more than 4 intervals (or 
+ * 250 ms) re-locks.  Runs in the parser context. 
+ */
+void SerialMidi::ClockTrack(uint8_t rt, uint32_t t)
+{
+	uint32_t seq = clk_seq.load(std::memory_order_relaxed); 
+
+	if(rt != RT_TIMING_CLOCK && rt != RT_START && rt != RT_CONTINUE && 
+			rt != RT_STOP) {
+		return; 
+	}
+	clk_seq.store(seq + 1, std::memory_order_relaxed); 
+	std::atomic_thread_fence(std::memory_order_release); 
+
+	switch(rt) {
+	case RT_START: 
+		clk_song = 0; 
+		clk_count = 0; 
+		clk_jmin = 0; 
+		clk_jmax = 0; 
+		clk_running = true; 
+		break; 
+	case RT_CONTINUE: 
+		clk_running = true; 
+		break; 
+	case RT_STOP: 
+		clk_running = false; 
+		break; 
+	default: {
+		uint32_t interval = t - clk_last_us; 
+		uint32_t avg = clk_avg_q8 >> 8; 
+		clk_last_us = t; 
+		clk_count++; 
+		if(clk_running) {
+			clk_song++; 
+		}
+		if(clk_samples == 0 || interval > 250000 || 
+				(clk_samples >= 2 && interval > 4 * avg)) {
+			// First clock or a gap, start over from this clock 
+			clk_samples = 1; 
+			clk_avg_q8 = 0; 
+			clk_var = 0; 
+			break; 
+		}
+		if(clk_samples == 1) {
+			clk_avg_q8 = interval << 8; 
+			clk_samples = 2; 
+			break; 
+		}
+		int32_t dev = (int32_t)interval - (int32_t)avg; 
+		if(dev > 32767) {
+			dev = 32767; 
+		}
+		else if(dev < -32767) {
+			dev = -32767; 
+		}
+		clk_avg_q8 += (int32_t)((interval << 8) - clk_avg_q8) >> 3; 
+		clk_var += (int32_t)((uint32_t)(dev * dev) - clk_var) >> 4; 
+		if(clk_samples < 8) {
+			// Settling, statistics not meaningful yet 
+			clk_samples++; 
+			clk_jmin = 0; 
+			clk_jmax = 0; 
+			break; 
+		}
+		if(dev < clk_jmin) {
+			clk_jmin = dev; 
+		}
+		if(dev > clk_jmax) {
+			clk_jmax = dev; 
+		}
+		break; 
+	}
+	}
+
+	clk_seq.store(seq + 2, std::memory_order_release); 
+}
+
+
+/**
+ * Song Position Pointer, beats are 16th notes (6 MIDI clocks). 
+ */
+void SerialMidi::ClockSongPosition(uint16_t beats)
+{
+	uint32_t seq = clk_seq.load(std::memory_order_relaxed); 
+
+	clk_seq.store(seq + 1, std::memory_order_relaxed); 
+	std::atomic_thread_fence(std::memory_order_release); 
+	clk_song = (uint32_t)beats * 6; 
+	clk_seq.store(seq + 2, std::memory_order_release); 
+}
+
+
+/**
+ * Consistent snapshot of the clock follower from any thread, without 
+ * locking.  returns false when no consistent copy could be taken, e.g. 
+ * when called from an interrupt that preempted the parser. 
+ */
+bool SerialMidi::ClockInfo(MidiClockInfo &info) const
+{
+	for(int retry = 0; retry < 4; retry++) {
+		uint32_t seq = clk_seq.load(std::memory_order_acquire); 
+		if(seq & 1) {
+			continue; 
+		}
+		uint32_t avg = clk_avg_q8; 
+		info.song_position = clk_song; 
+		info.clocks = clk_count; 
+		info.jitter_min_us = clk_jmin; 
+		info.jitter_max_us = clk_jmax; 
+		info.jitter_var_us2 = clk_var; 
+		info.running = clk_running; 
+		info.locked = clk_samples >= 8; 
+		std::atomic_thread_fence(std::memory_order_acquire); 
+		if(clk_seq.load(std::memory_order_relaxed) != seq) {
+			continue; 
+		}
+		info.interval_us = (avg + 128) >> 8; 
+		// 60 s * 100 / 24 clocks per quarter, with avg in 1/256 us 
+		info.tempo_bpm_x100 = (avg && info.locked) ? 
+			(uint32_t)((250000000ull << 8) / avg) : 0; 
+		return true; 
+	}
+	return false; 
+}
+
+
+/**
+ * Arrival time in us (MIDI_TIMESTAMP(), wraps) of the message currently 
+ * being delivered or last returned by Poll(). 
+ */
+uint32_t SerialMidi::RxTimestamp(void) const
+{
+	return rx_timestamp; 
+}
+
+
+/**
+ * Controller (0..31) of a MIDI_CC14 event, RPN/NRPN number (NRPN with 
+ * MIDI_PARAM_NRPN set) of a MIDI_PARAMETER event, valid like 
+ * RxTimestamp(). 
+ */
+uint16_t SerialMidi::RxParameter(void) const
+{
+	return rx_param; 
+}
+
+
+/**
+ * High resolution controllers as single events.  Enabled, the parser 
+ * pairs a CC 0..31 MSB with the LSB (CC 32..63) that follows into one 
+ * MIDI_CC14 event (Control14 handler) instead of two control changes, 
+ * an MSB alone is delivered with LSB 0 as soon as the next byte shows 
+ * no LSB follows, or when no byte follows for MIDI_RX_PARAM_HOLD_US (seen
+ * by Poll(), ReceiveParser*() and the RX interrupt mode).  The MSB is 
+ * held across parse blocks, a pair split over two reads is one event. 
+ * CC 99/98 and 101/100 select the NRPN/RPN of the channel and are not
+ * delivered, data entry (CC 6/38) on a selected number becomes one 
+ * MIDI_PARAMETER event (Rpn/Nrpn handler).  Increment/decrement (CC 
+ * 96/97) and the other controllers pass as they are. 
+ */
+void SerialMidi::RxParameters(bool enable)
+{
+#if MIDI_RX_PARAMETERS
+	rx_params = enable; 
+	rx_hold = 0; 
+	rx_hold_ctl = 0; 
+	rx_hold_us = 0; 
+	rx_block_us = 0; 
+	for(uint8_t ch = 0; ch < 16; ch++) {
+		rx_param_sel[ch] = MIDI_PARAM_NULL; 
+	}
+	memset(rx_msb, 0, sizeof(rx_msb)); 
+#else
+	(void)enable; 
+#endif
+}
+
+
+void SerialMidi::SetPolyAfterTouchHandler(
+	void (*handler_ptr)(uint8_t note, uint8_t value))
+{
+	poly_aftertouch_handler_delegate = handler_ptr; 
+}
+
+
+void SerialMidi::SetProgramChangeHandler(void (*handler_ptr)(uint8_t program))
+{
+	program_change_handler_delegate = handler_ptr; 
+}
+
+
+void SerialMidi::SetChannelAfterTouchHandler(void (*handler_ptr)(uint8_t value))
+{
+	channel_aftertouch_handler_delegate = handler_ptr; 
+}
+
+
+/**
+ * MTC quarter frame (0xF1, data1), Song Position (0xF2, data1 LSB/data2
+ * MSB), Song Select (0xF3, data1) and Tune Request (0xF6). 
+ */
+void SerialMidi::SetSystemCommonHandler(
+	void (*handler_ptr)(uint8_t status, uint8_t data1, uint8_t data2))
+{
+	system_common_handler_delegate = handler_ptr; 
+}
+
+
+void SerialMidi::SetControl14Handler(
+	void (*handler_ptr)(uint8_t controller, uint16_t value))
+{
+	control14_handler_delegate = handler_ptr; 
+}
+
+
+void SerialMidi::SetRpnHandler(
+	void (*handler_ptr)(uint16_t number, uint16_t value))
+{
+	rpn_handler_delegate = handler_ptr; 
+}
+
+
+void SerialMidi::SetNrpnHandler(
+	void (*handler_ptr)(uint16_t number, uint16_t value))
+{
+	nrpn_handler_delegate = handler_ptr; 
+}
+
+
+/**
+ * Channel of the message currently being delivered, for use inside the 
+ * delegates (which only get the data bytes). 
+ */
+uint8_t SerialMidi::RxChannel(void) const
+{
+	return rx_channel; 
+}
+
+
+bool SerialMidi::ChannelPass(uint8_t status) const
+{
+	if(status >= 0xF0) {
+		return true; 
+	}
+	return (rx_channel_mask >> (status & 0x0F)) & 1; 
+}
+
+
+/**
+ * Adapter between the compile time dispatch and the delegates. 
+ */
+struct SerialMidi::DelegateHandler {
+	SerialMidi &midi; 
+
+	void NoteOn(uint8_t, uint8_t note, uint8_t velocity) {
+		if(midi.midi_note_on_delegate) {
+			midi.midi_note_on_delegate(note, velocity);
+		}
+	}
+	void NoteOff(uint8_t, uint8_t note, uint8_t velocity) {
+		if(midi.midi_note_off_delegate) {
+			midi.midi_note_off_delegate(note, velocity);
+		}
+	}
+	void ControlChange(uint8_t, uint8_t controller, uint8_t value) {
+		if(midi.midi_control_change_delegate) {
+			midi.midi_control_change_delegate(controller, value);
+		}
+	}
+	void PitchWheel(uint8_t, uint16_t value) {
+		if(midi.midi_pitchwheel_delegate) {
+			midi.midi_pitchwheel_delegate(value & MIDI_DATA, value >> 7);
+		}
+	}
+	void PolyAfterTouch(uint8_t, uint8_t note, uint8_t value) {
+		if(midi.poly_aftertouch_handler_delegate) {
+			midi.poly_aftertouch_handler_delegate(note, value);
+		}
+	}
+	void ProgramChange(uint8_t, uint8_t program) {
+		if(midi.program_change_handler_delegate) {
+			midi.program_change_handler_delegate(program);
+		}
+	}
+	void ChannelAfterTouch(uint8_t, uint8_t value) {
+		if(midi.channel_aftertouch_handler_delegate) {
+			midi.channel_aftertouch_handler_delegate(value);
+		}
+	}
+	void SystemCommon(uint8_t status, uint8_t data1, uint8_t data2) {
+		if(midi.system_common_handler_delegate) {
+			midi.system_common_handler_delegate(status, data1, data2);
+		}
+	}
+	void Control14(uint8_t, uint8_t controller, uint16_t value) {
+		if(midi.control14_handler_delegate) {
+			midi.control14_handler_delegate(controller, value);
+		}
+	}
+	void Rpn(uint8_t, uint16_t number, uint16_t value) {
+		if(midi.rpn_handler_delegate) {
+			midi.rpn_handler_delegate(number, value);
+		}
+	}
+	void Nrpn(uint8_t, uint16_t number, uint16_t value) {
+		if(midi.nrpn_handler_delegate) {
+			midi.nrpn_handler_delegate(number, value);
+		}
+	}
+	void ConnectionLost(void) {
+		if(midi.connection_lost_handler_delegate) {
+			midi.connection_lost_handler_delegate();
+		}
+	}
+	void Realtime(uint8_t msg) {
+		if(midi.realtime_handler_delegate) {
+			midi.realtime_handler_delegate(msg);
+		}
+	}
+};
+
+
+/**
+ * Calls the delegate registered for a decoded message 
+ */
+void SerialMidi::Deliver(const MidiEvent &ev)
+{
+	DelegateHandler delegates = { *this }; 
+
+	if(ev.status == SYSTEM_EXCLUSIVE_START) {
+		DeliverSysEx(ev); 
+		return; 
+	}
+	rx_channel = ev.channel; 
+	serial_midi_detail::Dispatch(delegates, ev, rx_param); 
+}
+
+
+/**
+ * Delivers to the SerialMidiT handler when there is one, else to the 
+ * delegates 
+ */
+void SerialMidi::DeliverNow(const MidiEvent &ev)
+{
+	if(rx_deliver_hook) {
+		rx_deliver_hook(this, ev); 
+	}
+	else {
+		Deliver(ev); 
+	}
+}
+
+
+bool SerialMidi::RxNoteActive(uint8_t channel, uint8_t key) const
+{
+#if MIDI_NOTE_TRACKER
+	return (rx_notes[channel & 0x0F][(key >> 5) & 3] >> (key & 31)) & 1; 
+#else
+	(void)channel; 
+	(void)key; 
+	return false; 
+#endif
+}
+
+
+uint8_t SerialMidi::RxNotesActive(uint8_t channel) const
+{
+	uint8_t n = 0; 
+#if MIDI_NOTE_TRACKER
+	for(uint8_t w = 0; w < 4; w++) {
+		n += (uint8_t)__builtin_popcount(rx_notes[channel & 0x0F][w]); 
+	}
+#else
+	(void)channel; 
+#endif
+	return n; 
+}
+
+
+/**
+ * Takes one held RX note out of the tracker as a Note Off event (velocity 
+ * 0x40), false when no note is held. 
+ */
+bool SerialMidi::RxNextHeld(MidiEvent &ev)
+{
+#if MIDI_NOTE_TRACKER
+	for(uint8_t channel = 0; channel < 16; channel++) {
+		for(uint8_t w = 0; w < 4; w++) {
+			uint32_t held = rx_notes[channel][w]; 
+			if(held) {
+				uint8_t bit = (uint8_t)__builtin_ctz(held); 
+				rx_notes[channel][w] = held & (held - 1); 
+				ev.status = C_NOTE_OFF; 
+				ev.channel = channel; 
+				ev.data1 = (uint8_t)(w * 32 + bit); 
+				ev.data2 = 0x40; 
+				return true; 
+			}
+		}
+	}
+#else
+	(void)ev; 
+#endif
+	return false; 
+}
+
+
+/**
+ * Stuck note recovery on the receiving side, e.g. after the input cable
+ * was pulled in the middle of a chord: calls the Note Off delegate for 
+ * every note that is still held.  Call it from the context that parses
+ * (or with RX stopped), the tracker is not locked.  returns the number 
+ * of Note Offs delivered. 
+ */
+size_t SerialMidi::RxAllNotesOff(void)
+{
+	MidiEvent ev; 
+	size_t n = 0; 
+
+	while(RxNextHeld(ev)) {
+		DeliverNow(ev); 
+		n++; 
+	}
+	return n; 
+}
+
+
+/**
+ * Interrupt driven receive.  The BufferedSerial RX interrupt (sigio) 
+ * defers parsing to queue, the decoded messages are put in a lock-free
+ * single producer/single consumer event ring.  Drain that ring with 
+ * DispatchEvents() from one thread of your choice, WaitForEvents() lets 
+ * that thread sleep until something arrives.  No more polling of an 
+ * empty FIFO.  
+ * Note: BufferedSerial::read() takes a mutex so the parser itself can 
+ * not run in the ISR, use a high priority queue for low latency e.g. 
+ * mbed_highprio_event_queue(). 
+ */
+void SerialMidi::EnableRxInterrupt(EventQueue *queue)
+{
+	rx_queue = queue; 
+	rx_event_mode = true; 
+	serial_port.sigio(callback(this, &SerialMidi::RxIrq)); 
+	// Bytes that arrived before the sigio was attached
+	RxIrq(); 
+}
+
+
+void SerialMidi::DisableRxInterrupt(void)
+{
+	serial_port.sigio(nullptr); 
+	rx_queue = nullptr; 
+	rx_event_mode = false; 
+}
+
+
+/**
+ * sigio callback, ISR context.  Only one deferred call is pending at
+ * any time. 
+ */
+void SerialMidi::RxIrq(void)
+{
+	uint32_t now = MIDI_TIMESTAMP(); 
+
+	if(rx_deferred_pending.exchange(true)) {
+		return; 
+	}
+	rx_irq_us = now; 
+	if(rx_queue == nullptr || rx_queue->call(callback(this, 
+			&SerialMidi::RxDeferred)) == 0) {
+		rx_deferred_pending = false; 
+	}
+}
+
+
+/**
+ * Runs in the EventQueue thread, the producer of the event ring. 
+ */
+void SerialMidi::RxDeferred(void)
+{
+	rx_irq_hint = true; 
+	rx_deferred_pending = false; 
+	RxService(true); 
+	while(serial_port.readable()) {
+		ReceiveParserBlock(); 
+		rx_irq_hint = false; 
+	}
+	rx_irq_hint = false; 
+#if MIDI_RX_PARAMETERS
+	if(rx_hold) {
+		// No RX interrupt when the LSB does not come 
+		rx_hold_timeout.attach(callback(this, &SerialMidi::RxIrq), 
+				std::chrono::microseconds(MIDI_RX_PARAM_HOLD_US)); 
+	}
+#endif
+}
+
+
+/**
+ * Blocks the calling thread until events are available or the timeout 
+ * expires.  returns true when there are events. 
+ */
+bool SerialMidi::WaitForEvents(uint32_t timeout_ms)
+{
+	if(RxEventsPending()) {
+		return true; 
+	}
+	rx_flags.wait_any_for(MIDI_RX_EVENT_FLAG, 
+			Kernel::Clock::duration_u32(timeout_ms)); 
+	return RxEventsPending(); 
+}
+
+
+/**
+ * Ends a WaitForEvents() in another thread early, e.g. to stop it. 
+ */
+void SerialMidi::WakeWaiter(void)
+{
+	rx_flags.set(MIDI_RX_EVENT_FLAG); 
+}
+
+
+/**
+ * Pops all queued events and calls the delegates from the calling 
+ * thread.  returns the number of events dispatched. 
+ */
+size_t SerialMidi::DispatchEvents(void)
+{
+	size_t dispatched = 0; 
+	MidiEvent ev; 
+
+	while(RxEventPop(ev)) {
+		DeliverNow(ev); 
+		dispatched++; 
+	}
+	return dispatched; 
+}
+
+
+/**
+ * Pull style API: returns the next decoded message in ev, or false when
+ * there is none.  Without the RX interrupt mode the USART FIFO is read
+ * (one block) when the event ring is empty, the delegates are not 
+ * called for messages fetched this way. 
+ */
+bool SerialMidi::Poll(MidiEvent &ev)
+{
+	if(rx_queue == nullptr) {
+		// Poll() is the RX context 
+		RxService(true); 
+		if(!RxEventsPending() && serial_port.readable()) {
+			ReadBlock(true); 
+		}
+	}
+	return RxEventPop(ev); 
+}
+
+
+/**
+ * As above, with the arrival time of the message. 
+ */
+bool SerialMidi::Poll(MidiEvent &ev, uint32_t &timestamp_us)
+{
+	if(!Poll(ev)) {
+		return false; 
+	}
+	timestamp_us = rx_timestamp; 
+	return true; 
+}
+
+
+/**
+ * Fills up to max events in a contiguous array, returns the count. 
+ */
+size_t SerialMidi::PollMany(MidiEvent *evs, size_t max)
+{
+	size_t n = 0; 
+
+	while(n < max && Poll(evs[n])) {
+		n++; 
+	}
+	return n; 
+}
+
+
+bool SerialMidi::RxEventsPending(void) const
+{
+	return rx_ev_head.load(std::memory_order_acquire) != 
+		rx_ev_tail.load(std::memory_order_relaxed); 
+}
+
+
+/**
+ * Event ring, producer side.  returns false when full (event lost). 
+ */
+bool SerialMidi::RxEventPush(const MidiEvent &ev, uint32_t timestamp)
+{
+	uint16_t head = rx_ev_head.load(std::memory_order_relaxed); 
+	uint16_t tail = rx_ev_tail.load(std::memory_order_acquire); 
+
+	if((uint16_t)(head - tail) >= MIDI_RX_EVENT_QUEUE_SIZE) {
+		return false; 
+	}
+	rx_events[head % MIDI_RX_EVENT_QUEUE_SIZE] = ev; 
+	rx_event_time[head % MIDI_RX_EVENT_QUEUE_SIZE] = timestamp; 
+#if MIDI_RX_PARAMETERS
+	rx_event_param[head % MIDI_RX_EVENT_QUEUE_SIZE] = rx_param_parse; 
+#endif
+	rx_ev_head.store(head + 1, std::memory_order_release); 
+	return true; 
+}
+
+
+/**
+ * Event ring, consumer side. 
+ */
+bool SerialMidi::RxEventPop(MidiEvent &ev)
+{
+	uint16_t tail = rx_ev_tail.load(std::memory_order_relaxed); 
+
+	if(tail == rx_ev_head.load(std::memory_order_acquire)) {
+		return false; 
+	}
+	ev = rx_events[tail % MIDI_RX_EVENT_QUEUE_SIZE]; 
+	rx_timestamp = rx_event_time[tail % MIDI_RX_EVENT_QUEUE_SIZE]; 
+#if MIDI_RX_PARAMETERS
+	rx_param = rx_event_param[tail % MIDI_RX_EVENT_QUEUE_SIZE]; 
+#endif
+#if MIDI_STATS
+	uint32_t latency = MIDI_TIMESTAMP() - rx_timestamp; 
+	if(latency > stats.rx_latency_max_us) {
+		stats.rx_latency_max_us = latency; 
+	}
+#endif
+	rx_ev_tail.store(tail + 1, std::memory_order_release); 
+	return true; 
+}
 
 
 // EOF
@@ -57,12 +57,20 @@ See the License for the specific language governing permissions and limitations
 // MBED OS Includes
 #include <cstdint>
 #include <stdint.h>
+#include <atomic>
+#include <cstring>
+#include "midi-trace.h"
 
 
 
 /** Adjust to your Hardware specific defines 
  * TODO: adjust for your board! 
+ * Build with -DSERIAL_MIDI_HOST for the desktop shim (benchmarks). 
  */
+#ifdef SERIAL_MIDI_HOST
+#include "serial-midi-host.h"
+#else 
+
 #define K64 0 
 #define K66 1 
 
@@ -78,6 +86,154 @@ See the License for the specific language governing permissions and limitations
 
 #include "mbed.h"
 
+/* eDMA UART instead of BufferedSerial (K64/K66 UART0-3), see 
+ * midi-uart-dma.h */
+#ifndef MIDI_UART_DMA
+#define MIDI_UART_DMA 0
+#endif
+#endif /* SERIAL_MIDI_HOST */
+
+#if MIDI_UART_DMA && !defined(SERIAL_MIDI_HOST)
+#include "midi-uart-dma.h"
+typedef MidiUartDma MidiPort; 
+#else
+#undef MIDI_UART_DMA
+#define MIDI_UART_DMA 0
+typedef BufferedSerial MidiPort; 
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/** Buffer sizing.  All buffers are statically allocated inside the 
+ * SerialMidi object, nothing is taken from the heap.  Override any of 
+ * these per board from the build (e.g. "macros" in mbed_app.json) to 
+ * trim RAM on small targets or to scale up on K66 builds.  To put the 
+ * buffers in a specific RAM section place the SerialMidi object there. 
+ */
+
+/* Maximum number of bytes drained from the USART per ReceiveParserBlock() */
+#ifndef MIDI_RX_BLOCK_SIZE
+#define MIDI_RX_BLOCK_SIZE 32
+#endif
+
+/* Size of the TX block used in batched mode, see BatchedTx() */
+#ifndef MIDI_TX_BUFFER_SIZE
+#define MIDI_TX_BUFFER_SIZE 64
+#endif
+
+/* Real-time priority lane for non-blocking mode (power of 2) */
+#ifndef MIDI_RT_QUEUE_SIZE
+#define MIDI_RT_QUEUE_SIZE 8
+#endif
+
+/* Decoded events buffered in RX interrupt mode (power of 2) */
+#ifndef MIDI_RX_EVENT_QUEUE_SIZE
+#define MIDI_RX_EVENT_QUEUE_SIZE 64
+#endif
+#define MIDI_RX_EVENT_FLAG       0x01
+
+/* SysEx block pool, used when no buffer is given with SetSysExBuffer(). 
+ * Blocks travel with the SysEx events through the event queue, 0 blocks
+ * disables the pool (only an empty END event, MIDI_SYSEX_ERROR when data
+ * was lost). (max 32 blocks) */
+#ifndef MIDI_SYSEX_BLOCK_COUNT
+#define MIDI_SYSEX_BLOCK_COUNT 2
+#endif
+#ifndef MIDI_SYSEX_BLOCK_SIZE
+#define MIDI_SYSEX_BLOCK_SIZE 64
+#endif
+#define MIDI_SYSEX_NO_BLOCK 0xFF	// SysEx event refers to the caller buffer
+#define MIDI_SYSEX_EMPTY    0xFE	// SysEx event without data
+
+static_assert((MIDI_RT_QUEUE_SIZE & (MIDI_RT_QUEUE_SIZE - 1)) == 0 && 
+		MIDI_RT_QUEUE_SIZE <= 128, "MIDI_RT_QUEUE_SIZE must be a power of 2");
+static_assert((MIDI_RX_EVENT_QUEUE_SIZE & (MIDI_RX_EVENT_QUEUE_SIZE - 1)) == 0,
+		"MIDI_RX_EVENT_QUEUE_SIZE must be a power of 2");
+// A block parsed in RX interrupt mode must fit in the event ring 
+static_assert(MIDI_RX_EVENT_QUEUE_SIZE > MIDI_RX_BLOCK_SIZE, 
+		"MIDI_RX_EVENT_QUEUE_SIZE must be larger than MIDI_RX_BLOCK_SIZE");
+static_assert(MIDI_TX_BUFFER_SIZE >= 4 && MIDI_TX_BUFFER_SIZE <= 0xFFFF, 
+		"MIDI_TX_BUFFER_SIZE out of range");
+static_assert(MIDI_SYSEX_BLOCK_COUNT <= 32, "MIDI_SYSEX_BLOCK_COUNT max 32");
+
+/* One byte on the wire: start + 8 data + stop bit at 31250 baud */
+#define MIDI_BYTE_TIME_US 320
+
+/* RX timestamp source in us, e.g. a DWT cycle counter divided down: 
+ * #define MIDI_TIMESTAMP() (DWT->CYCCNT / (SystemCoreClock / 1000000)) */
+#ifndef MIDI_TIMESTAMP
+#define MIDI_TIMESTAMP() us_ticker_read()
+#endif
+
+/* Max channel data bytes handed ahead to BufferedSerial in non-blocking 
+ * mode, real-time bytes wait at most this many byte times.  Raise it if
+ * ServiceTx() can not be called once per byte time. */
+#ifndef MIDI_TX_LOOKAHEAD
+#define MIDI_TX_LOOKAHEAD 1
+#endif
+
+/* Default TX running status refresh in ms (0 = off), see 
+ * RunningStatusRefresh() */
+#ifndef MIDI_TX_STATUS_REFRESH_MS
+#define MIDI_TX_STATUS_REFRESH_MS 0
+#endif
+
+/* Controller last value cache, see ControllerCache().  Costs about 
+ * 2.6 kB per instance, 0 compiles it out. */
+#ifndef MIDI_CC_CACHE
+#define MIDI_CC_CACHE 1
+#endif
+#define MIDI_CC_SLOTS (16 * 128 + 16)	// 16x128 CC + 16 pitch wheels
+
+/* Active note tracking on TX and RX, 256 bytes each, see AllNotesOff().
+ * 0 compiles it out. */
+#ifndef MIDI_NOTE_TRACKER
+#define MIDI_NOTE_TRACKER 1
+#endif
+
+/* 14 bit CC and RPN/NRPN assembly on RX, about 0.7 kB per instance, 
+ * see RxParameters().  0 compiles it out. */
+#ifndef MIDI_RX_PARAMETERS
+#define MIDI_RX_PARAMETERS 1
+#endif
+
+/* A held MSB (see above) goes out with LSB 0 when no byte follows for 
+ * this long: about three byte times. */
+#ifndef MIDI_RX_PARAM_HOLD_US
+#define MIDI_RX_PARAM_HOLD_US 1000
+#endif
+
+/* What the receiver has of 14 bit CCs and RPN/NRPN, lets the TX helpers
+ * skip redundant bytes, about 1 kB per instance.  0 compiles it out. */
+#ifndef MIDI_TX_PARAMETERS
+#define MIDI_TX_PARAMETERS 1
+#endif
+
+/* Active Sensing, see ActiveSensing().  Sent after MIDI_SENSE_TX_IDLE_MS
+ * without TX, the input is lost MIDI_SENSE_RX_TIMEOUT_MS after the last
+ * byte.  One Ticker checks all ports every MIDI_SENSE_TICK_MS. */
+#ifndef MIDI_SENSE_TX_IDLE_MS
+#define MIDI_SENSE_TX_IDLE_MS 270
+#endif
+#ifndef MIDI_SENSE_RX_TIMEOUT_MS
+#define MIDI_SENSE_RX_TIMEOUT_MS 300
+#endif
+#ifndef MIDI_SENSE_TICK_MS
+#define MIDI_SENSE_TICK_MS 20
+#endif
+
+/* Runtime counters, see GetStats().  0 compiles the updates out. */
+#ifndef MIDI_STATS
+#define MIDI_STATS 1
+#endif
+#if MIDI_STATS
+#define MIDI_STAT(expr) do { expr; } while(0)
+#else
+#define MIDI_STAT(expr) do { } while(0)
+#endif
+
 
 
 
@@ -97,11 +253,22 @@ See the License for the specific language governing permissions and limitations
 #define MIDI_DATA               0x7F    //  Bit 7 == 0
 
 
-/* System exclusive */
+/* System exclusive and system common */
 #define SYSTEM_EXCLUSIVE_START  0xF0
-#define SYSTEM_TUNE_REQUEST     0xF6
+#define SYSTEM_TIME_CODE        0xF1    // MTC quarter frame, 1 byte
+#define SYSTEM_SONG_POSITION    0xF2    // 2 bytes
+#define SYSTEM_SONG_SELECT      0xF3    // 1 byte
+#define SYSTEM_TUNE_REQUEST     0xF6    // no data
 #define SYSTEM_EXCLUSIVE_END    0xF7
 
+/* Pseudo status bytes of assembled controllers, see RxParameters(). 
+ * Never on the wire (0xF4/0xF5 are undefined), data1/data2 hold the 14 
+ * bit value LSB/MSB, RxParameter() the controller resp. number. */
+#define MIDI_CC14               0xF4    // 14 bit control change 
+#define MIDI_PARAMETER          0xF5    // RPN/NRPN data entry 
+#define MIDI_PARAM_NRPN         0x4000  // RxParameter() flag, NRPN number
+#define MIDI_PARAM_NULL         0x3FFF  // No RPN/NRPN selected 
+
 
 /* MIDI channel commands */
 #define C_NOTE_ON               0x90    // 2 bytes
@@ -112,26 +279,104 @@ See the License for the specific language governing permissions and limitations
 #define C_PROGRAM_CHANGE        0xC0    // 1 byte
 #define C_CHANNEL_AFTERTOUCH    0xD0    // 1 byte
 
-// This one is not implemented i.e. ignored. 
+// Same as RT_ACTIVE_SENSING, see ActiveSensing() 
 #define ACTIVE_SENSE            0xFE    
 
+/* Flags passed with received SysEx chunks */
+#define MIDI_SYSEX_BEGIN        0x01    // First chunk of a message
+#define MIDI_SYSEX_END          0x02    // Last chunk of a message
+#define MIDI_SYSEX_ERROR        0x04    // Not terminated by EOX
+
 /* System Real Time commands */
 #define RT_TIMING_CLOCK         0xF8
 #define RT_START                0xFA
 #define RT_CONTINUE             0xFB
 #define RT_STOP                 0xFC
 #define RT_ACTIVE_SENSING       0xFE
+#define MIDI_SENSE_LOST         0x01    // data1 of a RT_ACTIVE_SENSING event:
+                                        // input lost, not received 
 #define RT_RESET                0xFF
 
 
+/** Number of data bytes following a channel voice status byte 
+ */
+static inline uint8_t MidiDataLength(uint8_t status)
+{
+	uint8_t type = status & 0xF0; 
+	return (type == C_PROGRAM_CHANGE || type == C_CHANNEL_AFTERTOUCH) ? 1 : 2; 
+}
+
+
+/** Decoded MIDI message. 
+ * status: message type without channel (e.g. C_NOTE_ON) or the full 
+ *         status byte for system messages. A Note On with velocity 0 
+ *         is reported as C_NOTE_OFF. 
+ */
+struct MidiEvent {
+	uint8_t status; 
+	uint8_t data1; 
+	uint8_t data2; 
+	uint8_t channel; 
+};
+static_assert(sizeof(MidiEvent) == 4, "MidiEvent must stay a packed 4 bytes");
+
+
+/** Snapshot of the received MIDI clock, see SerialMidi::ClockInfo(). 
+ * tempo_bpm_x100: smoothed tempo in 1/100 BPM, 0 while not locked. 
+ * interval_us:    smoothed time between two 0xF8 (24 per quarter). 
+ * song_position:  in MIDI clocks since the start of the song, set by 
+ *                 Start and Song Position Pointer, counts while running. 
+ * jitter_*:       deviation of single intervals from the smoothed one, 
+ *                 min/max since Start, variance exponentially smoothed.
+ */
+struct MidiClockInfo {
+	uint32_t tempo_bpm_x100; 
+	uint32_t interval_us; 
+	uint32_t song_position; 
+	uint32_t clocks; 
+	int32_t jitter_min_us; 
+	int32_t jitter_max_us; 
+	uint32_t jitter_var_us2; 
+	bool running; 
+	bool locked; 
+};
+
+
+/** Runtime counters of one port, see SerialMidi::GetStats(). 
+ * *_messages are indexed by MidiStatIndex(): channel message types 
+ * 0x8n..0xEn at 0..6, all system messages (incl. SysEx chunks) at 7. 
+ * Every counter is updated by a single context without locks, a 
+ * snapshot is consistent per counter, not across counters. 
+ */
+struct MidiStats {
+	uint32_t rx_bytes; 
+	uint32_t rx_messages[8]; 
+	uint32_t rx_ignored;       // Data bytes without status, lost SysEx data
+	uint32_t rx_filtered;      // Messages removed by the channel mask 
+	uint32_t rx_dropped;       // Event ring full 
+	uint32_t rx_resyncs;       // Message cut short by a status byte 
+	uint32_t rx_latency_max_us; // Arrival until popped from the ring 
+	uint32_t tx_bytes; 
+	uint32_t tx_messages[8]; 
+	uint32_t tx_running_status_hits; // Status byte saved 
+	uint32_t tx_dropped; 
+	uint32_t tx_queue_high_water; // Bytes, see TxQueueDepth() 
+};
+
+static inline uint8_t MidiStatIndex(uint8_t status)
+{
+	return (status >= 0xF0) ? 7 : ((status >> 4) & 0x07); 
+}
+
+
 /*-----------------------------------------------------------------------*/
 
 /** Forward declaration of callback functions. 
  * users of this library must define all of these callbacks as they
  * are called from the ReceiveParser. 
  *
- * TODO: There is a better way to code this instead of pointer to 
- * functions.  
+ * SerialMidiT<Handler> (see below) avoids the pointers to functions 
+ * and does not need these globals. 
  */  
 void realtime_handler(uint8_t msg);
 void midi_note_off_handler(uint8_t note, uint8_t velocity);
@@ -146,7 +391,12 @@ void midi_pitchwheel_handler(uint8_t valueLSB, uint8_t valueMSB);
  * the parser is implemented as per the standard.  Data reduction is
  * achieved by maintaining running status both on Rx and Tx. 
  * 
- * TODO: periodially send out running status byte if timer expires.  
+ * Every instance owns its USART and all parser/TX state, for more ports
+ * pass the pins: 
+ *  @code
+ * SerialMidi midiIn2(PTD3, PTD2, &note_on2, &rt2, &note_off2, &cc2, &pw2);
+ * SerialMidi midiOut2(PTE24, PTE25);    // Poll() or TX only 
+ * @endcode
  */
 class SerialMidi {
 public: 
@@ -159,32 +409,196 @@ public:
 		void (*control_change_handler_ptr)(uint8_t controller, uint8_t value),
 		void (*midi_pitchwheel_ptr)(	uint8_t valueLSB, uint8_t valueMSB)
 	);
+	SerialMidi( 
+		PinName tx, 
+		PinName rx,
+		void (*note_on_handler_ptr)(	uint8_t note, uint8_t velocity),
+		void (*realtime_handler_ptr)(	uint8_t msg),
+		void (*note_off_handler_ptr)(	uint8_t note, uint8_t velocity),
+		void (*control_change_handler_ptr)(uint8_t controller, uint8_t value),
+		void (*midi_pitchwheel_ptr)(	uint8_t valueLSB, uint8_t valueMSB)
+	);
+	SerialMidi(PinName tx = USART_TX, PinName rx = USART_RX); // No delegates
+	~SerialMidi();
 
 	void ReceiveParser(void);
+	size_t ReceiveParserBlock(void); // returns number of messages dispatched
+	size_t Parse(const uint8_t *data, size_t len); // Parse caller owned bytes
+	size_t Parse(const uint8_t *data, size_t len, uint32_t end_us);
+
+	// Interrupt driven receive 
+	void EnableRxInterrupt(EventQueue *queue = mbed_highprio_event_queue());
+	void DisableRxInterrupt(void);
+	bool WaitForEvents(uint32_t timeout_ms = osWaitForever);
+	void WakeWaiter(void);	// WaitForEvents() returns now 
+	size_t DispatchEvents(void);
+
+	// Receive channel filter, bit 0 == CH1 
+	void SetChannelMask(uint16_t mask);
+	uint16_t ChannelMask(void) const;
+	uint8_t RxChannel(void) const; // Valid inside delegates 
+	uint32_t RxTimestamp(void) const; // us, valid inside delegates 
+	uint16_t RxParameter(void) const; // MIDI_CC14/MIDI_PARAMETER number
+
+	// 14 bit CC pairs, RPN/NRPN as one event, off by default 
+	void RxParameters(bool enable);
+	// Delegates for the other messages, channel from RxChannel() 
+	void SetPolyAfterTouchHandler(void (*handler_ptr)(uint8_t note, 
+			uint8_t value));
+	void SetProgramChangeHandler(void (*handler_ptr)(uint8_t program));
+	void SetChannelAfterTouchHandler(void (*handler_ptr)(uint8_t value));
+	void SetSystemCommonHandler(void (*handler_ptr)(uint8_t status, 
+			uint8_t data1, uint8_t data2));
+
+	void SetControl14Handler(void (*handler_ptr)(uint8_t controller, 
+			uint16_t value));
+	void SetRpnHandler(void (*handler_ptr)(uint16_t number, uint16_t value));
+	void SetNrpnHandler(void (*handler_ptr)(uint16_t number, uint16_t value));
+
+	// Streaming System Exclusive 
+	void SetSysExBuffer(uint8_t *buf, size_t size);
+	const uint8_t *SysExData(const MidiEvent &ev, size_t &len) const;
+	void ReleaseSysEx(const MidiEvent &ev);
+	void SetSysExHandler(void (*sysex_handler_ptr)(const uint8_t *data, 
+			size_t len, uint8_t flags));
+
+	// MIDI clock follower, lock-free snapshot 
+	bool ClockInfo(MidiClockInfo &info) const;
+
+	// Pull style receive, no delegates involved
+	bool Poll(MidiEvent &ev);
+	bool Poll(MidiEvent &ev, uint32_t &timestamp_us);
+	size_t PollMany(MidiEvent *evs, size_t max);
 	//void SerialMidiReceiveParser2(void);
 
 	char * Text(); // Text Representation of the Class status  
+	char * Text(char *buf, size_t size); // Reentrant
+
+	// Runtime counters 
+	void GetStats(MidiStats &stats) const;
+	void ResetStats(void);
+
+	// Capture of the raw RX stream, nullptr stops 
+	void SetTrace(MidiTraceRecorder *recorder);
+
+	/** Result of a send in non-blocking TX mode, always OK otherwise
+	 */
+	enum class TxStatus {
+		OK,         // Sent or queued 
+		REPLACED,   // Updated the value of an already queued message
+		DROPPED,    // TX queue full, message not sent 
+		SUPPRESSED, // Same value as last sent, nothing to send 
+		DEFERRED    // Rate limited, latest value is sent later
+	};
+
+	/** What to do when the TX queue is full in non-blocking mode
+	 */
+	enum class TxPolicy {
+		BLOCK,
+		DROP_NEWEST,
+		DROP_OLDEST_SAME_CONTROLLER
+	};
 
 	// Channel mode messages
-	void NoteON( 	uint8_t channel, uint8_t key, uint8_t velocity);
-	void NoteOFF(	uint8_t channel, uint8_t key, uint8_t velocity);
-	void ControlChange(uint8_t channel, uint8_t controller, uint8_t val);
-	void PitchWheel(uint8_t channel, uint16_t val);
-	void PitchWheel(uint8_t channel, int16_t val);	
-	void ModWheel(	uint8_t channel, uint16_t val);
-	void ModWheel(	uint8_t channel, uint8_t val); // Only MSB sent 8 bits
-	void ModWheel(	uint8_t channel, int val) { 
-		SerialMidi::ModWheel(channel,(uint8_t)val); 
+	TxStatus NoteON( 	uint8_t channel, uint8_t key, uint8_t velocity);
+	TxStatus NoteOFF(	uint8_t channel, uint8_t key, uint8_t velocity);
+	TxStatus ControlChange(uint8_t channel, uint8_t controller, uint8_t val);
+	TxStatus PitchWheel(uint8_t channel, uint16_t val);
+	TxStatus PitchWheel(uint8_t channel, int16_t val);	
+	TxStatus ModWheel(	uint8_t channel, uint16_t val);
+	TxStatus ModWheel(	uint8_t channel, uint8_t val); // Only MSB sent 8 bits
+	TxStatus ModWheel(	uint8_t channel, int val) { 
+		return SerialMidi::ModWheel(channel,(uint8_t)val); 
+	}
+	TxStatus PolyAfterTouch(uint8_t channel, uint8_t key, uint8_t val) {
+		return Send(C_POLYPHONIC_AFTERTOUCH | (channel & 0x0F), key, val); 
+	}
+	TxStatus ProgramChange(uint8_t channel, uint8_t program) {
+		return Send(C_PROGRAM_CHANGE | (channel & 0x0F), program); 
+	}
+	TxStatus ChannelAfterTouch(uint8_t channel, uint8_t val) {
+		return Send(C_CHANNEL_AFTERTOUCH | (channel & 0x0F), val); 
 	}
-	void ChannelAfterTouch(uint8_t channel, uint8_t val);
 
-	// System Common messages
-	void TimingClock(void);
-	void Start(void);
-	void Continue(void);
-	void Stop(void);
-	void Active_Sensing(void);
-	void Reset(void);
+	// Any message by status byte, data bytes as the status needs 
+	TxStatus Send(uint8_t status, uint8_t data1 = 0, uint8_t data2 = 0);
+
+	// 14 bit, RPN/NRPN, one block and only what changed 
+	TxStatus ControlChange14(uint8_t channel, uint8_t controller, uint16_t val);
+	TxStatus Rpn(uint8_t channel, uint16_t number, uint16_t val);
+	TxStatus Nrpn(uint8_t channel, uint16_t number, uint16_t val);
+
+	// Held notes, Note Off only for the notes that are on 
+	TxStatus AllNotesOff(uint8_t channel);
+	TxStatus Panic(void);
+	bool TxNoteActive(uint8_t channel, uint8_t key) const;
+	bool RxNoteActive(uint8_t channel, uint8_t key) const;
+	uint8_t RxNotesActive(uint8_t channel) const;
+	size_t RxAllNotesOff(void);	// Local Note Off for held RX notes 
+
+	// System Exclusive, payload without 0xF0/0xF7 framing
+	TxStatus SendSysEx(const uint8_t *data, size_t len);
+
+	// Re-encode a decoded message, send bytes as they are 
+	TxStatus SendEvent(const MidiEvent &ev, uint16_t param = 0);
+	TxStatus SendRaw(const uint8_t *data, size_t len);
+
+	// MIDI Thru / merge into another port 
+	enum class ThruMode {
+		OFF,
+		SOFT,	// Raw bytes, single input 
+		MERGE	// Message aware, several inputs into one output 
+	};
+	void SetThru(SerialMidi *out, ThruMode mode = ThruMode::SOFT);
+
+	// Batched transmission
+	void BatchedTx(bool enable);
+	void Flush(void);
+
+	// Running status optimizer, Note Off as Note On velocity 0 
+	void OptimizeTx(bool enable);
+
+	// Full status byte at least every timeout_ms, 0 = off 
+	void RunningStatusRefresh(uint32_t timeout_ms);
+
+	// Suppress repeated CC/pitch wheel values, optional rate limit
+	void ControllerCache(bool enable, uint32_t min_interval_ms = 0);
+	void ServiceControllers(void);
+
+	// Non-blocking transmission
+	void NonBlockingTx(bool enable, TxPolicy policy = TxPolicy::DROP_NEWEST);
+	void ServiceTx(void);
+	size_t TxQueueDepth(void) const;	
+
+	// System Real Time messages
+	TxStatus TimingClock(void);
+	TxStatus Start(void);
+	TxStatus Continue(void);
+	TxStatus Stop(void);
+	TxStatus Active_Sensing(void);
+	TxStatus Reset(void);
+
+	// System common, beats are 16th notes 
+	TxStatus SongPosition(uint16_t beats);
+	TxStatus SongSelect(uint8_t song) {
+		return Send(SYSTEM_SONG_SELECT, song); 
+	}
+	TxStatus TimeCodeQuarterFrame(uint8_t data) {	// type << 4 | value
+		return Send(SYSTEM_TIME_CODE, data); 
+	}
+	TxStatus TuneRequest(void) {
+		return Send(SYSTEM_TUNE_REQUEST); 
+	}
+
+	// Active Sensing: send when idle, watch the input, off by default 
+	void ActiveSensing(bool send, bool watch, 
+			EventQueue *queue = mbed_highprio_event_queue());
+	void SetConnectionLostHandler(void (*handler_ptr)(void));
+
+	// Timer driven MIDI clock, 24 PPQN, bpm_x100 0 = off 
+	void ClockGenerator(uint32_t bpm_x100, 
+			EventQueue *queue = mbed_highprio_event_queue());
+	uint32_t ClockGenPosition(void) const; // MIDI clocks 
 
 	enum class State_machine {
     	RESET,
@@ -292,26 +706,678 @@ public:
 			CH16  = 15,
 	};
 
+/* ------------------------------------------------------------- */
+protected: 
+	MidiPort serial_port;
+
+	bool ParseByte(uint8_t c, MidiEvent &ev);
+	bool ParamFlush(MidiEvent &ev);
+	void ParamExpired(bool queue);
+	bool RxEventPop(MidiEvent &ev);
+	void ClockTrack(uint8_t rt, uint32_t t); 
+	void ClockSongPosition(uint16_t beats); 
+	void RxStamp(uint32_t end_us, size_t bytes_after) {
+		uint32_t t = end_us - (uint32_t)bytes_after * MIDI_BYTE_TIME_US; 
+		if(rx_irq_hint && (int32_t)(t - rx_irq_us) < 0) {
+			t = rx_irq_us; 
+		}
+		rx_parse_us = t; 
+	}
+	void RxDone(const MidiEvent &ev, uint32_t end_us, size_t bytes_after) {
+		// Every decoded message, parser context 
+		RxStamp(end_us, bytes_after); 
+		MIDI_STAT(stats.rx_messages[MidiStatIndex(ev.status)]++); 
+		if(ev.status >= 0xF8) {
+			ClockTrack(ev.status, rx_parse_us); 
+			if(ev.status == RT_ACTIVE_SENSING) {
+				rx_sense_seen = true; 
+			}
+		}
+#if MIDI_NOTE_TRACKER
+		NoteTrack(rx_notes, ev.status, ev.channel, ev.data1, ev.data2); 
+#endif
+	}
+	void RxStampDirect(void) {
+		// Parsed and delivered in the same context 
+		rx_timestamp = rx_parse_us; 
+		rx_param = rx_param_parse; 
+	}
+	void RxBlock(const uint8_t *data, size_t len, uint32_t end_us) {
+		MIDI_STAT(stats.rx_bytes += len); 
+#if MIDI_RX_PARAMETERS
+		rx_block_us = end_us; 
+#endif
+		if(sense_watch) {
+			// Arrival of the last byte, not the parse time 
+			rx_last_us = end_us; 
+		}
+		if(rx_trace) {
+			rx_trace->Record(data, len, end_us); 
+		}
+		ThruRaw(data, len); 
+	}
+	// RX context work without a received byte: lost input, expired MSB 
+	void RxService(bool queue) {
+		// Input lost, flagged by the sense ticker 
+		if(rx_sense_lost.load(std::memory_order_acquire) && 
+				rx_sense_lost.exchange(false)) {
+			SenseLost(queue); 
+		}
+#if MIDI_RX_PARAMETERS
+		// A held MSB whose LSB did not follow in time, bytes still in 
+		// the FIFO are parsed first 
+		if(rx_hold && (uint32_t)(MIDI_TIMESTAMP() - rx_hold_us) >= 
+				MIDI_RX_PARAM_HOLD_US && !serial_port.readable()) {
+			ParamExpired(queue); 
+		}
+#endif
+	}
+	bool RxNextHeld(MidiEvent &ev); 
+	/**
+	 * The parse loop of SerialMidi and SerialMidiT, take(ev) gets every
+	 * decoded message and returns false when it was dropped.  returns 
+	 * the number of messages taken. 
+	 */
+	template <class Take>
+	size_t ParseWith(const uint8_t *data, size_t len, uint32_t end_us, 
+			Take take) {
+		size_t taken = 0; 
+		MidiEvent ev; 
+		RxBlock(data, len, end_us); 
+		// A status byte that ended a SysEx is parsed again (rx_reparse) 
+		for(size_t i = 0; i < len; i += !rx_reparse) {
+			if(!ParseByte(data[i], ev)) {
+				continue; 
+			}
+			RxDone(ev, end_us, len - 1 - i); 
+			ThruEvent(ev); 
+			taken += take(ev); 
+		}
+		return taken; 
+	}
+	/**
+	 * One read() of up to MIDI_RX_BLOCK_SIZE bytes handed to 
+	 * parse(data, len, end_us).  The DMA backend hands out the received 
+	 * span of its ring instead, no copy. 
+	 */
+	template <class Parse>
+	size_t ReadWith(Parse parse) {
+#if MIDI_UART_DMA
+		// Parsed in place in the DMA ring, a block at most so the events
+		// fit in the event ring 
+		const uint8_t *data; 
+		size_t len = serial_port.ReadSpan(data); 
+		if(len == 0) {
+			return 0; 
+		}
+		if(len > MIDI_RX_BLOCK_SIZE) {
+			len = MIDI_RX_BLOCK_SIZE; 
+		}
+		size_t taken = parse(data, len, MIDI_TIMESTAMP()); 
+		serial_port.Consume(len); 
+		return taken; 
+#else
+		uint8_t buf[MIDI_RX_BLOCK_SIZE];
+		ssize_t len = serial_port.read(buf, sizeof(buf));
+		return (len > 0) ? parse(buf, (size_t)len, MIDI_TIMESTAMP()) : 0; 
+#endif
+	}
+	// Events delivered by the base class, set by SerialMidiT to reach its
+	// handler 
+	void (*rx_deliver_hook)(SerialMidi *midi, const MidiEvent &ev); 
+	// Status byte that ended a SysEx, the parse loop feeds it again 
+	bool rx_reparse; 
+#if MIDI_NOTE_TRACKER
+	/** Active notes, bit (key & 31) of word [channel][key >> 5] */
+	typedef uint32_t NoteBits[16][4]; 
+	static void NoteTrack(NoteBits &notes, uint8_t type, uint8_t channel, 
+			uint8_t data1, uint8_t data2) {
+		uint32_t *word = &notes[channel & 0x0F][(data1 >> 5) & 3]; 
+		uint32_t bit = 1u << (data1 & 31); 
+		switch(type) {
+		case C_NOTE_ON:
+			if(data2) {
+				*word |= bit; 
+			}
+			else {
+				*word &= ~bit; 
+			}
+			break; 
+		case C_NOTE_OFF:
+			*word &= ~bit; 
+			break; 
+		case C_CONTROL_CHANGE:
+			if(data1 == CTL_ALL_NOTES_OFF || data1 == CTL_ALL_SOUNDS_OFF) {
+				memset(notes[channel & 0x0F], 0, sizeof(notes[0])); 
+			}
+			break; 
+		case RT_RESET:
+			memset(notes, 0, sizeof(notes)); 
+			break; 
+		}
+	}
+#endif
+	void ThruRaw(const uint8_t *data, size_t len) {
+		if(thru_mode == ThruMode::SOFT) {
+			thru_port->SendRaw(data, len); 
+		}
+	}
+	void ThruEvent(const MidiEvent &ev) {
+		if(thru_mode == ThruMode::MERGE) {
+			thru_port->SendEvent(ev, rx_param_parse); 
+		}
+	}
+
 /* ------------------------------------------------------------- */
 private: 
+	struct DelegateHandler;
+
+	void Init(void);
+	void Deliver(const MidiEvent &ev);
+	void DeliverNow(const MidiEvent &ev);
+	bool RxTake(const MidiEvent &ev, bool queue);
+	bool ChannelPass(uint8_t status) const;
+	bool SysExChunk(MidiEvent &ev, uint8_t flags);
+	bool SysExAcquire(void);
+	bool ParamAssemble(MidiEvent &ev);
+	void ParamValue(MidiEvent &ev, uint8_t controller, uint16_t value);
+	void DeliverSysEx(const MidiEvent &ev);
+	size_t ReadBlock(bool queue);
+	size_t ParseBlock(const uint8_t *data, size_t len, uint32_t end_us, 
+			bool queue);
+	void RxIrq(void);
+	void RxDeferred(void);
+	bool RxEventsPending(void) const;
+	bool RxEventPush(const MidiEvent &ev, uint32_t timestamp);
+	TxStatus SendChannelMessage(uint8_t status, uint8_t data1, uint8_t data2, 
+			uint8_t data_len);
+	TxStatus TxReserve(size_t len);
+	TxStatus SendControlSequence(uint8_t channel, const uint8_t *pairs, 
+			uint8_t count);
+	TxStatus SendParameter(uint8_t channel, bool nrpn, uint16_t number, 
+			uint16_t val);
+	void TxControlTrack(uint8_t channel, uint8_t ctl, uint8_t val);
+	void TxControlReset(uint8_t channel);
+	void Transmit(const uint8_t *buf, size_t len);
+	void TxConsume(size_t n);
+	static void TxTrackByte(uint8_t c, uint8_t &status, uint8_t &phase);
+	void FlushBlocking(void);
+	void TxBatchRoom(size_t len);
+	void OptimizeBatch(void);
+	void RunningStatusExpired(void);
+	uint8_t TxRunningStatus(void);
+	TxStatus CacheUpdate(uint16_t slot, bool changed);
+	void CacheSent(uint16_t slot, TxStatus st);
+	void CacheTrack(uint16_t slot, uint16_t val);
+	bool ReplaceQueuedControlChange(uint8_t status, uint8_t controller, 
+			uint8_t val);
+	ssize_t PortWrite(const void *buf, size_t len);
+	void TxHighWater(void);
+	TxStatus SendRealtime(uint8_t c);
+	bool RtQueuePush(uint8_t c);
+	void ServiceRt(uint32_t now);
+	void RtDeferred(void);
+	void ClockTick(void);
+	void RtDefer(EventQueue *queue);
+	static void SenseTick(void);
+	void SenseCheck(uint32_t now);
+	void SenseLost(bool queue);
+	void SenseDeliver(const MidiEvent &ev, bool queue);
+	void ClockArm(void);
+	void TxWireAdd(uint32_t now, size_t n);
+
 	void (*midi_note_on_delegate)(uint8_t note, uint8_t velocity);
 	void (*realtime_handler_delegate)(uint8_t msg);
     void (*midi_note_off_delegate)(uint8_t note, uint8_t velocity);
 	void (*midi_control_change_delegate)(uint8_t controller, uint8_t value);
 	void (*midi_pitchwheel_delegate)(uint8_t valueLSB, uint8_t valueMSB); 
 	
-	BufferedSerial serial_port;
 
 	/** Required to be able to process MIDI data.
 	 *  while keeping running state. 
  	 */
-	uint8_t global_running_status_tx;
+	volatile uint8_t global_running_status_tx;
 	uint8_t global_running_status_rx;
 	uint8_t global_3rd_byte_flag;
 	uint8_t global_midi_c2;
 	uint8_t global_midi_c3;
 	//uint8_t global_midi_state;
 	State_machine global_state;	// Reference the enum Class 
+	uint16_t rx_channel_mask;
+	bool rx_channel_pass;	// Channel of the running status passes the mask
+	uint8_t rx_channel;	// Channel of the message being delivered
+
+	/** RX timestamps: rx_parse_us parser side, rx_timestamp of the 
+	 * message being delivered/polled.  rx_irq_us: RX interrupt time, no
+	 * byte of the first block after it can be older. 
+	 */
+	uint32_t rx_parse_us;
+	uint32_t rx_timestamp;
+	volatile uint32_t rx_irq_us;
+	bool rx_irq_hint;
+
+	/** 14 bit CC / RPN / NRPN assembly, parser context.  An MSB is held
+	 * (rx_hold: its status byte, rx_hold_us: end of its block) until the
+	 * next byte shows whether its LSB follows, also across blocks. 
+	 * rx_param_parse: number of the event being parsed, rx_param: of the
+	 * one being delivered/polled. 
+	 */
+	uint16_t rx_param_parse;
+	uint16_t rx_param;
+#if MIDI_RX_PARAMETERS
+	bool rx_params;
+	uint8_t rx_hold;
+	uint8_t rx_hold_ctl;
+	uint32_t rx_hold_us;
+	uint32_t rx_block_us;
+	Timeout rx_hold_timeout;	// Interrupt mode, wakes RxDeferred() 
+	uint16_t rx_param_sel[16];	// Selected RPN/NRPN per channel
+	uint8_t rx_msb[16][32];	// Last MSB per channel/controller
+	uint16_t rx_event_param[MIDI_RX_EVENT_QUEUE_SIZE];
+#endif
+	void (*poly_aftertouch_handler_delegate)(uint8_t note, uint8_t value);
+	void (*program_change_handler_delegate)(uint8_t program);
+	void (*channel_aftertouch_handler_delegate)(uint8_t value);
+	void (*system_common_handler_delegate)(uint8_t status, uint8_t data1, 
+			uint8_t data2);
+	void (*control14_handler_delegate)(uint8_t controller, uint16_t value);
+	void (*rpn_handler_delegate)(uint16_t number, uint16_t value);
+	void (*nrpn_handler_delegate)(uint16_t number, uint16_t value);
+
+	/** Clock follower, written by the parser only.  clk_seq is odd while
+	 * an update is in progress (seqlock).  avg/var in 1/256 us. 
+	 */
+	std::atomic<uint32_t> clk_seq;
+	uint32_t clk_last_us;
+	uint32_t clk_avg_q8;
+	uint32_t clk_var;
+	int32_t clk_jmin;
+	int32_t clk_jmax;
+	uint32_t clk_song;
+	uint32_t clk_count;
+	uint8_t clk_samples;
+	bool clk_running;
+
+	/** Streaming SysEx reception into a caller supplied buffer
+	 */
+	void (*sysex_handler_delegate)(const uint8_t *data, size_t len, 
+			uint8_t flags);
+	uint8_t *rx_sysex_buf;	// Chunk being filled, caller buffer or pool block
+	size_t rx_sysex_size;
+	size_t rx_sysex_len;	// Bytes in the chunk being filled
+	const uint8_t *rx_sysex_done;	// Last completed chunk
+	size_t rx_sysex_chunk;	// Length of the last completed chunk
+	uint8_t rx_sysex_flags;
+	bool rx_sysex_user;	// Caller buffer instead of the pool
+	uint8_t rx_sysex_block;	// Pool block being filled
+#if MIDI_SYSEX_BLOCK_COUNT
+	uint8_t sysex_pool[MIDI_SYSEX_BLOCK_COUNT][MIDI_SYSEX_BLOCK_SIZE];
+	uint16_t sysex_pool_len[MIDI_SYSEX_BLOCK_COUNT];
+	std::atomic<uint32_t> sysex_pool_free;	// Bit n set: block n is free
+#endif
+
+	/** RX interrupt mode, lock-free SPSC event ring
+	 */
+	bool rx_event_mode;
+	EventQueue *rx_queue;
+	std::atomic<bool> rx_deferred_pending;
+	EventFlags rx_flags;
+	MidiEvent rx_events[MIDI_RX_EVENT_QUEUE_SIZE];
+	uint32_t rx_event_time[MIDI_RX_EVENT_QUEUE_SIZE];
+	std::atomic<uint16_t> rx_ev_head;
+	std::atomic<uint16_t> rx_ev_tail;
+
+#if MIDI_CC_CACHE
+	/** Controller cache, slot = channel * 128 + controller, pitch wheel
+	 * at 2048 + channel.  Values are the latest requested, a pending bit
+	 * means that value has not been sent yet.  sent: slot used in the 
+	 * current rate limit window. 
+	 */
+	bool cc_cache;
+	uint32_t cc_interval_us;
+	uint32_t cc_window_start;
+	uint8_t cc_last[16 * 128];
+	uint16_t pw_last[16];
+	uint32_t cc_pending[(MIDI_CC_SLOTS + 31) / 32];
+	uint32_t cc_sent[(MIDI_CC_SLOTS + 31) / 32];
+#endif
+
+#if MIDI_NOTE_TRACKER
+	/** Held notes, TX: what the receiver was told, RX: what we were told.
+	 * Written by the sending thread resp. the parser context. 
+	 */
+	NoteBits tx_notes; 
+	NoteBits rx_notes; 
+#endif
+
+#if MIDI_TX_PARAMETERS
+	/** Receiver side of 14 bit CCs (MSB << 7 | LSB) and the RPN/NRPN 
+	 * selection, 0xFFFF/0xFF unknown.  tx_sel_nrpn: bit per channel, 
+	 * the last selection sent was an NRPN. 
+	 */
+	uint16_t tx_cc14[16][32]; 
+	uint8_t tx_sel_msb[16]; 
+	uint8_t tx_sel_lsb[16]; 
+	uint16_t tx_sel_nrpn; 
+#endif
+
+	/** Running status refresh, the Ticker only raises tx_status_expired
+	 */
+	Ticker tx_status_ticker;
+	std::atomic<bool> tx_status_expired;
+
+	/** Batched/non-blocking TX block, see BatchedTx() and NonBlockingTx()
+	 * tx_queue_status/phase: running status and data byte index in 
+	 * effect before tx_buf[0].
+	 */
+	uint8_t tx_buf[MIDI_TX_BUFFER_SIZE];
+	uint16_t tx_len;
+	bool tx_batched;
+	bool tx_nonblocking;
+	bool tx_optimize;
+	TxPolicy tx_policy;
+	uint8_t tx_queue_status;
+	uint8_t tx_queue_phase;
+	uint32_t tx_wire_free_us;
+
+	/** Real-time priority lane, rt_busy: a consumer is draining it
+	 */
+	uint8_t rt_queue[MIDI_RT_QUEUE_SIZE];
+	volatile uint8_t rt_head;
+	volatile uint8_t rt_tail;
+	std::atomic<bool> rt_busy;
+
+	/** Clock generator, times in 1/65536 us (us ticker wraps in the 
+	 * upper bits).  clk_tx_interval 0: generator off. 
+	 */
+	Timeout clk_tx_timeout;
+	uint64_t clk_tx_next;
+	volatile uint64_t clk_tx_interval;
+	volatile uint32_t clk_tx_song;
+	volatile bool clk_tx_running;
+	EventQueue *clk_tx_queue;
+	std::atomic<bool> clk_tx_pending;
+
+	/** Pending SysEx stream, goes out after tx_sysex_at queued bytes
+	 */
+	const uint8_t *tx_sysex_ptr;
+	size_t tx_sysex_left;
+	size_t tx_sysex_at;
+
+	/** Runtime counters, stats_rt_bytes is written by the real-time 
+	 * lane consumer only. 
+	 */
+	MidiStats stats;
+	uint32_t stats_rt_bytes;
+
+	/** Active Sensing.  Ports with sensing on are in the sense_ports 
+	 * list walked by the shared ticker (ISR).  tx_last_us: the last byte 
+	 * out, rx_last_us: arrival of the last byte in, both MIDI_TIMESTAMP() 
+	 * like the ticker's compare.  rx_sense_lost: input lost, for the RX 
+	 * context. 
+	 */
+	static SerialMidi *sense_ports; 
+	SerialMidi *sense_next; 
+	bool sense_listed; 
+	volatile bool sense_tx; 
+	volatile bool sense_watch; 
+	volatile bool rx_sense_seen; 
+	volatile uint32_t tx_last_us; 
+	volatile uint32_t rx_last_us; 
+	std::atomic<bool> rx_sense_lost; 
+	EventQueue *sense_queue; 
+	void (*connection_lost_handler_delegate)(void);
+
+	/** RX capture, see SetTrace() 
+	 */
+	MidiTraceRecorder *rx_trace;
+
+	/** MIDI Thru / merge 
+	 */
+	SerialMidi *thru_port;
+	volatile ThruMode thru_mode;
+};
+
+
+/*-----------------------------------------------------------------------*/
+
+/** Compile time dispatch of decoded messages to a handler object. 
+ * Every handler member function is optional, calls to the ones that are
+ * not defined compile out entirely: 
+ *   void NoteOn(uint8_t channel, uint8_t note, uint8_t velocity);
+ *   void NoteOff(uint8_t channel, uint8_t note, uint8_t velocity);
+ *   void ControlChange(uint8_t channel, uint8_t controller, uint8_t value);
+ *   void PitchWheel(uint8_t channel, uint16_t value);   // 0 .. 16383
+ *   void PolyAfterTouch(uint8_t channel, uint8_t note, uint8_t value);
+ *   void ProgramChange(uint8_t channel, uint8_t program);
+ *   void ChannelAfterTouch(uint8_t channel, uint8_t value);
+ *   void SystemCommon(uint8_t status, uint8_t data1, uint8_t data2);
+ *   void ConnectionLost(void);     // Active Sensing timeout
+ *   void Control14(uint8_t channel, uint8_t controller, uint16_t value);
+ *   void Rpn(uint8_t channel, uint16_t number, uint16_t value);
+ *   void Nrpn(uint8_t channel, uint16_t number, uint16_t value);
+ *   void Realtime(uint8_t msg);
+ *   void SysEx(const uint8_t *data, size_t len, uint8_t flags);
+ */
+namespace serial_midi_detail {
+
+// Overload on int is preferred, the long one is picked by SFINAE when
+// the handler lacks the member. 
+template <class H>
+inline auto CallNoteOn(H &h, int, uint8_t ch, uint8_t note, uint8_t vel)
+	-> decltype(h.NoteOn(ch, note, vel), void()) { h.NoteOn(ch, note, vel); }
+template <class H>
+inline void CallNoteOn(H &, long, uint8_t, uint8_t, uint8_t) {}
+
+template <class H>
+inline auto CallNoteOff(H &h, int, uint8_t ch, uint8_t note, uint8_t vel)
+	-> decltype(h.NoteOff(ch, note, vel), void()) { h.NoteOff(ch, note, vel); }
+template <class H>
+inline void CallNoteOff(H &, long, uint8_t, uint8_t, uint8_t) {}
+
+template <class H>
+inline auto CallControlChange(H &h, int, uint8_t ch, uint8_t ctl, uint8_t val)
+	-> decltype(h.ControlChange(ch, ctl, val), void()) { h.ControlChange(ch, ctl, val); }
+template <class H>
+inline void CallControlChange(H &, long, uint8_t, uint8_t, uint8_t) {}
+
+template <class H>
+inline auto CallPitchWheel(H &h, int, uint8_t ch, uint16_t val)
+	-> decltype(h.PitchWheel(ch, val), void()) { h.PitchWheel(ch, val); }
+template <class H>
+inline void CallPitchWheel(H &, long, uint8_t, uint16_t) {}
+
+template <class H>
+inline auto CallPolyAfterTouch(H &h, int, uint8_t ch, uint8_t note, uint8_t val)
+	-> decltype(h.PolyAfterTouch(ch, note, val), void()) { h.PolyAfterTouch(ch, note, val); }
+template <class H>
+inline void CallPolyAfterTouch(H &, long, uint8_t, uint8_t, uint8_t) {}
+
+template <class H>
+inline auto CallProgramChange(H &h, int, uint8_t ch, uint8_t program)
+	-> decltype(h.ProgramChange(ch, program), void()) { h.ProgramChange(ch, program); }
+template <class H>
+inline void CallProgramChange(H &, long, uint8_t, uint8_t) {}
+
+template <class H>
+inline auto CallChannelAfterTouch(H &h, int, uint8_t ch, uint8_t val)
+	-> decltype(h.ChannelAfterTouch(ch, val), void()) { h.ChannelAfterTouch(ch, val); }
+template <class H>
+inline void CallChannelAfterTouch(H &, long, uint8_t, uint8_t) {}
+
+template <class H>
+inline auto CallSystemCommon(H &h, int, uint8_t status, uint8_t d1, uint8_t d2)
+	-> decltype(h.SystemCommon(status, d1, d2), void()) { h.SystemCommon(status, d1, d2); }
+template <class H>
+inline void CallSystemCommon(H &, long, uint8_t, uint8_t, uint8_t) {}
+
+template <class H>
+inline auto CallControl14(H &h, int, uint8_t ch, uint8_t ctl, uint16_t val)
+	-> decltype(h.Control14(ch, ctl, val), void()) { h.Control14(ch, ctl, val); }
+template <class H>
+inline void CallControl14(H &, long, uint8_t, uint8_t, uint16_t) {}
+
+template <class H>
+inline auto CallRpn(H &h, int, uint8_t ch, uint16_t num, uint16_t val)
+	-> decltype(h.Rpn(ch, num, val), void()) { h.Rpn(ch, num, val); }
+template <class H>
+inline void CallRpn(H &, long, uint8_t, uint16_t, uint16_t) {}
+
+template <class H>
+inline auto CallNrpn(H &h, int, uint8_t ch, uint16_t num, uint16_t val)
+	-> decltype(h.Nrpn(ch, num, val), void()) { h.Nrpn(ch, num, val); }
+template <class H>
+inline void CallNrpn(H &, long, uint8_t, uint16_t, uint16_t) {}
+
+template <class H>
+inline auto CallConnectionLost(H &h, int)
+	-> decltype(h.ConnectionLost(), void()) { h.ConnectionLost(); }
+template <class H>
+inline void CallConnectionLost(H &, long) {}
+
+template <class H>
+inline auto CallRealtime(H &h, int, uint8_t msg)
+	-> decltype(h.Realtime(msg), void()) { h.Realtime(msg); }
+template <class H>
+inline void CallRealtime(H &, long, uint8_t) {}
+
+template <class H>
+inline auto CallSysEx(H &h, int, const uint8_t *data, size_t len, uint8_t flags)
+	-> decltype(h.SysEx(data, len, flags), void()) { h.SysEx(data, len, flags); }
+template <class H>
+inline void CallSysEx(H &, long, const uint8_t *, size_t, uint8_t) {}
+
+template <class H>
+inline void Dispatch(H &h, const MidiEvent &ev, uint16_t param = 0)
+{
+	switch(ev.status) {
+	case C_NOTE_ON:
+		CallNoteOn(h, 0, ev.channel, ev.data1, ev.data2); 
+		break; 
+	case C_NOTE_OFF:
+		CallNoteOff(h, 0, ev.channel, ev.data1, ev.data2); 
+		break; 
+	case C_CONTROL_CHANGE:
+		CallControlChange(h, 0, ev.channel, ev.data1, ev.data2); 
+		break; 
+	case C_POLYPHONIC_AFTERTOUCH:
+		CallPolyAfterTouch(h, 0, ev.channel, ev.data1, ev.data2); 
+		break; 
+	case C_PROGRAM_CHANGE:
+		CallProgramChange(h, 0, ev.channel, ev.data1); 
+		break; 
+	case C_CHANNEL_AFTERTOUCH:
+		CallChannelAfterTouch(h, 0, ev.channel, ev.data1); 
+		break; 
+	case SYSTEM_TIME_CODE:
+	case SYSTEM_SONG_POSITION:
+	case SYSTEM_SONG_SELECT:
+	case SYSTEM_TUNE_REQUEST:
+		CallSystemCommon(h, 0, ev.status, ev.data1, ev.data2); 
+		break; 
+	case C_PITCH_WHEEL:
+		CallPitchWheel(h, 0, ev.channel, 
+				(uint16_t)(ev.data1 | (ev.data2 << 7))); 
+		break; 
+	case MIDI_CC14:
+		CallControl14(h, 0, ev.channel, (uint8_t)param, 
+				(uint16_t)(ev.data1 | (ev.data2 << 7))); 
+		break; 
+	case MIDI_PARAMETER:
+		if(param & MIDI_PARAM_NRPN) {
+			CallNrpn(h, 0, ev.channel, param & MIDI_PARAM_NULL, 
+					(uint16_t)(ev.data1 | (ev.data2 << 7))); 
+		}
+		else {
+			CallRpn(h, 0, ev.channel, param, 
+					(uint16_t)(ev.data1 | (ev.data2 << 7))); 
+		}
+		break; 
+	case RT_ACTIVE_SENSING:
+		if(ev.data1 == MIDI_SENSE_LOST) {
+			CallConnectionLost(h, 0); 
+		}
+		else {
+			CallRealtime(h, 0, ev.status); 
+		}
+		break; 
+	default:
+		if(ev.status >= 0xF8) {
+			CallRealtime(h, 0, ev.status); 
+		}
+		break; 
+	}
+}
+
+} // namespace serial_midi_detail
+
+
+/** SerialMidiT, SerialMidi with the handler type as compile time
+ * parameter instead of pointers to functions.  The handler calls are 
+ * inlined into the parse loop of Parse() and ReceiveParserBlock(), the 
+ * messages of ReceiveParser(), DispatchEvents() and RxAllNotesOff() reach
+ * the handler through one indirect call. 
+ *
+ *  Example:
+ *  @code
+ * struct Synth {
+ *	void NoteOn(uint8_t channel, uint8_t note, uint8_t velocity) { ... }
+ *	void NoteOff(uint8_t channel, uint8_t note, uint8_t velocity) { ... }
+ * }; 
+ * Synth synth; 
+ * SerialMidiT<Synth> serialMidiGlob(synth); 
+ *
+ * int main(void) {
+ *    while (true) {
+ *		serialMidiGlob.ReceiveParserBlock();
+ *	} 
+ * } 
+ * @endcode
+ */
+template <class Handler>
+class SerialMidiT : public SerialMidi {
+public: 
+	SerialMidiT(Handler &h, PinName tx = USART_TX, PinName rx = USART_RX) 
+		: SerialMidi(tx, rx), handler(h) {
+		rx_deliver_hook = &SerialMidiT::DeliverHook; 
+	}
+
+	size_t ReceiveParserBlock(void) {
+		RxService(false); 
+		return ReadWith([this](const uint8_t *data, size_t len, 
+				uint32_t end_us) { return Parse(data, len, end_us); }); 
+	}
+
+	size_t Parse(const uint8_t *data, size_t len) {
+		return Parse(data, len, MIDI_TIMESTAMP()); 
+	}
+
+	size_t Parse(const uint8_t *data, size_t len, uint32_t end_us) {
+		return ParseWith(data, len, end_us, [this](const MidiEvent &ev) {
+			RxStampDirect(); 
+			Handle(ev); 
+			return true; 
+		}); 
+	}
+
+private: 
+	static void DeliverHook(SerialMidi *midi, const MidiEvent &ev) {
+		static_cast<SerialMidiT *>(midi)->Handle(ev); 
+	}
+
+	void Handle(const MidiEvent &ev) {
+		if(ev.status == SYSTEM_EXCLUSIVE_START) {
+			size_t len; 
+			const uint8_t *data = SysExData(ev, len); 
+			serial_midi_detail::CallSysEx(handler, 0, data, len, ev.data1); 
+			ReleaseSysEx(ev); 
+		}
+		else {
+			serial_midi_detail::Dispatch(handler, ev, RxParameter()); 
+		}
+	}
+
+	Handler &handler; 
 };
 
 #endif /* _SERIAL_USART_MIDI */
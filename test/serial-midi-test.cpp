@@ -0,0 +1,1228 @@
+/*
+Copyright (c) 2014 - 2020, Jan-Willem Smaal <usenet@gispen.org>
+SPDX-License-Identifier: Apache-2.0
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+
+You may obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied.
+
+See the License for the specific language governing permissions and limitations under the License.
+*/
+
+/** SerialMidi host tests
+ * Runs the parser and the TX paths against the host shim and checks the
+ * bytes on the "wire" and the decoded messages. 
+ *
+ * cd test && make run     (builds with -DSERIAL_MIDI_HOST)
+ */
+#include "serial-midi.h"
+#include "midi-route.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static int failures;
+
+#define CHECK(cond) do { \
+		if(!(cond)) { \
+			printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while(0)
+
+
+/** Access to the host wire 
+ */
+class TestMidi : public SerialMidi {
+public:
+	using SerialMidi::SerialMidi;
+	TestMidi() : SerialMidi(USART_TX, USART_RX) {
+		serial_port.host_capture = true; 
+	}
+	std::vector<uint8_t> &Wire(void) {
+		return serial_port.host_tx; 
+	}
+	void Feed(const uint8_t *data, size_t len) {
+		serial_port.HostFeed(data, len); 
+	}
+	bool Readable(void) {
+		return serial_port.readable(); 
+	}
+};
+
+static bool WireIs(TestMidi &midi, std::vector<uint8_t> expect)
+{
+	bool same = midi.Wire() == expect; 
+	if(!same) {
+		printf("  wire:"); 
+		for(uint8_t c : midi.Wire()) {
+			printf(" %02X", c); 
+		}
+		printf("\n"); 
+	}
+	midi.Wire().clear(); 
+	return same; 
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** Non-blocking TX 
+ */
+
+/* Calls ServiceTx() with time moving on a byte time per call */
+static void DrainTx(TestMidi &midi)
+{
+	for(int i = 0; i < 64 && midi.TxQueueDepth(); i++) {
+		host_us_offset() += MIDI_BYTE_TIME_US; 
+		midi.ServiceTx(); 
+	}
+}
+
+static void TestNonBlockingDrain(void)
+{
+	TestMidi midi; 
+
+	// Enabled when the clock is past 2^31 us 
+	host_us_offset() = 3402132839u; 
+	midi.NonBlockingTx(true); 
+	midi.ControlChange(0, 7, 100); 
+	midi.NoteON(0, 60, 100); 
+	DrainTx(midi); 
+	CHECK(midi.TxQueueDepth() == 0); 
+	CHECK(WireIs(midi, { 0xB0, 7, 100, 0x90, 60, 100 })); 
+
+	// An idle gap longer than 2^31 us 
+	host_us_offset() += 0x80001000u; 
+	midi.ControlChange(0, 7, 101); 
+	DrainTx(midi); 
+	CHECK(midi.TxQueueDepth() == 0); 
+	CHECK(WireIs(midi, { 0xB0, 7, 101 })); 
+	host_us_offset() = 0; 
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** Parser, status table and running status 
+ */
+
+/* Messages a receiver decodes from bytes */
+static std::vector<MidiEvent> Decode(const std::vector<uint8_t> &wire)
+{
+	TestMidi rx; 
+	std::vector<MidiEvent> got; 
+	MidiEvent ev; 
+
+	rx.Feed(wire.data(), wire.size()); 
+	for(;;) {
+		if(rx.Poll(ev)) {
+			got.push_back(ev); 
+		}
+		else if(!rx.Readable()) {
+			break; 
+		}
+	}
+	return got; 
+}
+
+static bool EventIs(const MidiEvent &ev, uint8_t status, uint8_t channel, 
+		uint8_t data1, uint8_t data2)
+{
+	return ev.status == status && ev.channel == channel && 
+		ev.data1 == data1 && ev.data2 == data2; 
+}
+
+/* Polls until all input is parsed, SysEx payload follows its flags */
+static std::vector<uint8_t> PollAll(TestMidi &midi)
+{
+	std::vector<uint8_t> got; 
+	MidiEvent ev; 
+
+	for(;;) {
+		if(!midi.Poll(ev)) {
+			if(!midi.Readable()) {
+				break; 
+			}
+			continue; 
+		}
+		got.push_back(ev.status); 
+		if(ev.status == SYSTEM_EXCLUSIVE_START) {
+			size_t len; 
+			const uint8_t *data = midi.SysExData(ev, len); 
+			got.push_back(ev.data1); 
+			got.insert(got.end(), data, data + len); 
+			midi.ReleaseSysEx(ev); 
+		}
+	}
+	return got; 
+}
+
+static void TestParseRunningStatus(void)
+{
+	// Running status, a Note On with velocity 0 is a Note Off 
+	std::vector<MidiEvent> got = Decode({ 0x91, 60, 100, 62, 100, 60, 0 }); 
+	CHECK(got.size() == 3 && EventIs(got[0], C_NOTE_ON, 1, 60, 100) && 
+		EventIs(got[1], C_NOTE_ON, 1, 62, 100) && 
+		EventIs(got[2], C_NOTE_OFF, 1, 60, 0)); 
+
+	// One data byte messages 
+	got = Decode({ 0xC2, 5, 6, 0xD3, 70 }); 
+	CHECK(got.size() == 3 && EventIs(got[0], C_PROGRAM_CHANGE, 2, 5, 0) && 
+		EventIs(got[1], C_PROGRAM_CHANGE, 2, 6, 0) && 
+		EventIs(got[2], C_CHANNEL_AFTERTOUCH, 3, 70, 0)); 
+
+	// Real-time inside a message does not disturb it 
+	got = Decode({ 0xB0, 7, 0xF8, 100, 0xFA, 8, 101 }); 
+	CHECK(got.size() == 4 && EventIs(got[0], RT_TIMING_CLOCK, 0, 0, 0) && 
+		EventIs(got[1], C_CONTROL_CHANGE, 0, 7, 100) && 
+		EventIs(got[2], RT_START, 0, 0, 0) && 
+		EventIs(got[3], C_CONTROL_CHANGE, 0, 8, 101)); 
+
+	// A message split over two reads 
+	TestMidi midi; 
+	static const uint8_t first[] = { 0x92, 60 }; 
+	static const uint8_t second[] = { 100, 61, 100 }; 
+	midi.Feed(first, sizeof(first)); 
+	CHECK(PollAll(midi).empty()); 
+	midi.Feed(second, sizeof(second)); 
+	CHECK(PollAll(midi) == std::vector<uint8_t>({ C_NOTE_ON, C_NOTE_ON })); 
+}
+
+static void TestParseSystemCommon(void)
+{
+	// System common ends the running status, the data bytes after it 
+	// are ignored 
+	std::vector<MidiEvent> got = Decode({ 0x90, 60, 100, 0xF3, 5, 62, 100 }); 
+	CHECK(got.size() == 2 && EventIs(got[0], C_NOTE_ON, 0, 60, 100) && 
+		EventIs(got[1], SYSTEM_SONG_SELECT, 0, 5, 0)); 
+
+	got = Decode({ 0xF2, 0x10, 0x02, 0xF1, 0x35, 0xF6, 0x40 }); 
+	CHECK(got.size() == 3 && EventIs(got[0], SYSTEM_SONG_POSITION, 0, 0x10, 0x02) && 
+		EventIs(got[1], SYSTEM_TIME_CODE, 0, 0x35, 0) && 
+		EventIs(got[2], SYSTEM_TUNE_REQUEST, 0, 0, 0)); 
+
+	// Data without status, undefined status bytes and an incomplete 
+	// message are dropped, the parser picks up at the next status 
+	got = Decode({ 60, 100, 0xF4, 1, 0xF5, 0x90, 60, 0xB0, 7, 100 }); 
+	CHECK(got.size() == 1 && EventIs(got[0], C_CONTROL_CHANGE, 0, 7, 100)); 
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** Batched TX and the running status optimizer 
+ */
+
+static void TestOptimizeBatch(void)
+{
+	TestMidi midi; 
+
+	midi.BatchedTx(true); 
+	midi.OptimizeTx(true); 
+
+	// Regrouped per channel, the Note Off rides on the Note On status 
+	midi.NoteON(0, 60, 100); 
+	midi.NoteON(1, 62, 100); 
+	midi.NoteON(0, 64, 100); 
+	midi.NoteOFF(1, 62, 64); 
+	midi.Flush(); 
+	CHECK(WireIs(midi, { 0x90, 60, 100, 64, 100, 0x91, 62, 100, 62, 0 })); 
+
+	// The running status carries over to the next batch 
+	midi.NoteON(1, 65, 100); 
+	midi.NoteOFF(0, 60, 64); 
+	midi.Flush(); 
+	CHECK(WireIs(midi, { 65, 100, 0x80, 60, 64 })); 
+
+	// Without the optimizer the batch goes out as queued 
+	midi.OptimizeTx(false); 
+	midi.NoteON(2, 60, 100); 
+	midi.NoteON(3, 60, 100); 
+	midi.NoteON(2, 61, 100); 
+	midi.Flush(); 
+	CHECK(WireIs(midi, { 0x92, 60, 100, 0x93, 60, 100, 0x92, 61, 100 })); 
+}
+
+static void TestOptimizeBatchAutoFlush(void)
+{
+	TestMidi midi; 
+
+	midi.BatchedTx(true); 
+	midi.OptimizeTx(true); 
+	midi.NoteON(1, 60, 100); 
+	midi.NoteON(2, 61, 100); 
+	midi.NoteON(1, 62, 100); 
+	// Fill the batch with channel 1, the last note does not fit 
+	for(uint8_t k = 0; midi.TxQueueDepth() + 2 <= MIDI_TX_BUFFER_SIZE; k++) {
+		midi.NoteON(1, 63 + (k & 15), 100); 
+	}
+	size_t queued = 3 + (midi.TxQueueDepth() - 9) / 2; 
+	midi.NoteON(1, 100, 101); 
+	midi.Flush(); 
+
+	// The auto flushed batch ends on channel 2, the last note needs its
+	// status byte again 
+	const std::vector<uint8_t> &wire = midi.Wire(); 
+	CHECK(wire.size() > 6 && std::vector<uint8_t>(wire.end() - 6, wire.end()) == 
+		std::vector<uint8_t>({ 0x92, 61, 100, 0x91, 100, 101 })); 
+	std::vector<MidiEvent> got = Decode(wire); 
+	CHECK(got.size() == queued + 1); 
+	size_t ch2 = 0; 
+	for(const MidiEvent &ev : got) {
+		ch2 += (ev.channel == 2); 
+	}
+	CHECK(ch2 == 1); 
+	CHECK(!got.empty() && EventIs(got.back(), C_NOTE_ON, 1, 100, 101)); 
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** Thru and merge 
+ */
+
+static void TestThruSoft(void)
+{
+	TestMidi in, out; 
+
+	// Every block raw, also what the parser drops 
+	static const uint8_t wire[] = { 0x90, 60, 100, 61, 0xF0, 1, 0xF7, 5 }; 
+	in.SetThru(&out, SerialMidi::ThruMode::SOFT); 
+	in.Feed(wire, sizeof(wire)); 
+	PollAll(in); 
+	CHECK(WireIs(out, std::vector<uint8_t>(wire, wire + sizeof(wire)))); 
+
+	// Off again 
+	in.SetThru(nullptr); 
+	in.Feed(wire, sizeof(wire)); 
+	PollAll(in); 
+	CHECK(out.Wire().empty()); 
+}
+
+static void TestThruMerge(void)
+{
+	TestMidi a, b, out; 
+
+	a.SetThru(&out, SerialMidi::ThruMode::MERGE); 
+	b.SetThru(&out, SerialMidi::ThruMode::MERGE); 
+
+	// Running status is recomputed for the merged stream 
+	static const uint8_t wire_a[] = { 0x90, 60, 100, 62, 100 }; 
+	static const uint8_t wire_b[] = { 0x90, 64, 100, 0xB1, 7, 90 }; 
+	a.Feed(wire_a, sizeof(wire_a)); 
+	PollAll(a); 
+	b.Feed(wire_b, sizeof(wire_b)); 
+	PollAll(b); 
+	CHECK(WireIs(out, { 0x90, 60, 100, 62, 100, 64, 100, 0xB1, 7, 90 })); 
+
+	// Real-time and system common pass, SysEx and filtered channels not 
+	static const uint8_t wire_c[] = { 0xF8, 0xF0, 1, 2, 0xF7, 0xF3, 4, 
+		0x92, 60, 100, 0x93, 60, 100 }; 
+	a.SetChannelMask(0x0008); 
+	a.Feed(wire_c, sizeof(wire_c)); 
+	PollAll(a); 
+	CHECK(WireIs(out, { 0xF8, 0xF3, 4, 0x93, 60, 100 })); 
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** Note tracker 
+ */
+#if MIDI_NOTE_TRACKER
+
+static std::vector<uint8_t> notes_off; 
+static SerialMidi *notes_midi; 
+
+static void NoteOffSink(uint8_t note, uint8_t velocity)
+{
+	notes_off.push_back(notes_midi->RxChannel()); 
+	notes_off.push_back(note); 
+	notes_off.push_back(velocity); 
+}
+
+static void TestNotesRx(void)
+{
+	TestMidi midi(nullptr, nullptr, NoteOffSink, nullptr, nullptr); 
+	notes_midi = &midi; 
+
+	static const uint8_t wire[] = { 0x90, 60, 100, 62, 100, 60, 0, 
+		0x91, 64, 100, 0x82, 70, 100, 0xB3, 5, 0x93, 40, 1 }; 
+	midi.Feed(wire, sizeof(wire)); 
+	while(midi.Readable()) {
+		midi.ReceiveParserBlock(); 
+	}
+	CHECK(!midi.RxNoteActive(0, 60)); 
+	CHECK(midi.RxNoteActive(0, 62)); 
+	CHECK(midi.RxNoteActive(1, 64)); 
+	CHECK(midi.RxNoteActive(3, 40)); 
+	CHECK(midi.RxNotesActive(0) == 1 && midi.RxNotesActive(2) == 0); 
+
+	// All Notes Off on channel 4 releases it in the tracker 
+	static const uint8_t off[] = { 0xB3, 123, 0 }; 
+	midi.Feed(off, sizeof(off)); 
+	midi.ReceiveParserBlock(); 
+	CHECK(!midi.RxNoteActive(3, 40)); 
+
+	// Local Note Off for the notes still held 
+	notes_off.clear(); 
+	CHECK(midi.RxAllNotesOff() == 2); 
+	CHECK(notes_off == std::vector<uint8_t>({ 0, 62, 0x40, 1, 64, 0x40 })); 
+	CHECK(midi.RxNotesActive(0) == 0 && midi.RxNotesActive(1) == 0); 
+	CHECK(midi.RxAllNotesOff() == 0); 
+}
+
+static void TestNotesTx(void)
+{
+	TestMidi midi; 
+
+	midi.NoteON(0, 60, 100); 
+	midi.NoteON(0, 61, 100); 
+	midi.NoteON(5, 90, 100); 
+	midi.NoteOFF(0, 60, 64); 
+	CHECK(midi.TxNoteActive(0, 61) && !midi.TxNoteActive(0, 60)); 
+	midi.Wire().clear(); 
+
+	// Note Off only for the held notes, on the running status of the 
+	// last one 
+	CHECK(midi.AllNotesOff(0) == SerialMidi::TxStatus::OK); 
+	CHECK(WireIs(midi, { 61, 0x40 })); 
+	CHECK(midi.Panic() == SerialMidi::TxStatus::OK); 
+	CHECK(WireIs(midi, { 0x85, 90, 0x40 })); 
+	CHECK(!midi.TxNoteActive(5, 90)); 
+	CHECK(midi.Panic() == SerialMidi::TxStatus::OK); 
+	CHECK(midi.Wire().empty()); 
+}
+
+#endif
+
+
+/*-----------------------------------------------------------------------*/
+/** Clock follower 
+ */
+
+/* Timing Clocks every interval_us from t, one byte per parse */
+static uint32_t FeedClocks(SerialMidi &midi, uint32_t t, uint32_t interval_us, 
+		int count)
+{
+	static const uint8_t clock = RT_TIMING_CLOCK; 
+	for(int i = 0; i < count; i++) {
+		t += interval_us; 
+		midi.Parse(&clock, 1, t); 
+	}
+	return t; 
+}
+
+static void TestClockFollow(void)
+{
+	TestMidi midi; 
+	MidiClockInfo info; 
+	static const uint8_t start[] = { RT_START }; 
+	static const uint8_t stop[] = { RT_STOP }; 
+	static const uint8_t song[] = { SYSTEM_SONG_POSITION, 10, 0 }; 
+
+	// 120 BPM: 24 clocks per quarter, 20833 us apart 
+	midi.Parse(start, sizeof(start), 1000); 
+	uint32_t t = FeedClocks(midi, 1000, 20833, 24); 
+	CHECK(midi.ClockInfo(info)); 
+	CHECK(info.running && info.locked); 
+	CHECK(info.clocks == 24 && info.song_position == 24); 
+	CHECK(info.interval_us == 20833); 
+	CHECK(info.tempo_bpm_x100 >= 11999 && info.tempo_bpm_x100 <= 12001); 
+	CHECK(info.jitter_min_us == 0 && info.jitter_max_us == 0); 
+
+	// Jitter of +-100 us around the interval 
+	for(int i = 0; i < 8; i++) {
+		t = FeedClocks(midi, t, (i & 1) ? 20733 : 20933, 1); 
+	}
+	CHECK(midi.ClockInfo(info)); 
+	CHECK(info.jitter_min_us < -50 && info.jitter_max_us > 50); 
+	CHECK(info.tempo_bpm_x100 >= 11950 && info.tempo_bpm_x100 <= 12050); 
+
+	// Stopped the position stays, Song Position moves it 
+	midi.Parse(stop, sizeof(stop), t); 
+	t = FeedClocks(midi, t, 20833, 3); 
+	midi.Parse(song, sizeof(song), t); 
+	CHECK(midi.ClockInfo(info)); 
+	CHECK(!info.running && info.song_position == 60 && info.clocks == 35); 
+
+	// A gap starts the tempo over 
+	t = FeedClocks(midi, t, 300000, 1); 
+	CHECK(midi.ClockInfo(info)); 
+	CHECK(!info.locked && info.tempo_bpm_x100 == 0); 
+}
+
+static void TestClockSnapshot(void)
+{
+	TestMidi midi; 
+	static const uint8_t start[] = { RT_START }; 
+	std::atomic<bool> done(false); 
+	int torn = 0; 
+	int taken = 0; 
+
+	// After Start every clock counts in clocks and song position, a 
+	// snapshot taken while the parser runs in another thread must have
+	// both the same 
+	midi.Parse(start, sizeof(start), 0); 
+	std::thread parser([&]() {
+		uint32_t t = 0; 
+		for(int i = 0; i < 2000; i++) {
+			t = FeedClocks(midi, t, 1000, 1); 
+			std::this_thread::yield(); 
+		}
+		done = true; 
+	}); 
+	while(!done) {
+		MidiClockInfo info; 
+		if(midi.ClockInfo(info)) {
+			taken++; 
+			torn += (info.song_position != info.clocks); 
+		}
+		std::this_thread::yield(); 
+	}
+	parser.join(); 
+	MidiClockInfo info; 
+	CHECK(midi.ClockInfo(info) && info.clocks == 2000); 
+	CHECK(torn == 0); 
+	CHECK(taken > 0); 
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** Active Sensing 
+ */
+
+static void TestSenseLost(void)
+{
+	TestMidi midi; 
+	MidiEvent ev; 
+
+	midi.ActiveSensing(false, true, nullptr); 
+	static const uint8_t wire[] = { RT_ACTIVE_SENSING, 0x90, 60, 100 }; 
+	midi.Feed(wire, sizeof(wire)); 
+	CHECK(PollAll(midi) == std::vector<uint8_t>({ RT_ACTIVE_SENSING, C_NOTE_ON })); 
+
+	// Not yet 
+	host_us_offset() += MIDI_SENSE_RX_TIMEOUT_MS * 1000 - 5000; 
+	host_timers_fire(); 
+	CHECK(!midi.Poll(ev)); 
+
+	// Lost: Note Off for the held note, then the lost event 
+	host_us_offset() += 5000; 
+	host_timers_fire(); 
+#if MIDI_NOTE_TRACKER
+	CHECK(midi.Poll(ev) && EventIs(ev, C_NOTE_OFF, 0, 60, 0x40)); 
+#endif
+	CHECK(midi.Poll(ev) && EventIs(ev, RT_ACTIVE_SENSING, 0, MIDI_SENSE_LOST, 0)); 
+	CHECK(!midi.Poll(ev)); 
+
+	// Only once, and only after an Active Sensing was received again 
+	host_us_offset() += MIDI_SENSE_RX_TIMEOUT_MS * 1000; 
+	host_timers_fire(); 
+	CHECK(!midi.Poll(ev)); 
+	midi.ActiveSensing(false, false, nullptr); 
+	host_us_offset() = 0; 
+}
+
+static void TestSenseSend(void)
+{
+	TestMidi midi; 
+	EventQueue queue; 
+
+	midi.ActiveSensing(true, false, &queue); 
+	midi.NoteON(0, 60, 100); 
+	midi.Wire().clear(); 
+
+	// 0xFE only after MIDI_SENSE_TX_IDLE_MS without TX 
+	host_us_offset() += MIDI_SENSE_TX_IDLE_MS * 1000 - 5000; 
+	host_timers_fire(); 
+	queue.dispatch_once(); 
+	CHECK(midi.Wire().empty()); 
+	host_us_offset() += 5000; 
+	host_timers_fire(); 
+	queue.dispatch_once(); 
+	CHECK(WireIs(midi, { RT_ACTIVE_SENSING })); 
+
+	// Sending restarts the idle time 
+	host_us_offset() += MIDI_SENSE_TX_IDLE_MS * 1000 - 5000; 
+	midi.NoteOFF(0, 60, 0); 
+	midi.Wire().clear(); 
+	host_us_offset() += 5000; 
+	host_timers_fire(); 
+	queue.dispatch_once(); 
+	CHECK(midi.Wire().empty()); 
+	midi.ActiveSensing(false, false, nullptr); 
+	host_us_offset() = 0; 
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** Controller cache 
+ */
+#if MIDI_CC_CACHE
+
+static void TestControllerCacheSend(void)
+{
+	TestMidi midi; 
+
+	midi.ControllerCache(true); 
+	CHECK(midi.ControlChange(0, 7, 100) == SerialMidi::TxStatus::OK); 
+	CHECK(midi.ControlChange(0, 7, 100) == SerialMidi::TxStatus::SUPPRESSED); 
+
+	// A value sent around the cache updates it 
+	CHECK(midi.Send(0xB0, 7, 50) == SerialMidi::TxStatus::OK); 
+	CHECK(midi.ControlChange(0, 7, 100) == SerialMidi::TxStatus::OK); 
+	CHECK(midi.ControlChange(0, 7, 100) == SerialMidi::TxStatus::SUPPRESSED); 
+	MidiEvent ev = { C_CONTROL_CHANGE, 7, 20, 1 }; 
+	CHECK(midi.SendEvent(ev) == SerialMidi::TxStatus::OK); 
+	CHECK(midi.ControlChange(1, 7, 20) == SerialMidi::TxStatus::SUPPRESSED); 
+
+	CHECK(midi.PitchWheel(2, (uint16_t)0x2000) == SerialMidi::TxStatus::OK); 
+	CHECK(midi.Send(0xE2, 0x01, 0x40) == SerialMidi::TxStatus::OK); 
+	CHECK(midi.PitchWheel(2, (uint16_t)0x2000) == SerialMidi::TxStatus::OK); 
+	CHECK(midi.Send(0xE2, 0x01, 0x40) == SerialMidi::TxStatus::OK); 
+	CHECK(midi.PitchWheel(2, (uint16_t)0x2001) == SerialMidi::TxStatus::SUPPRESSED); 
+	CHECK(WireIs(midi, { 0xB0, 7, 100, 7, 50, 7, 100, 0xB1, 7, 20, 
+		0xE2, 0x00, 0x40, 0x01, 0x40, 0x00, 0x40, 0x01, 0x40 })); 
+}
+
+#endif
+
+
+/*-----------------------------------------------------------------------*/
+/** SysEx reception 
+ */
+#if MIDI_SYSEX_BLOCK_COUNT	// Pool blocks, the SerialMidiT test follows 
+
+/* Caller buffer chunks, delivered from the parser */
+static std::vector<uint8_t> sysex_got; 
+
+static void SysExSink(const uint8_t *data, size_t len, uint8_t flags)
+{
+	sysex_got.push_back(SYSTEM_EXCLUSIVE_START); 
+	sysex_got.push_back(flags); 
+	sysex_got.insert(sysex_got.end(), data, data + len); 
+}
+
+static void TestSysExTermination(void)
+{
+	TestMidi midi; 
+
+	// A new SysEx ends the current one 
+	static const uint8_t restart[] = { 0xF0, 1, 0xF0, 2, 0xF7 }; 
+	midi.Feed(restart, sizeof(restart)); 
+	CHECK(PollAll(midi) == std::vector<uint8_t>({ 
+		0xF0, MIDI_SYSEX_BEGIN | MIDI_SYSEX_END | MIDI_SYSEX_ERROR, 1, 
+		0xF0, MIDI_SYSEX_BEGIN | MIDI_SYSEX_END, 2 })); 
+
+	// So does a tune request, it is delivered after the END 
+	static const uint8_t tune[] = { 0xF0, 1, 2, 0xF6, 0x90, 60, 100 }; 
+	midi.Feed(tune, sizeof(tune)); 
+	CHECK(PollAll(midi) == std::vector<uint8_t>({ 
+		0xF0, MIDI_SYSEX_BEGIN | MIDI_SYSEX_END | MIDI_SYSEX_ERROR, 1, 2, 
+		0xF6, 0x90 })); 
+}
+
+static void TestSysExBufferSwitch(void)
+{
+	TestMidi midi; 
+	uint8_t buf[8]; 
+
+	// Switching mid-message gives the pool block back 
+	static const uint8_t head[] = { 0xF0, 1, 2 }; 
+	static const uint8_t tail[] = { 3, 0xF7 }; 
+	midi.SetSysExHandler(SysExSink); 
+	midi.Feed(head, sizeof(head)); 
+	CHECK(PollAll(midi).empty()); 
+	midi.SetSysExBuffer(buf, sizeof(buf)); 
+	midi.Feed(tail, sizeof(tail)); 
+	CHECK(PollAll(midi).empty()); 
+	CHECK(sysex_got == std::vector<uint8_t>({ 
+		0xF0, MIDI_SYSEX_BEGIN | MIDI_SYSEX_END | MIDI_SYSEX_ERROR, 3 })); 
+	midi.SetSysExBuffer(nullptr, 0); 
+
+	// All blocks are free again, hold them all 
+	std::vector<uint8_t> dump(MIDI_SYSEX_BLOCK_COUNT * MIDI_SYSEX_BLOCK_SIZE + 2, 0x55); 
+	dump.front() = 0xF0; 
+	dump.back() = 0xF7; 
+	midi.Feed(dump.data(), dump.size()); 
+	MidiEvent ev[MIDI_SYSEX_BLOCK_COUNT + 1]; 
+	size_t n = 0; 
+	for(int i = 0; i < 16 && n < MIDI_SYSEX_BLOCK_COUNT + 1; i++) {
+		n += midi.PollMany(ev + n, MIDI_SYSEX_BLOCK_COUNT + 1 - n); 
+	}
+	CHECK(n == MIDI_SYSEX_BLOCK_COUNT + 1); 
+	for(size_t i = 0; i < n; i++) {
+		size_t len; 
+		midi.SysExData(ev[i], len); 
+		CHECK(!(ev[i].data1 & MIDI_SYSEX_ERROR)); 
+		CHECK(len == ((i < MIDI_SYSEX_BLOCK_COUNT) ? MIDI_SYSEX_BLOCK_SIZE : 0)); 
+		midi.ReleaseSysEx(ev[i]); 
+	}
+}
+
+#endif
+
+/* SerialMidiT handler, records the SysEx chunks */
+struct SysExRecorder {
+	std::vector<uint8_t> got; 
+	void SysEx(const uint8_t *data, size_t len, uint8_t flags) {
+		got.push_back(flags); 
+		got.insert(got.end(), data, data + len); 
+	}
+};
+
+template <class Handler>
+class TestMidiT : public SerialMidiT<Handler> {
+public:
+	TestMidiT(Handler &h) : SerialMidiT<Handler>(h) {}
+	void Feed(const uint8_t *data, size_t len) {
+		this->serial_port.HostFeed(data, len); 
+	}
+	bool Readable(void) {
+		return this->serial_port.readable(); 
+	}
+};
+
+static void TestSysExHandlerT(void)
+{
+	static const uint8_t msg[] = { 0xF0, 1, 2, 3, 0xF7 }; 
+	const std::vector<uint8_t> expect = { 
+		MIDI_SYSEX_BEGIN | MIDI_SYSEX_END, 1, 2, 3 }; 
+	SysExRecorder rec; 
+	TestMidiT<SysExRecorder> midi(rec); 
+	EventQueue queue; 
+	uint8_t buf[8]; 
+	MidiEvent ev; 
+
+	// Caller buffer chunks reach the handler in RX interrupt mode ... 
+	midi.SetSysExBuffer(buf, sizeof(buf)); 
+	midi.Feed(msg, sizeof(msg)); 
+	midi.EnableRxInterrupt(&queue); 
+	queue.dispatch_once(); 
+	CHECK(rec.got == expect); 
+
+	// ... and with Poll() 
+	midi.DisableRxInterrupt(); 
+	rec.got.clear(); 
+	midi.Feed(msg, sizeof(msg)); 
+	CHECK(!midi.Poll(ev)); 
+	CHECK(rec.got == expect); 
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** SerialMidiT dispatch 
+ */
+
+/* SerialMidiT handler, one entry per call: the status, then the arguments */
+struct CallLog {
+	SerialMidi *midi; 
+	std::vector<std::vector<unsigned>> calls; 
+	uint32_t note_on_us; 
+	void NoteOn(uint8_t channel, uint8_t note, uint8_t velocity) {
+		calls.push_back({ C_NOTE_ON, channel, note, velocity }); 
+		note_on_us = midi->RxTimestamp(); 
+	}
+	void NoteOff(uint8_t channel, uint8_t note, uint8_t velocity) {
+		calls.push_back({ C_NOTE_OFF, channel, note, velocity }); 
+	}
+	void ControlChange(uint8_t channel, uint8_t controller, uint8_t value) {
+		calls.push_back({ C_CONTROL_CHANGE, channel, controller, value }); 
+	}
+	void PolyAfterTouch(uint8_t channel, uint8_t note, uint8_t value) {
+		calls.push_back({ C_POLYPHONIC_AFTERTOUCH, channel, note, value }); 
+	}
+	void ProgramChange(uint8_t channel, uint8_t program) {
+		calls.push_back({ C_PROGRAM_CHANGE, channel, program }); 
+	}
+	void ChannelAfterTouch(uint8_t channel, uint8_t value) {
+		calls.push_back({ C_CHANNEL_AFTERTOUCH, channel, value }); 
+	}
+	void PitchWheel(uint8_t channel, uint16_t value) {
+		calls.push_back({ C_PITCH_WHEEL, channel, value }); 
+	}
+	void SystemCommon(uint8_t status, uint8_t data1, uint8_t data2) {
+		calls.push_back({ status, data1, data2 }); 
+	}
+	void Realtime(uint8_t msg) {
+		calls.push_back({ msg }); 
+	}
+};
+
+/* Only the members it has are called */
+struct NoteOnCount {
+	unsigned count; 
+	void NoteOn(uint8_t, uint8_t, uint8_t) {
+		count++; 
+	}
+};
+
+static void TestDispatchT(void)
+{
+	static const uint8_t wire[] = { 0x91, 60, 100, 0x81, 60, 64, 
+		0xB2, 64, 127, 0xA3, 60, 50, 0xC4, 5, 0xD5, 70, 0xE6, 0x00, 0x40, 
+		0xF3, 7, 0xF8, 0xF6 }; 
+	const std::vector<std::vector<unsigned>> expect = { 
+		{ C_NOTE_ON, 1, 60, 100 }, { C_NOTE_OFF, 1, 60, 64 }, 
+		{ C_CONTROL_CHANGE, 2, 64, 127 }, { C_POLYPHONIC_AFTERTOUCH, 3, 60, 50 }, 
+		{ C_PROGRAM_CHANGE, 4, 5 }, { C_CHANNEL_AFTERTOUCH, 5, 70 }, 
+		{ C_PITCH_WHEEL, 6, 0x2000 }, { SYSTEM_SONG_SELECT, 7, 0 }, 
+		{ RT_TIMING_CLOCK }, { SYSTEM_TUNE_REQUEST, 0, 0 } }; 
+	CallLog log; 
+	TestMidiT<CallLog> midi(log); 
+	SerialMidi &base = midi; 
+	EventQueue queue; 
+	log.midi = &midi; 
+
+	// Inlined in Parse(), with the back-dated arrival time 
+	CHECK(midi.Parse(wire, sizeof(wire), 100000) == expect.size()); 
+	CHECK(log.calls == expect); 
+	CHECK(log.note_on_us == 100000 - (sizeof(wire) - 3) * MIDI_BYTE_TIME_US); 
+
+	// ... and in ReceiveParserBlock() 
+	log.calls.clear(); 
+	midi.Feed(wire, sizeof(wire)); 
+	CHECK(midi.ReceiveParserBlock() == expect.size()); 
+	CHECK(log.calls == expect); 
+
+	// The base class paths reach the handler through the hook 
+	log.calls.clear(); 
+	midi.Feed(wire, sizeof(wire)); 
+	while(midi.Readable()) {
+		base.ReceiveParser(); 
+	}
+	CHECK(log.calls == expect); 
+
+	log.calls.clear(); 
+	midi.EnableRxInterrupt(&queue); 
+	midi.Feed(wire, sizeof(wire)); 
+	queue.dispatch_once(); 
+	CHECK(log.calls.empty()); 
+	CHECK(base.DispatchEvents() == expect.size()); 
+	CHECK(log.calls == expect); 
+	midi.DisableRxInterrupt(); 
+
+#if MIDI_NOTE_TRACKER
+	static const uint8_t held[] = { 0x90, 60, 100, 62, 100 }; 
+	midi.Parse(held, sizeof(held)); 
+	log.calls.clear(); 
+	CHECK(base.RxAllNotesOff() == 2); 
+	CHECK(log.calls == std::vector<std::vector<unsigned>>({ 
+		{ C_NOTE_OFF, 0, 60, 0x40 }, { C_NOTE_OFF, 0, 62, 0x40 } })); 
+#endif
+
+	NoteOnCount count = { 0 }; 
+	TestMidiT<NoteOnCount> only(count); 
+	CHECK(only.Parse(wire, sizeof(wire)) == expect.size()); 
+	CHECK(count.count == 1); 
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** 14 bit controllers and RPN/NRPN on RX 
+ */
+#if MIDI_RX_PARAMETERS
+
+static std::vector<uint16_t> cc14_got; 
+
+static void Control14Sink(uint8_t controller, uint16_t value)
+{
+	cc14_got.push_back(controller); 
+	cc14_got.push_back(value); 
+}
+
+static void TestParamSplitPair(void)
+{
+	TestMidi midi; 
+	MidiEvent ev; 
+
+	midi.RxParameters(true); 
+	midi.SetControl14Handler(Control14Sink); 
+
+	// MSB and LSB in two Parse() calls, one value 
+	static const uint8_t msb[] = { 0xB0, 7, 100 }; 
+	static const uint8_t lsb[] = { 39, 5 }; 
+	CHECK(midi.Parse(msb, sizeof(msb)) == 0); 
+	CHECK(midi.Parse(lsb, sizeof(lsb)) == 1); 
+	CHECK(cc14_got == std::vector<uint16_t>({ 7, (100 << 7) | 5 })); 
+
+	// One byte per read 
+	static const uint8_t pair[] = { 0xB1, 1, 64, 33, 1 }; 
+	midi.Feed(pair, sizeof(pair)); 
+	std::vector<uint8_t> got = PollAll(midi); 
+	CHECK(got == std::vector<uint8_t>({ MIDI_CC14 })); 
+
+	// An MSB without LSB goes out when the next byte is not the LSB ... 
+	static const uint8_t alone[] = { 0xB0, 7, 100, 0x90, 60, 100 }; 
+	midi.Feed(alone, sizeof(alone)); 
+	CHECK(PollAll(midi) == std::vector<uint8_t>({ MIDI_CC14, C_NOTE_ON })); 
+
+	// ... or when no byte follows in time 
+	static const uint8_t last[] = { 0xB0, 7, 101 }; 
+	midi.Feed(last, sizeof(last)); 
+	CHECK(PollAll(midi).empty()); 
+	CHECK(!midi.Poll(ev)); 
+	host_us_offset() += MIDI_RX_PARAM_HOLD_US; 
+	CHECK(midi.Poll(ev) && EventIs(ev, MIDI_CC14, 0, 0, 101)); 
+	CHECK(midi.RxParameter() == 7); 
+	host_us_offset() = 0; 
+}
+
+static void TestParamNumbers(void)
+{
+	TestMidi midi; 
+	MidiEvent ev; 
+
+	midi.RxParameters(true); 
+
+	// RPN 0 (pitch bend range) data entry MSB + LSB, parameter CCs are 
+	// not delivered 
+	static const uint8_t rpn[] = { 0xB2, 101, 0, 100, 0, 6, 2, 38, 1 }; 
+	midi.Feed(rpn, sizeof(rpn)); 
+	CHECK(midi.Poll(ev) && EventIs(ev, MIDI_PARAMETER, 2, 1, 2)); 
+	CHECK(midi.RxParameter() == 0); 
+	CHECK(!midi.Poll(ev)); 
+
+	// NRPN 0x0102, the selection is per channel 
+	static const uint8_t nrpn[] = { 0xB3, 99, 2, 98, 3, 6, 64, 38, 0, 
+		0xB2, 6, 3, 38, 0 }; 
+	midi.Feed(nrpn, sizeof(nrpn)); 
+	CHECK(midi.Poll(ev) && EventIs(ev, MIDI_PARAMETER, 3, 0, 64)); 
+	CHECK(midi.RxParameter() == (MIDI_PARAM_NRPN | (2 << 7) | 3)); 
+	CHECK(midi.Poll(ev) && EventIs(ev, MIDI_PARAMETER, 2, 0, 3)); 
+	CHECK(midi.RxParameter() == 0); 
+
+	// RPN null deselects, data entry is a plain 14 bit controller again 
+	static const uint8_t null[] = { 0xB2, 101, 127, 100, 127, 6, 9, 38, 0 }; 
+	midi.Feed(null, sizeof(null)); 
+	CHECK(midi.Poll(ev) && EventIs(ev, MIDI_CC14, 2, 0, 9)); 
+	CHECK(midi.RxParameter() == SerialMidi::CTL_MSB_DATA_ENTRY); 
+
+	// Other controllers pass as they are 
+	static const uint8_t plain[] = { 0xB2, 64, 127 }; 
+	midi.Feed(plain, sizeof(plain)); 
+	CHECK(midi.Poll(ev) && EventIs(ev, C_CONTROL_CHANGE, 2, 64, 127)); 
+}
+
+#endif
+
+
+/*-----------------------------------------------------------------------*/
+/** 14 bit controllers and RPN/NRPN on TX 
+ */
+#if MIDI_TX_PARAMETERS
+
+static void TestParamSend(void)
+{
+	TestMidi midi; 
+
+	// MSB and LSB on one status, then only what the receiver lacks 
+	CHECK(midi.ControlChange14(0, 7, (100 << 7) | 5) == SerialMidi::TxStatus::OK); 
+	CHECK(midi.ControlChange14(0, 7, (100 << 7) | 5) == 
+		SerialMidi::TxStatus::SUPPRESSED); 
+	CHECK(midi.ControlChange14(0, 7, (100 << 7) | 6) == SerialMidi::TxStatus::OK); 
+	CHECK(midi.ControlChange14(0, 7, 101 << 7) == SerialMidi::TxStatus::OK); 
+	CHECK(WireIs(midi, { 0xB0, 7, 100, 39, 5, 39, 6, 7, 101 })); 
+
+	// The parameter number only when another one is selected 
+	midi.Rpn(1, 0, 2 << 7); 
+	midi.Rpn(1, 0, (2 << 7) | 1); 
+	midi.Nrpn(1, (1 << 7) | 2, 64 << 7); 
+	midi.Nrpn(1, (1 << 7) | 3, 64 << 7); 
+	CHECK(WireIs(midi, { 0xB1, 101, 0, 100, 0, 6, 2, 38, 1, 
+		99, 1, 98, 2, 6, 64, 98, 3, 6, 64 })); 
+}
+
+#if MIDI_RX_PARAMETERS
+static void TestParamLoopback(void)
+{
+	TestMidi tx, rx; 
+	MidiEvent ev; 
+
+	rx.RxParameters(true); 
+	tx.ControlChange14(2, 1, 0x1234); 
+	tx.Nrpn(2, 0x0555, 0x0AAA); 
+	tx.Rpn(2, 0, 0x0100); 
+	rx.Feed(tx.Wire().data(), tx.Wire().size()); 
+	CHECK(rx.Poll(ev) && EventIs(ev, MIDI_CC14, 2, 0x34, 0x24)); 
+	CHECK(rx.RxParameter() == 1); 
+	CHECK(rx.Poll(ev) && EventIs(ev, MIDI_PARAMETER, 2, 0x2A, 0x15)); 
+	CHECK(rx.RxParameter() == (MIDI_PARAM_NRPN | 0x0555)); 
+	// Data entry MSB alone (LSB 0), flushed by the timeout 
+	CHECK(!rx.Poll(ev)); 
+	host_us_offset() += MIDI_RX_PARAM_HOLD_US; 
+	CHECK(rx.Poll(ev) && EventIs(ev, MIDI_PARAMETER, 2, 0, 0x02)); 
+	CHECK(rx.RxParameter() == 0); 
+	host_us_offset() = 0; 
+}
+#endif
+
+#endif
+
+
+/*-----------------------------------------------------------------------*/
+/** Trace record and replay 
+ */
+
+static std::vector<uint32_t> trace_notes; 
+static SerialMidi *trace_midi; 
+
+static void TraceNoteSink(uint8_t note, uint8_t velocity)
+{
+	trace_notes.push_back(note); 
+	trace_notes.push_back(velocity); 
+	trace_notes.push_back(trace_midi->RxTimestamp()); 
+}
+
+static void TestTraceRecord(void)
+{
+	static const uint8_t notes[] = { 0x90, 60, 100 }; 
+	static const uint8_t more[] = { 62, 100 }; 
+	uint8_t ring[32]; 
+	uint8_t out[32]; 
+	MidiTraceRecorder rec(ring, sizeof(ring)); 
+	TestMidi midi; 
+
+	// The first delta is absolute, varints least significant first 
+	midi.SetTrace(&rec); 
+	midi.Parse(notes, sizeof(notes), 1000); 
+	midi.Parse(more, sizeof(more), 3000); 
+	const std::vector<uint8_t> expect = { 
+		0xE8, 0x07, 3, 0x90, 60, 100, 0xD0, 0x0F, 2, 62, 100 }; 
+	CHECK(rec.Size() == expect.size()); 
+	size_t n = rec.Read(out, 4); 
+	n += rec.Read(out + n, sizeof(out) - n); 
+	CHECK(std::vector<uint8_t>(out, out + n) == expect); 
+	CHECK(rec.Size() == 0); 
+
+	// A record that does not fit is dropped whole, the next one carries 
+	// the delta to the last record kept and wraps around the ring 
+	uint8_t clocks[30]; 
+	memset(clocks, RT_TIMING_CLOCK, sizeof(clocks)); 
+	midi.Parse(clocks, sizeof(clocks), 4000); 
+	CHECK(rec.Dropped() == 1 && rec.Size() == 0); 
+	midi.Parse(notes, sizeof(notes), 5000); 
+	midi.Parse(notes, sizeof(notes), 5010); 
+	midi.Parse(notes, sizeof(notes), 5020); 
+	n = rec.Read(out, sizeof(out)); 
+	CHECK(std::vector<uint8_t>(out, out + n) == std::vector<uint8_t>({ 
+		0xD0, 0x0F, 3, 0x90, 60, 100, 10, 3, 0x90, 60, 100, 
+		10, 3, 0x90, 60, 100 })); 
+
+	// Clear() drops the unread trace 
+	midi.Parse(more, sizeof(more), 6000); 
+	rec.Clear(); 
+	CHECK(rec.Size() == 0 && rec.Read(out, sizeof(out)) == 0); 
+}
+
+static void TestTraceReplay(void)
+{
+	// Note On at 1000 us, running status Note On at 3000, Note Off at 3500 
+	static const uint8_t trace[] = { 
+		0xE8, 0x07, 3, 0x90, 60, 100, 
+		0xD0, 0x0F, 2, 62, 100, 
+		0xF4, 0x03, 3, 0x80, 60, 0 }; 
+	const std::vector<uint32_t> expect = { 60, 100, 1000, 62, 100, 3000 }; 
+	uint8_t ring[32]; 
+	uint8_t out[32]; 
+	MidiTraceRecorder rec(ring, sizeof(ring)); 
+	TestMidi midi(TraceNoteSink, nullptr, nullptr, nullptr, nullptr); 
+	trace_midi = &midi; 
+
+	// Speed 0: at once, with the recorded arrival times, and recording 
+	// the replay gives the trace back 
+	midi.SetTrace(&rec); 
+	MidiTracePlayer fast(trace, sizeof(trace), 0); 
+	CHECK(fast.Run(midi) == 3 && fast.Done()); 
+	CHECK(trace_notes == expect); 
+	size_t n = rec.Read(out, sizeof(out)); 
+	CHECK(std::vector<uint8_t>(out, out + n) == 
+		std::vector<uint8_t>(trace, trace + sizeof(trace))); 
+	midi.SetTrace(nullptr); 
+
+	// Original speed: the first record at once, the others when their 
+	// delta has passed on the replay clock 
+	trace_notes.clear(); 
+	host_us_offset() = 0; 
+	MidiTracePlayer paced(trace, sizeof(trace)); 
+	CHECK(paced.Service(midi) == 1); 
+	CHECK(paced.Service(midi) == 0); 
+	host_us_offset() += 2000; 
+	CHECK(paced.Service(midi) == 1); 
+	host_us_offset() += 250; 
+	CHECK(paced.Service(midi) == 0 && !paced.Done()); 
+	host_us_offset() += 250; 
+	CHECK(paced.Service(midi) == 1 && paced.Done()); 
+	CHECK(trace_notes == expect); 
+
+	// Twice as fast, the timestamps stay the recorded ones 
+	trace_notes.clear(); 
+	MidiTracePlayer twice(trace, sizeof(trace), 200); 
+	CHECK(twice.Service(midi) == 1); 
+	host_us_offset() += 1000; 
+	CHECK(twice.Service(midi) == 1); 
+	CHECK(trace_notes == expect); 
+
+	// Rewind() starts over, a corrupt record ends the replay 
+	twice.Rewind(); 
+	CHECK(!twice.Done()); 
+	MidiTracePlayer cut(trace, 8, 0); 
+	CHECK(cut.Run(midi) == 1 && cut.Done()); 
+	host_us_offset() = 0; 
+}
+
+
+/*-----------------------------------------------------------------------*/
+/** Router stages 
+ */
+
+/* ev through the stages, status 0 when dropped */
+static MidiEvent Route(std::vector<MidiRouteStage> stages, MidiEvent ev)
+{
+	if(!MidiRouteStage::Apply(stages.data(), stages.size(), ev)) {
+		ev.status = 0; 
+	}
+	return ev; 
+}
+
+static void TestRouteFilters(void)
+{
+	std::vector<MidiRouteStage> notes = { 
+		{ MidiRouteStage::TYPES, 0, 0, MIDI_ROUTE_NOTES, nullptr } }; 
+	CHECK(EventIs(Route(notes, { C_NOTE_ON, 60, 100, 0 }), C_NOTE_ON, 0, 60, 100)); 
+	CHECK(EventIs(Route(notes, { C_NOTE_OFF, 60, 0, 0 }), C_NOTE_OFF, 0, 60, 0)); 
+	CHECK(Route(notes, { C_CONTROL_CHANGE, 7, 100, 0 }).status == 0); 
+	CHECK(Route(notes, { RT_TIMING_CLOCK, 0, 0, 0 }).status == 0); 
+
+	std::vector<MidiRouteStage> params = { 
+		{ MidiRouteStage::TYPES, 0, 0, MIDI_ROUTE_PARAMETER, nullptr } }; 
+	CHECK(Route(params, { MIDI_CC14, 1, 2, 0 }).status == MIDI_CC14); 
+	CHECK(Route(params, { C_CONTROL_CHANGE, 1, 2, 0 }).status == 0); 
+
+	// Channel 2 and 10, system messages have no channel and pass 
+	std::vector<MidiRouteStage> channels = { 
+		{ MidiRouteStage::CHANNELS, 0, 0, 0x0202, nullptr } }; 
+	CHECK(Route(channels, { C_NOTE_ON, 60, 100, 1 }).status == C_NOTE_ON); 
+	CHECK(Route(channels, { MIDI_PARAMETER, 0, 2, 9 }).status == MIDI_PARAMETER); 
+	CHECK(Route(channels, { C_NOTE_ON, 60, 100, 0 }).status == 0); 
+	CHECK(Route(channels, { RT_START, 0, 0, 0 }).status == RT_START); 
+}
+
+static void TestRouteTransforms(void)
+{
+	// An octave up, notes that leave the range are dropped 
+	std::vector<MidiRouteStage> up = { 
+		{ MidiRouteStage::TRANSPOSE, 12, 0, 0, nullptr } }; 
+	CHECK(EventIs(Route(up, { C_NOTE_ON, 60, 100, 3 }), C_NOTE_ON, 3, 72, 100)); 
+	CHECK(EventIs(Route(up, { C_POLYPHONIC_AFTERTOUCH, 115, 9, 3 }), 
+		C_POLYPHONIC_AFTERTOUCH, 3, 127, 9)); 
+	CHECK(Route(up, { C_NOTE_OFF, 116, 0, 3 }).status == 0); 
+	CHECK(EventIs(Route(up, { C_CONTROL_CHANGE, 120, 0, 3 }), 
+		C_CONTROL_CHANGE, 3, 120, 0)); 
+	std::vector<MidiRouteStage> down = { 
+		{ MidiRouteStage::TRANSPOSE, (uint8_t)-24, 0, 0, nullptr } }; 
+	CHECK(EventIs(Route(down, { C_NOTE_ON, 24, 1, 0 }), C_NOTE_ON, 0, 0, 1)); 
+	CHECK(Route(down, { C_NOTE_ON, 23, 1, 0 }).status == 0); 
+
+	// Velocity curve, a Note On stays a Note On 
+	uint8_t half[128]; 
+	for(int i = 0; i < 128; i++) {
+		half[i] = (uint8_t)(i / 2); 
+	}
+	std::vector<MidiRouteStage> soft = { 
+		{ MidiRouteStage::VELOCITY, 0, 0, 0, half } }; 
+	CHECK(EventIs(Route(soft, { C_NOTE_ON, 60, 100, 0 }), C_NOTE_ON, 0, 60, 50)); 
+	CHECK(EventIs(Route(soft, { C_NOTE_ON, 60, 1, 0 }), C_NOTE_ON, 0, 60, 1)); 
+	CHECK(EventIs(Route(soft, { C_NOTE_OFF, 60, 100, 0 }), C_NOTE_OFF, 0, 60, 100)); 
+
+	// Channels 1..4 to channel 16 
+	std::vector<MidiRouteStage> map = { 
+		{ MidiRouteStage::CHANNEL_MAP, 15, 0, 0x000F, nullptr } }; 
+	CHECK(Route(map, { C_PROGRAM_CHANGE, 5, 0, 3 }).channel == 15); 
+	CHECK(Route(map, { C_PROGRAM_CHANGE, 5, 0, 4 }).channel == 4); 
+}
+
+static void TestRouteSplit(void)
+{
+	// Two routes of one keyboard: the lower half an octave up, the upper
+	// half to channel 10, in the order of the stages 
+	std::vector<MidiRouteStage> lower = { 
+		{ MidiRouteStage::KEY_RANGE, 0, 59, 0, nullptr }, 
+		{ MidiRouteStage::TRANSPOSE, 12, 0, 0, nullptr } }; 
+	std::vector<MidiRouteStage> upper = { 
+		{ MidiRouteStage::KEY_RANGE, 60, 127, 0, nullptr }, 
+		{ MidiRouteStage::CHANNEL_MAP, 9, 0, 0xFFFF, nullptr } }; 
+	CHECK(EventIs(Route(lower, { C_NOTE_ON, 59, 100, 0 }), C_NOTE_ON, 0, 71, 100)); 
+	CHECK(Route(upper, { C_NOTE_ON, 59, 100, 0 }).status == 0); 
+	CHECK(Route(lower, { C_NOTE_ON, 60, 100, 0 }).status == 0); 
+	CHECK(EventIs(Route(upper, { C_NOTE_ON, 60, 100, 0 }), C_NOTE_ON, 9, 60, 100)); 
+
+	// Non-note messages go to both 
+	CHECK(Route(lower, { C_CONTROL_CHANGE, 64, 127, 0 }).status == C_CONTROL_CHANGE); 
+	CHECK(EventIs(Route(upper, { C_CONTROL_CHANGE, 64, 127, 0 }), 
+		C_CONTROL_CHANGE, 9, 64, 127)); 
+
+	// The range is checked before the transpose moves the key 
+	std::vector<MidiRouteStage> late = { 
+		{ MidiRouteStage::TRANSPOSE, 12, 0, 0, nullptr }, 
+		{ MidiRouteStage::KEY_RANGE, 0, 59, 0, nullptr } }; 
+	CHECK(Route(late, { C_NOTE_ON, 50, 100, 0 }).status == 0); 
+}
+
+
+/*-----------------------------------------------------------------------*/
+
+int main(void)
+{
+	TestNonBlockingDrain(); 
+	TestParseRunningStatus(); 
+	TestParseSystemCommon(); 
+	TestOptimizeBatch(); 
+	TestOptimizeBatchAutoFlush(); 
+	TestThruSoft(); 
+	TestThruMerge(); 
+#if MIDI_NOTE_TRACKER
+	TestNotesRx(); 
+	TestNotesTx(); 
+#endif
+	TestClockFollow(); 
+	TestClockSnapshot(); 
+	TestSenseLost(); 
+	TestSenseSend(); 
+#if MIDI_CC_CACHE
+	TestControllerCacheSend(); 
+#endif
+#if MIDI_SYSEX_BLOCK_COUNT
+	TestSysExTermination(); 
+	TestSysExBufferSwitch(); 
+#endif
+	TestSysExHandlerT(); 
+	TestDispatchT(); 
+#if MIDI_RX_PARAMETERS
+	TestParamSplitPair(); 
+	TestParamNumbers(); 
+#endif
+#if MIDI_TX_PARAMETERS
+	TestParamSend(); 
+#if MIDI_RX_PARAMETERS
+	TestParamLoopback(); 
+#endif
+#endif
+	TestTraceRecord(); 
+	TestTraceReplay(); 
+	TestRouteFilters(); 
+	TestRouteTransforms(); 
+	TestRouteSplit(); 
+
+	if(failures) {
+		printf("%d failure(s)\n", failures); 
+		return 1; 
+	}
+	printf("all tests passed\n"); 
+	return 0; 
+}